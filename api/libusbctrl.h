@@ -55,6 +55,46 @@
 # error "architecture not yet supported!"
 #endif
 
+/*
+ * USB backend driver operations. Each context is bound to its own backend
+ * driver at declaration time (see usbctrl_declare_backend()), so that several
+ * USB IPs handled by different drivers (e.g. USB OTG FS and USB OTG HS) are
+ * driven at the same time by the same application.
+ * Fields have the same prototypes as the usb_backend_drv_*() API. The
+ * usbctrl_backend_drv_default_ops table is bound to these link-time resolved
+ * symbols, and is used by usbctrl_declare().
+ * All the fields are mandatory.
+ */
+typedef struct {
+    mbed_error_t (*declare)(void);
+    mbed_error_t (*configure)(usb_backend_drv_mode_t mode,
+                              usb_backend_drv_ioep_handler_t ieph,
+                              usb_backend_drv_ioep_handler_t oeph);
+    mbed_error_t (*activate_endpoint)(uint8_t id, usb_backend_drv_ep_dir_t dir);
+    mbed_error_t (*configure_endpoint)(uint8_t                        ep,
+                                       usb_backend_drv_ep_type_t      type,
+                                       usb_backend_drv_ep_dir_t       dir,
+                                       usb_backend_drv_epx_mpsize_t   mpsize,
+                                       usb_backend_drv_ep_toggle_t    dtoggle,
+                                       usb_backend_drv_ioep_handler_t handler);
+    mbed_error_t (*deconfigure_endpoint)(uint8_t ep);
+    usb_backend_drv_ep_state_t (*get_ep_state)(uint8_t epnum, usb_backend_drv_ep_dir_t dir);
+    mbed_error_t (*send_data)(uint8_t *src, uint32_t size, uint8_t ep);
+    mbed_error_t (*send_zlp)(uint8_t ep);
+    void         (*set_address)(uint16_t addr);
+    mbed_error_t (*set_recv_fifo)(uint8_t *dst, uint32_t size, uint8_t ep);
+    mbed_error_t (*ack)(uint8_t ep_id, usb_backend_drv_ep_dir_t dir);
+    mbed_error_t (*nak)(uint8_t ep_id, usb_backend_drv_ep_dir_t dir);
+    mbed_error_t (*stall)(uint8_t ep_id, usb_backend_drv_ep_dir_t dir);
+    mbed_error_t (*endpoint_disable)(uint8_t ep_id, usb_backend_drv_ep_dir_t dir);
+    mbed_error_t (*endpoint_enable)(uint8_t ep_id, usb_backend_drv_ep_dir_t dir);
+    uint16_t     (*get_ep_mpsize)(usb_backend_drv_ep_type_t type);
+    usb_backend_drv_port_speed_t (*get_speed)(void);
+    uint16_t     (*get_frame_number)(void);     /*< optional, may be NULL */
+} usb_backend_drv_ops_t;
+
+extern const usb_backend_drv_ops_t usbctrl_backend_drv_default_ops;
+
 
 /*********************************************************************************
  * About handlers
@@ -185,6 +225,20 @@ typedef enum {
  */
 typedef mbed_error_t (*usb_ioep_handler_t)(uint32_t dev_id, uint32_t size, uint8_t ep_id);
 
+/*
+ * OUT EP ping-pong reception handler. buf holds the size bytes received. The other
+ * ping-pong buffer is already armed when the handler is called, and buf is armed
+ * again (behind it) when the handler returns.
+ */
+typedef mbed_error_t (*usb_ioep_pingpong_handler_t)(uint32_t dev_id, uint32_t size, uint8_t ep_id, uint8_t *buf);
+
+/*
+ * Isochronous IN EP frame buffer handler. buf (size bytes, at most one EP max
+ * packet) is to be filled with the data to send in the frame after the current
+ * one. Returns the number of bytes written in buf (0: a ZLP is sent in the frame).
+ */
+typedef uint16_t (*usb_ioep_iso_fill_handler_t)(uint32_t dev_id, uint8_t ep_id, uint8_t *buf, uint16_t size);
+
 /*
  * USB Endpoint definition
  * Each Endpoint is defined by:
@@ -197,11 +251,28 @@ typedef struct {
     usb_ep_dir_t     dir;                   /* EP direction */
     usb_ep_attr_t    attr;                  /* EP attributes */
     usb_ep_usage_t   usage;                 /* EP usage */
-    uint16_t         pkt_maxsize;           /* pkt maxsize in this EP */
+    uint16_t         pkt_maxsize;           /* pkt maxsize in this EP (updated to the negotiated speed one) */
     usb_ioep_handler_t handler;             /* EP handler */
     uint8_t          ep_num;                /* EP identifier */
     uint8_t          poll_interval;         /* EP polling interval in ms (for interrupt IN EP */
     bool             configured;            /* EP enable in current config */
+    /* OUT EP ping-pong reception (optional): the libusbctrl receives the EP data
+     * alternately in two buffers, and passes each filled buffer to pingpong_handler
+     * (handler is then not called for OUT events) */
+    uint8_t         *pingpong_buf;          /* 2 * pingpong_size bytes (NULL: ping-pong disabled) */
+    uint16_t         pingpong_size;         /* size of each buffer, multiple of pkt_maxsize */
+    usb_ioep_pingpong_handler_t pingpong_handler; /* filled buffer handler */
+    /* isochronous IN EP double buffering (optional): the libusbctrl sends one
+     * pingpong_buf half per frame, and fills the other one for the next frame in
+     * the meantime, through iso_fill_handler. Feedback EPs are filled by the
+     * libusbctrl itself with iso_feedback (see usbctrl_iso_set_feedback()) */
+    usb_ioep_iso_fill_handler_t iso_fill_handler; /* frame buffer handler (NULL: feedback EP) */
+    uint32_t         iso_feedback;          /* feedback EP rate, set by libxDCI */
+    /* per-speed max packet sizes, appended last not to break upper layers
+     * positional initializers */
+    uint16_t         pkt_maxsize_fs;        /* full-speed pkt maxsize (0: derived from pkt_maxsize) */
+    uint16_t         pkt_maxsize_hs;        /* high-speed pkt maxsize (0: derived from pkt_maxsize) */
+    uint8_t          alt_setting;           /* interface alternate setting holding the EP */
 } usb_ep_infos_t;
 
 /************************************************
@@ -219,6 +290,12 @@ typedef struct {
  */
 #define MAX_EP_PER_INTERFACE 8
 
+/*
+ * A interface can have up to this number of alternate settings (including
+ * the default one, i.e. alternate setting 0).
+ */
+#define MAX_ALTSETTINGS_PER_INTERFACE 8
+
 
 /*
  * A interface may have to handle dedicated
@@ -260,6 +337,16 @@ typedef mbed_error_t
                                             uint32_t            usbdci_handler);
 
 
+/*
+ * Handler prototype for alternate setting change. Called by the libusbctrl when
+ * the host selects another alternate setting of the interface (SetInterface
+ * request), once the endpoints of the new alternate setting are configured.
+ * Can be set to NULL in the interface structure.
+ */
+typedef void     (*usb_iface_altsetting_handler_t)(uint32_t usbdci_handler,
+                                                   uint8_t  iface_id,
+                                                   uint8_t  alt_setting);
+
 /*
     cyril : *desc_size : uint8_t * et non uint32_t * : la taille max est de 256 bits
 */
@@ -292,8 +379,117 @@ typedef struct {
    /* for composite functions, requesting Interface Association Descriptor */
    bool               composite_function; /*< this interface is a part of a composite function */
    uint8_t            composite_function_id; /*< associated composite function identifier */
+   /* alternate settings (optional): each EP belongs to the alternate setting set in
+    * its alt_setting field, only the EPs of the current alternate setting are active */
+   uint8_t            alt_setting_num; /*< number of alternate settings (0 or 1: default only) */
+   uint8_t            alt_setting;    /*< current alternate setting, set by libxDCI */
+   usb_iface_altsetting_handler_t altsetting_handler; /*< alternate setting change handler */
+   /* appended last, not to break upper layers positional initializers */
+   uint8_t            cfg_id;         /*< configuration holding the interface, set by libxDCI */
 } usbctrl_interface_t;
 
+/************************************************
+ * about vendor requests
+ *
+ * Vendor requests are not associated to any
+ * interface. They are received on the default
+ * control pipe and dispatched by the libusbctrl
+ * to the upper layer handler declared for the
+ * request bRequest code (and recipient).
+ ***********************************************/
+
+/*
+ * Vendor request handler.
+ * - For device-to-host (IN) requests, the handler writes the response in data
+ *   (*data_size bytes available) and sets *data_size to the response length. The
+ *   libusbctrl sends it to the host (truncated to wLength if needed).
+ * - For host-to-device (OUT) requests, the handler is called once the data stage
+ *   (if any) is fully received. data holds *data_size bytes (NULL if wLength is 0).
+ *   The libusbctrl handles the status stage.
+ * Returning an error makes the libusbctrl stall the control pipe.
+ */
+typedef mbed_error_t     (*usb_vendor_rqst_handler_t)(uint32_t             usbdci_handler,
+                                                     usbctrl_setup_pkt_t *inpkt,
+                                                     uint8_t             *data,
+                                                     uint16_t            *data_size);
+
+typedef struct {
+   uint8_t                   bRequest;   /*< vendor request code */
+   uint8_t                   recipient;  /*< request recipient (bmRequestType bits 4..0) */
+   usb_ep_dir_t              dir;        /*< data stage direction: USB_EP_DIR_OUT (host to device) or USB_EP_DIR_IN */
+   uint16_t                  max_len;    /*< max data stage length, up to CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE */
+   usb_vendor_rqst_handler_t handler;    /*< vendor request handler */
+} usbctrl_vendor_rqst_t;
+
+/************************************************
+ * about control requests data stage
+ *
+ * The data stage of host-to-device requests
+ * targeting an interface (or one of its
+ * endpoints) can be received by the libusbctrl,
+ * across as many packets as needed, in a buffer
+ * declared by the upper layer (or in the
+ * context buffer). The upper layer is then
+ * called once, with the complete payload.
+ ***********************************************/
+
+/*
+ * Control data stage handler, called once the data stage is fully received.
+ * data holds *data_size bytes (i.e. wLength). The libusbctrl handles the status
+ * stage. Returning an error makes the libusbctrl stall the control pipe.
+ */
+typedef mbed_error_t     (*usb_rqst_data_handler_t)(uint32_t             usbdci_handler,
+                                                   usbctrl_setup_pkt_t *inpkt,
+                                                   uint8_t             *data,
+                                                   uint16_t            *data_size);
+
+/************************************************
+ * about endpoint transfers
+ *
+ * Instead of driving their endpoints through the
+ * backend driver API, upper layers can submit
+ * transfers to the libusbctrl. Each endpoint has
+ * a queue of submitted transfers: the libusbctrl
+ * sends (or receives) them one after the other,
+ * packet per packet, and calls the completion
+ * handler of each of them.
+ ***********************************************/
+
+/*
+ * Transfer completion handler. size is the amount of bytes sent (IN) or received
+ * (OUT, may be shorter than the submitted length if the host sent a short packet).
+ * cookie is the one given at submission time.
+ */
+typedef mbed_error_t     (*usbctrl_xfer_handler_t)(uint32_t  dev_id,
+                                                  uint32_t  size,
+                                                  uint8_t   ep_id,
+                                                  void     *cookie);
+
+/* IN transfers: terminate the transfer with a ZLP if its length is a multiple of the EP max packet size */
+#define USBCTRL_XFER_FLAG_ZLP 0x1
+
+/* IN transfers gather list segment (see usbctrl_submit_in_iov()) */
+typedef struct {
+    const uint8_t *base;                   /* segment start */
+    uint32_t       len;                    /* segment length */
+} usbctrl_iovec_t;
+
+/************************************************
+ * about string descriptors
+ *
+ * Beside the device manufacturer, product and serial
+ * strings (set in the configuration), upper layers
+ * can attach a string to their interface, to the
+ * composite function their interface starts, or to
+ * the configuration holding their interface.
+ ***********************************************/
+
+typedef enum {
+   USBCTRL_STRING_INTERFACE     = 0, /*< interface string (iInterface) */
+   USBCTRL_STRING_FUNCTION      = 1, /*< composite function string (iFunction) */
+   USBCTRL_STRING_CONFIGURATION = 2, /*< configuration string (iConfiguration) */
+} usbctrl_string_type_t;
+
 /*********************************************************************************
  * About Frama-C header
  * When using Frama-C, some static globals may need to be moved here instead of in
@@ -354,6 +550,21 @@ typedef struct {
 mbed_error_t usbctrl_declare(uint32_t dev_id,
                              uint32_t *ctxh);
 
+/*
+ * Same as usbctrl_declare(), the context being driven by the given backend driver
+ * (instead of the default, link-time resolved, usb_backend_drv_*() API). ops must
+ * stay valid during the whole context life. An incomplete ops table (NULL field)
+ * is rejected with MBED_ERROR_INVPARAM.
+ */
+/*@
+    @ requires \separated(ctxh+(..),&GHOST_opaque_libusbdci_privates);
+    @ assigns *ctxh, GHOST_opaque_libusbdci_privates, GHOST_num_ctx;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_declare_backend(uint32_t                     dev_id,
+                                     const usb_backend_drv_ops_t *ops,
+                                     uint32_t                    *ctxh);
+
 /*
  * create the first USB context, and create endpoint 0 for default
  * control pipe. Other EPs need to be registered by other libs (bulk, HID, and so on)
@@ -422,6 +633,189 @@ mbed_error_t usbctrl_initialize(uint32_t ctxh);
 mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
                                        __out    usbctrl_interface_t  *iface);
 
+/*
+ * declare a vendor request handler for the given context. Each (bRequest, recipient)
+ * pair can be declared once. The libusbctrl checks that the received requests
+ * match the declared direction and maximum length before calling the handler,
+ * and handles the data and status stages of the control transfer.
+ *
+ * Vendor requests must be declared before starting the device.
+ */
+/*@
+    @ requires \separated(rqst+(..),&GHOST_opaque_libusbdci_privates);
+    @ assigns GHOST_opaque_libusbdci_privates;
+
+    @ behavior bad_ctxh :
+    @   assumes ctxh >= GHOST_num_ctx ;
+    @   ensures \result == MBED_ERROR_INVPARAM ;
+
+    @ behavior invalid_rqst :
+    @   assumes ctxh < GHOST_num_ctx ;
+    @   assumes rqst == \null ;
+    @   ensures \result == MBED_ERROR_INVPARAM ;
+
+    @ behavior valid_input :
+    @   assumes ctxh < GHOST_num_ctx ;
+    @   assumes rqst != \null ;
+    @   ensures \result == MBED_ERROR_NONE ||
+                \result == MBED_ERROR_NOMEM ||
+                \result == MBED_ERROR_INVPARAM ;
+
+    @ complete behaviors;
+    @ disjoint behaviors;
+*/
+mbed_error_t usbctrl_declare_vendor_request(__in uint32_t                           ctxh,
+                                            __in usbctrl_vendor_rqst_t const * const rqst);
+
+/*
+ * declare a string descriptor for the given (already declared) interface. The string
+ * is an ASCII, NULL-terminated, string of at most CONFIG_USBCTRL_STRING_MAX_LEN
+ * characters. It is encoded once, at declaration time, and its index is set in
+ * the corresponding descriptor field depending on the string type. Declaring a
+ * string twice for the same descriptor field replaces its content.
+ *
+ * Strings must be declared before starting the device.
+ */
+/*@
+    @ requires \separated(iface+(..),string+(..),&GHOST_opaque_libusbdci_privates);
+    @ assigns GHOST_opaque_libusbdci_privates;
+
+    @ behavior bad_ctxh :
+    @   assumes ctxh >= GHOST_num_ctx ;
+    @   ensures \result == MBED_ERROR_INVPARAM ;
+
+    @ behavior invalid_input :
+    @   assumes ctxh < GHOST_num_ctx ;
+    @   assumes iface == \null || string == \null ;
+    @   ensures \result == MBED_ERROR_INVPARAM ;
+
+    @ behavior valid_input :
+    @   assumes ctxh < GHOST_num_ctx ;
+    @   assumes iface != \null && string != \null ;
+    @   ensures \result == MBED_ERROR_NONE ||
+                \result == MBED_ERROR_NOMEM ||
+                \result == MBED_ERROR_NOTFOUND ||
+                \result == MBED_ERROR_INVPARAM ;
+
+    @ complete behaviors;
+    @ disjoint behaviors;
+*/
+mbed_error_t usbctrl_declare_string(__in uint32_t                         ctxh,
+                                    __in usbctrl_interface_t const * const iface,
+                                    __in usbctrl_string_type_t             type,
+                                    __in const char                       *string);
+
+/*
+ * declare a control data stage handler for the given (already declared) interface.
+ * Host-to-device class requests (with a data stage) targeting the interface or one
+ * of its endpoints are then no more passed to the interface rqst_handler at SETUP
+ * time: the data stage is received in buf (buf_size bytes) and the handler is
+ * called with the complete payload. If buf is NULL, the context data stage buffer
+ * (CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE bytes) is used. Requests with a data stage
+ * longer than the buffer are stalled.
+ *
+ * Data stage handlers must be declared before starting the device.
+ */
+/*@
+    @ requires \separated(iface+(..),buf+(..),&GHOST_opaque_libusbdci_privates);
+    @ assigns GHOST_opaque_libusbdci_privates;
+
+    @ behavior bad_ctxh :
+    @   assumes ctxh >= GHOST_num_ctx ;
+    @   ensures \result == MBED_ERROR_INVPARAM ;
+
+    @ behavior invalid_input :
+    @   assumes ctxh < GHOST_num_ctx ;
+    @   assumes iface == \null || handler == \null ;
+    @   ensures \result == MBED_ERROR_INVPARAM ;
+
+    @ behavior valid_input :
+    @   assumes ctxh < GHOST_num_ctx ;
+    @   assumes iface != \null && handler != \null ;
+    @   ensures \result == MBED_ERROR_NONE ||
+                \result == MBED_ERROR_INVPARAM ;
+
+    @ complete behaviors;
+    @ disjoint behaviors;
+*/
+mbed_error_t usbctrl_declare_ctrl_data_handler(__in uint32_t                         ctxh,
+                                               __in usbctrl_interface_t const * const iface,
+                                               __in uint8_t                          *buf,
+                                               __in uint16_t                          buf_size,
+                                               __in usb_rqst_data_handler_t           handler);
+
+/*
+ * submit an IN (resp. OUT) transfer of len bytes on the given EP number, which must
+ * be declared by an interface of the current configuration, in the corresponding
+ * direction. The transfer is started at once if the EP queue is empty, or just
+ * after the completion of the previously submitted transfers. buf must stay valid
+ * up to the transfer completion. A zero length IN transfer is a ZLP.
+ *
+ * Transfers must be submitted from the EP events context: EP handlers, transfer
+ * completion handlers or, in deferred mode, the usbctrl_dispatch() caller task.
+ * Pending transfers are dropped when the configuration is changed or on USB reset.
+ */
+/*@
+    @ assigns GHOST_opaque_libusbdci_privates, GHOST_opaque_drv_privates;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_submit_in(__in uint32_t               ctxh,
+                               __in uint8_t                ep,
+                               __in const uint8_t         *buf,
+                               __in uint32_t               len,
+                               __in uint32_t               flags,
+                               __in usbctrl_xfer_handler_t handler,
+                               __in void                  *cookie);
+
+/*
+ * Gather IN transfer. The iovcnt segments of iov are sent in order, as a single
+ * transfer, without being copied in a staging buffer: packets are sent from the
+ * segments themselves. A packet crossing a segment boundary is gathered in a
+ * per-EP bounce buffer of CONFIG_USBCTRL_XFER_GATHER_BOUNCE_SIZE bytes, which must
+ * hold a whole EP max packet, except if all segments but the last are multiples of
+ * the EP max packet size. iov and the segments must stay valid up to the transfer
+ * completion.
+ */
+/*@
+    @ assigns GHOST_opaque_libusbdci_privates, GHOST_opaque_drv_privates;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_submit_in_iov(__in uint32_t                ctxh,
+                                   __in uint8_t                 ep,
+                                   __in const usbctrl_iovec_t  *iov,
+                                   __in uint8_t                 iovcnt,
+                                   __in uint32_t                flags,
+                                   __in usbctrl_xfer_handler_t  handler,
+                                   __in void                   *cookie);
+
+/*@
+    @ assigns GHOST_opaque_libusbdci_privates, GHOST_opaque_drv_privates;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_submit_out(__in uint32_t               ctxh,
+                                __in uint8_t                ep,
+                                __in uint8_t               *buf,
+                                __in uint32_t               len,
+                                __in uint32_t               flags,
+                                __in usbctrl_xfer_handler_t handler,
+                                __in void                  *cookie);
+
+/*
+ * Asynchronous isochronous feedback. rate is the number of samples per frame
+ * (full-speed) or per micro-frame (high-speed) the device consumes (OUT stream)
+ * or produces (IN stream), in 16.16 fixed point. It is sent to the host on the
+ * ep feedback EP (isochronous IN EP with USB_EP_USAGE_FEEDBACK usage, declared with
+ * a double buffer), with the encoding of the current port speed (10.14 on 3 bytes
+ * in full-speed, 16.16 on 4 bytes in high-speed), from the next frame buffer on.
+ */
+/*@
+    @ assigns GHOST_opaque_libusbdci_privates;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_iso_set_feedback(__in uint32_t ctxh,
+                                      __in uint8_t  ep,
+                                      __in uint32_t rate);
+
 /*
  * Effective device start.
  * bind and enable the device, initialize the communication and wait for the
@@ -470,5 +864,126 @@ mbed_error_t usbctrl_start_device(uint32_t ctxh);
 */
 mbed_error_t usbctrl_stop_device(uint32_t ctxh);
 
+/*
+ * Execute the USB driver events (SETUP packets, EP events, reset...) received since
+ * the last call, from the calling task context, for all the declared contexts.
+ *
+ * This is only required when CONFIG_USBCTRL_DEFERRED_DISPATCH is set: the driver
+ * handlers then only queue the events, which are handled here, including the upper
+ * layers requests and EP handlers. The task should call usbctrl_dispatch() each time
+ * it is woken up by the USB ISR. Otherwise, events are handled in the driver ISR
+ * context and this function does nothing.
+ *
+ * Each context has its own events queue: when several devices are handled by
+ * different tasks, each task calls usbctrl_dispatch_ctx() for its own context
+ * only, concurrently with the others.
+ */
+/*@
+  @ assigns GHOST_opaque_libusbdci_privates, GHOST_opaque_drv_privates;
+  @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_dispatch_ctx(uint32_t ctxh);
+
+/*
+ * Deferred events scheduling statistics, per context.
+ *
+ * Control plane events (bus reset, suspend, wakeup, control pipe events) are always
+ * executed before data plane events (other EPs events, i.e. upper layers EP
+ * handlers), and are checked again after each data event. Each usbctrl_dispatch_ctx()
+ * call executes at most CONFIG_USBCTRL_DISPATCH_DATA_BUDGET data events: if more are
+ * pending, it returns MBED_ERROR_BUSY and should be called again.
+ */
+typedef struct {
+    uint32_t ctrl_events;         /* executed control plane events */
+    uint32_t data_events;         /* executed data plane events */
+    uint32_t data_dropped;        /* data events received before a bus reset, dropped */
+    uint32_t ctrl_first;          /* control events executed ahead of pending data events */
+    uint32_t starved_rounds;      /* dispatch rounds ended with data events still pending */
+    uint32_t max_starved_rounds;  /* max consecutive rounds ended with data events pending */
+} usbctrl_dispatch_stats_t;
+
+/*@
+  @ assigns *stats ;
+  @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_get_dispatch_stats(uint32_t                  ctxh,
+                                        usbctrl_dispatch_stats_t *stats);
+
+/*@
+  @ assigns GHOST_opaque_libusbdci_privates, GHOST_opaque_drv_privates;
+  @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_dispatch(void);
+
+/*
+ * EP completions coalescing (CONFIG_USBCTRL_EP_EVENTS_COALESCING).
+ *
+ * In this mode, the data EPs completions (IN data sent, OUT data received) which
+ * do not belong to a submitted transfer don't call the EP handler anymore. They
+ * are only accounted per EP, so that the task handles all the ready EPs in one
+ * batch.
+ *
+ * usbctrl_wait_events() blocks (yielding the CPU) up to at least one EP of mask
+ * having pending completions, and set pending to these EPs. Each EP is a bit,
+ * see USBCTRL_EP_EVENT_IN()/USBCTRL_EP_EVENT_OUT(). In deferred mode, it also
+ * dispatches the received USB events.
+ * usbctrl_get_ep_events() collects the number of completions and the amount of
+ * bytes sent or received on the given EP since the previous call, clearing its
+ * pending state.
+ * Without CONFIG_USBCTRL_EP_EVENTS_COALESCING, both return MBED_ERROR_UNSUPORTED_CMD.
+ */
+#define USBCTRL_EP_EVENT_OUT(ep) ((uint32_t)1 << ((ep) & 0xf))
+#define USBCTRL_EP_EVENT_IN(ep)  ((uint32_t)1 << (16 + ((ep) & 0xf)))
+
+/*@
+  @ assigns *pending, GHOST_opaque_libusbdci_privates, GHOST_opaque_drv_privates;
+  @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_wait_events(uint32_t  ctxh,
+                                 uint32_t  mask,
+                                 uint32_t *pending);
+
+/*@
+  @ assigns *count, *size, GHOST_opaque_libusbdci_privates;
+  @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_get_ep_events(uint32_t      ctxh,
+                                   uint8_t       ep,
+                                   usb_ep_dir_t  dir,
+                                   uint32_t     *count,
+                                   uint32_t     *size);
+
+/*
+ * Bus frames.
+ *
+ * usbctrl_get_frame_number() returns the frame number (11 bits) of the last
+ * Start-Of-Frame received by the device, as counted by the backend driver, or
+ * MBED_ERROR_UNSUPORTED_CMD if the backend driver has no frame counter.
+ *
+ * With CONFIG_USBCTRL_SOF_HOOK, usbctrl_register_sof_handler() declares a handler
+ * called every divisor SOF (frames in full-speed, micro-frames in high-speed), with
+ * the frame number of the SOF that triggered it. It is executed in the USB events
+ * context, like the EP handlers (driver ISR, or usbctrl_dispatch() caller in deferred
+ * mode), and is expected to prepare the periodic transfers of the next frames.
+ * A NULL handler unregisters the hook. Without CONFIG_USBCTRL_SOF_HOOK,
+ * usbctrl_register_sof_handler() returns MBED_ERROR_UNSUPORTED_CMD.
+ */
+typedef void (*usbctrl_sof_handler_t)(uint32_t dev_id, uint16_t frame);
+
+/*@
+  @ assigns *frame, GHOST_opaque_drv_privates;
+  @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_get_frame_number(uint32_t  ctxh,
+                                      uint16_t *frame);
+
+/*@
+  @ assigns GHOST_opaque_libusbdci_privates;
+  @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_register_sof_handler(uint32_t              ctxh,
+                                          usbctrl_sof_handler_t handler,
+                                          uint16_t              divisor);
+
 
 #endif/*!LIBUSBCTRL_H_*/
@@ -31,6 +31,9 @@
 
 #define usb_backend_drv_declare usbotghs_declare
 #define usb_backend_drv_get_speed usbotghs_get_speed
+#if CONFIG_USBCTRL_BACKEND_FRAME_NUMBER
+#define usb_backend_drv_get_frame_number usbotghs_get_frame_number
+#endif
 #define usb_backend_drv_stall usbotghs_endpoint_stall
 #define usb_backend_drv_send_data usbotghs_send_data
 #define usb_backend_drv_ack usbotghs_endpoint_clear_nak
@@ -60,10 +60,11 @@
  * Abstraction layer for the STM32F4 USB OTG HS driver
  * Here, only preprocessing usage is enough.
  *
- * TODO: by now, abstraction is mutually exclusive for multiple backend IP.
- * The goal is to allow the usage of per-context, independent IP handling,
- * even for the same application. The libctrl API is enough for that
- * (device ID is passed to handler and associated to each context).
+ * The symbols below are the default backend. Each context can be bound to another
+ * backend driver, through its own operations table (see usb_backend_drv_ops_t and
+ * usbctrl_declare_backend()), so that several IPs are handled independently by
+ * the same application (device ID is passed to handler and associated to each
+ * context).
  */
 
 /*
@@ -192,4 +193,9 @@ uint16_t usb_backend_drv_get_ep_mpsize(usb_backend_drv_ep_type_t type);
 
 usb_backend_drv_port_speed_t usb_backend_drv_get_speed(void);
 
+#if CONFIG_USBCTRL_BACKEND_FRAME_NUMBER
+/* frame number of the last received SOF (11 bits) */
+uint16_t usb_backend_drv_get_frame_number(void);
+#endif
+
 #endif/*!USBCTRL_BACKEND_H_*/
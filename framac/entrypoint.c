@@ -245,7 +245,7 @@ void test_fcn_usbctrl(){
     //        functions that use both contexts
     ////////////////////////////////////////////////
 
-    ctx_list[0].ctrl_req_processing = true;  // to reach a state with EVA
+    ctx_list[0].ctrl_phase = USBCTRL_CTRL_PHASE_DATA_IN;  // to reach a state with EVA
     usbctrl_handle_inepevent(dev_id, size, ep);
 
 
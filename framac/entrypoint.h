@@ -64,6 +64,17 @@ mbed_error_t class_rqst_handler(uint32_t usbxdci_handler,
 
 mbed_error_t handler_ep(uint32_t dev_id, uint32_t size, uint8_t ep_id);
 
+/*@
+    @ requires \valid(packet) && \valid(data_size);
+    @ assigns *data_size, data[0 .. *data_size - 1] ;
+    @ ensures is_valid_error(\result);
+*/
+
+mbed_error_t vendor_rqst_handler(uint32_t usbxdci_handler,
+                                 usbctrl_setup_pkt_t *packet,
+                                 uint8_t *data,
+                                 uint16_t *data_size);
+
 void test_fcn_driver_eva(void) ;
 
 void framac_state_manipulator(usbctrl_context_t *ctx);
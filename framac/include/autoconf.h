@@ -331,4 +331,14 @@
 #define CONFIG_USBCTRL_MAX_CTX 2
 #define CONFIG_USR_LIB_USBCTRL_DEV_VENDORID 0xDEAD
 #define CONFIG_USBCTRL_EP0_FIFO_SIZE 128
+#define CONFIG_USBCTRL_SETUP_RING_SIZE 4
+#define CONFIG_USBCTRL_XFER_QUEUE_DEPTH 2
+#define CONFIG_USBCTRL_XFER_GATHER_BOUNCE_SIZE 64
+#define CONFIG_USBCTRL_MAX_VENDOR_RQST 4
+#define CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE 256
+#define CONFIG_USBCTRL_MAX_STRINGS 8
+#define CONFIG_USBCTRL_STRING_MAX_LEN 64
+#define CONFIG_USBCTRL_MAX_CFG_DESC_LEN 512
+#define CONFIG_USBCTRL_BACKEND_FRAME_NUMBER 1
 #define CONFIG_USR_LIB_USBCTRL_STRICT_USB_CONFORMITY 1
+#define CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE 1
@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+#
+# libxDCI build-time descriptor compiler.
+#
+# This tool reads the SDK Kconfig output (.config) and a static interface manifest
+# (JSON) describing the device configurations, and generates a C source file holding
+# the device, configuration (including IAD, interface, class and endpoint descriptors)
+# and string descriptors as const, flash resident, byte arrays.
+#
+# The generated descriptors follow the exact same layout as the one forged at runtime
+# by usbctrl_descriptors.c, so that the runtime and build-time paths are interchangeable.
+#
+# Manifest format:
+#
+# {
+#   "strings": { "4": "my function name" },
+#   "configurations": [
+#     {
+#       "string_index": 0,                   (optional, iConfiguration)
+#       "interfaces": [
+#         {
+#           "class": 8, "subclass": 6, "protocol": 80,
+#           "string_index": 0,               (optional, iInterface)
+#           "composite_function_id": 0,      (optional, composite functions only)
+#           "function_string_index": 4,      (optional, iFunction)
+#           "class_desc": "09 21 11 01 00 01 22 3f 00",  (optional, hex bytes)
+#           "alt_setting_num": 2,            (optional, alternate settings number)
+#           "endpoints": [
+#             { "num": 1, "dir": "in", "type": "bulk", "mpsize": 512, "interval": 0 },
+#             { "num": 2, "dir": "both", "type": "interrupt", "mpsize": 64, "interval": 4,
+#               "attr": 0, "usage": 0, "alt_setting": 1 }
+#           ]
+#         }
+#       ]
+#     }
+#   ]
+# }
+#
+# The "interval" field is the raw bInterval value, for the target port speed.
+# The "mpsize" field is the max packet size for the target port speed too: build-time
+# descriptors are not adapted to the speed negotiated with the host.
+# The control pipe max packet size is always 64 (full-speed and high-speed): low-speed
+# ports are not supported with build-time descriptors.
+# Each alternate setting has its own interface descriptor, followed by the descriptors
+# of the endpoints holding its "alt_setting" value (default 0). The class descriptor
+# follows the default alternate setting interface descriptor.
+# String indexes must match the ones the strings are declared with at runtime
+# (usbctrl_declare_string() resolves declared strings by content in the table).
+#
+
+import argparse
+import json
+import sys
+
+MAX_CFG_DESCRIPTOR_LEN = 256   # default CONFIG_USBCTRL_MAX_CFG_DESC_LEN
+
+USB_DESC_DEVICE = 0x01
+USB_DESC_CONFIGURATION = 0x02
+USB_DESC_STRING = 0x03
+USB_DESC_INTERFACE = 0x04
+USB_DESC_ENDPOINT = 0x05
+USB_DESC_IAD = 0x0B
+
+LANGUAGE_ENGLISH = 0x0409
+
+EP_TYPES = {"control": 0x0, "isochronous": 0x1, "bulk": 0x2, "interrupt": 0x3}
+EP_DIRS = ("in", "out", "both")
+
+
+def die(msg):
+    sys.stderr.write("usbctrl_gendesc: error: %s\n" % msg)
+    sys.exit(1)
+
+
+def u16(val):
+    return [val & 0xff, (val >> 8) & 0xff]
+
+
+def parse_kconfig(path):
+    """Parse a Kconfig .config file into a dict of CONFIG_* values"""
+    config = {}
+    with open(path, "r") as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("CONFIG_") or "=" not in line:
+                continue
+            key, val = line.split("=", 1)
+            if val.startswith('"') and val.endswith('"'):
+                val = val[1:-1].encode().decode("unicode_escape")
+            config[key] = val
+    return config
+
+
+def kconfig_int(config, key):
+    if key not in config:
+        die("%s is not set in Kconfig" % key)
+    return int(config[key], 0)
+
+
+def kconfig_str(config, key):
+    if key not in config:
+        die("%s is not set in Kconfig" % key)
+    return config[key]
+
+
+def device_desc(config, mode, cfg_num):
+    if "CONFIG_USR_LIB_USBCTRL_DIFFERENCIATE_DFU_FW_BUILD" in config and mode == "fw":
+        pid = kconfig_int(config, "CONFIG_USR_LIB_USBCTRL_FW_DEV_PRODUCTID")
+    else:
+        pid = kconfig_int(config, "CONFIG_USR_LIB_USBCTRL_DFU_DEV_PRODUCTID")
+    desc = [18, USB_DESC_DEVICE]
+    desc += u16(0x0200)     # bcdUSB: USB 2.0
+    desc += [0, 0, 0]       # class, subclass, protocol: replaced by interfaces
+    desc += [64]            # EP0 max packet size
+    desc += u16(kconfig_int(config, "CONFIG_USR_LIB_USBCTRL_DEV_VENDORID"))
+    desc += u16(pid)
+    desc += u16(0x0000)     # bcdDevice
+    desc += [kconfig_int(config, "CONFIG_USB_DEV_MANUFACTURER_INDEX"),
+             kconfig_int(config, "CONFIG_USB_DEV_PRODNAME_INDEX"),
+             kconfig_int(config, "CONFIG_USB_DEV_SERIAL_INDEX"),
+             cfg_num]
+    return desc
+
+
+def ep_descs(ep):
+    if ep.get("dir") not in EP_DIRS:
+        die("invalid EP direction %s" % ep.get("dir"))
+    if ep.get("type") not in EP_TYPES:
+        die("invalid EP type %s" % ep.get("type"))
+    ep_type = EP_TYPES[ep["type"]]
+    if ep_type == EP_TYPES["control"]:
+        # Control EP (EP0 usage) are not declared in configuration descriptor
+        return []
+    num = int(ep["num"])
+    if num <= 0 or num > 15:
+        die("invalid EP number %d" % num)
+    attrs = ep_type | (int(ep.get("attr", 0)) << 2) | (int(ep.get("usage", 0)) << 4)
+    interval = int(ep.get("interval", 0)) if ep_type == EP_TYPES["interrupt"] else 0
+    descs = []
+    # full duplex EP: IN EP descriptor first, then OUT
+    for d in ("in", "out"):
+        if ep["dir"] in (d, "both"):
+            addr = num | 0x80 if d == "in" else num
+            descs.append([7, USB_DESC_ENDPOINT, addr, attrs] + u16(int(ep["mpsize"])) + [interval])
+    return descs
+
+
+def configuration_desc(cfg, max_len):
+    ifaces = cfg.get("interfaces", [])
+    body = []
+    composite_id = None
+    for iface_id, iface in enumerate(ifaces):
+        func = iface.get("composite_function_id")
+        if func is not None and func != composite_id:
+            # new composite function: new IAD, using the master interface class
+            count = len([i for i in ifaces[iface_id:] if i.get("composite_function_id") == func])
+            body += [8, USB_DESC_IAD, iface_id, count,
+                     iface["class"], iface.get("subclass", 0), iface.get("protocol", 0),
+                     iface.get("function_string_index", 0)]
+        composite_id = func
+        alt_num = max(int(iface.get("alt_setting_num", 1)), 1)
+        for ep in iface.get("endpoints", []):
+            if int(ep.get("alt_setting", 0)) >= alt_num:
+                die("invalid EP alternate setting %s" % ep.get("alt_setting"))
+        for alt in range(alt_num):
+            eps = []
+            for ep in iface.get("endpoints", []):
+                if int(ep.get("alt_setting", 0)) == alt:
+                    eps += ep_descs(ep)
+            body += [9, USB_DESC_INTERFACE, iface_id, alt, len(eps),
+                     iface["class"], iface.get("subclass", 0), iface.get("protocol", 0),
+                     iface.get("string_index", 0)]
+            if alt == 0:
+                body += [int(b, 16) for b in iface.get("class_desc", "").split()]
+            for ep in eps:
+                body += ep
+    total = 9 + len(body)
+    if total >= max_len:
+        die("configuration descriptor too long (%d bytes, max %d)" % (total, max_len))
+    # bmAttributes: reserved bit 7 set, self-powered, no remote wakeup
+    header = [9, USB_DESC_CONFIGURATION] + u16(total) + [len(ifaces), 1, cfg.get("string_index", 0), 0xc0, 0]
+    return header + body
+
+
+def string_desc(string):
+    data = string.encode("utf-16-le")
+    if len(data) + 2 > 255:
+        die("string '%s' too long" % string)
+    return [len(data) + 2, USB_DESC_STRING] + list(data)
+
+
+def string_descs(config, manifest):
+    strings = {
+        kconfig_int(config, "CONFIG_USB_DEV_MANUFACTURER_INDEX"): kconfig_str(config, "CONFIG_USB_DEV_MANUFACTURER"),
+        kconfig_int(config, "CONFIG_USB_DEV_PRODNAME_INDEX"): kconfig_str(config, "CONFIG_USB_DEV_PRODNAME"),
+        kconfig_int(config, "CONFIG_USB_DEV_SERIAL_INDEX"): kconfig_str(config, "CONFIG_USB_DEV_SERIAL"),
+    }
+    for idx, string in manifest.get("strings", {}).items():
+        if int(idx) == 0 or int(idx) >= 255:
+            die("invalid string index %s" % idx)
+        strings[int(idx)] = string
+    table = [None] * (max(strings.keys()) + 1)
+    table[0] = [4, USB_DESC_STRING] + u16(LANGUAGE_ENGLISH)
+    for idx, string in strings.items():
+        table[idx] = string_desc(string)
+    return table
+
+
+def c_array(name, data):
+    lines = ["static const uint8_t %s[%d] = {" % (name, len(data))]
+    for i in range(0, len(data), 12):
+        lines.append("    " + " ".join("0x%02x," % b for b in data[i:i + 12]))
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def generate(config, manifest, mode):
+    cfgs = manifest.get("configurations", [])
+    if len(cfgs) == 0:
+        die("manifest declares no configuration")
+    out = ["/*",
+           " * Generated by tools/usbctrl_gendesc.py, do not edit.",
+           " * libxDCI build-time descriptors (%s mode)" % mode,
+           " */",
+           '#include "autoconf.h"',
+           '#include "libc/types.h"',
+           '#include "usbctrl_static_desc.h"',
+           ""]
+    out.append(c_array("dev_desc", device_desc(config, mode, len(cfgs))))
+    out.append("")
+    out.append("const usbctrl_static_desc_t usbctrl_static_dev_desc = { dev_desc, 18 };")
+    out.append("")
+    max_len = int(config.get("CONFIG_USBCTRL_MAX_CFG_DESC_LEN", str(MAX_CFG_DESCRIPTOR_LEN)), 0)
+    cfg_descs = [configuration_desc(c, max_len) for c in cfgs]
+    for i, desc in enumerate(cfg_descs):
+        out.append(c_array("cfg_desc_%d" % i, desc))
+        out.append("")
+    out.append("const usbctrl_static_desc_t usbctrl_static_cfg_desc[%d] = {" % len(cfg_descs))
+    for i, desc in enumerate(cfg_descs):
+        out.append("    { cfg_desc_%d, %d }," % (i, len(desc)))
+    out.append("};")
+    out.append("const uint8_t usbctrl_static_cfg_desc_num = %d;" % len(cfg_descs))
+    out.append("")
+    strings = string_descs(config, manifest)
+    for i, desc in enumerate(strings):
+        if desc is not None:
+            out.append(c_array("string_desc_%d" % i, desc))
+            out.append("")
+    out.append("const usbctrl_static_desc_t usbctrl_static_string_desc[%d] = {" % len(strings))
+    for i, desc in enumerate(strings):
+        if desc is None:
+            out.append("    { NULL, 0 },")
+        else:
+            out.append("    { string_desc_%d, %d }," % (i, len(desc)))
+    out.append("};")
+    out.append("const uint8_t usbctrl_static_string_desc_num = %d;" % len(strings))
+    out.append("")
+    return "\n".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="libxDCI build-time descriptor compiler")
+    parser.add_argument("-c", "--config", required=True, help="Kconfig .config file")
+    parser.add_argument("-m", "--manifest", required=True, help="interface manifest (JSON)")
+    parser.add_argument("-M", "--mode", choices=("fw", "dfu"), default="fw",
+                        help="FW or DFU profile, for differenciated builds")
+    parser.add_argument("-o", "--output", required=True, help="generated C file")
+    args = parser.parse_args()
+
+    config = parse_kconfig(args.config)
+    with open(args.manifest, "r") as f:
+        manifest = json.load(f)
+    source = generate(config, manifest, args.mode)
+    with open(args.output, "w") as f:
+        f.write(source)
+
+
+if __name__ == "__main__":
+    main()
@@ -29,15 +29,20 @@
 #include "libc/string.h"
 #include "libc/sync.h"
 #include "usbctrl.h"
+#include "usbctrl_sync.h"
+#include "usbctrl_drv.h"
 #include "usbctrl_state.h"
 #include "usbctrl_handlers.h"
 #include "usbctrl_requests.h"
+#include "usbctrl_xfer.h"
+#include "usbctrl_event.h"
 #include "usbctrl_descriptors.h"
+#include "usbctrl_static_desc.h"
 
 /*
- * by now, the libusbctrl handle upto 2 USB Ctrl context,
- * which means that an application can handle up to 2 USB blocks
- * with 2 dedicated context that may completely differ.
+ * the libusbctrl handle upto CONFIG_USBCTRL_MAX_CTX USB Ctrl context,
+ * which means that an application can handle multiple USB blocks
+ * with dedicated context that may completely differ.
  *
  */
 
@@ -52,6 +57,302 @@ usbctrl_context_t ctx_list[MAX_USB_CTRL_CTX] = { 0 };
 
 #endif/*!__FRAMAC__*/
 
+/*
+ * dev_id to context resolution. Device identifiers are given by the generated
+ * device list and are not contiguous. Contexts are indexed in a small open
+ * addressing table, built at declare time and twice as large as the context
+ * list, so that the event handlers resolve their context in (nearly always)
+ * a single access, whatever the number of contexts.
+ * Each cell holds the context handle + 1, 0 meaning a free cell.
+ */
+#define USBCTRL_DEVID_MAP_SIZE (2 * MAX_USB_CTRL_CTX)
+
+static uint8_t ctx_devid_map[USBCTRL_DEVID_MAP_SIZE] = { 0 };
+
+/*@
+    @ requires ctxh < MAX_USB_CTRL_CTX ;
+    @ assigns ctx_devid_map[0 .. USBCTRL_DEVID_MAP_SIZE-1];
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+void usbctrl_devid_map_register(uint32_t dev_id, uint8_t ctxh)
+{
+    uint8_t cell = dev_id % USBCTRL_DEVID_MAP_SIZE;
+
+    /* there is always a free cell, as at most MAX_USB_CTRL_CTX contexts are
+     * declared */
+    /*@
+      @ loop invariant 0 <= i <= USBCTRL_DEVID_MAP_SIZE ;
+      @ loop invariant 0 <= cell < USBCTRL_DEVID_MAP_SIZE ;
+      @ loop assigns i, cell, ctx_devid_map[0 .. USBCTRL_DEVID_MAP_SIZE-1] ;
+      @ loop variant (USBCTRL_DEVID_MAP_SIZE - i) ;
+      */
+    for (uint8_t i = 0; i < USBCTRL_DEVID_MAP_SIZE; ++i) {
+        if (ctx_devid_map[cell] == 0) {
+            /* the context is visible from the event handlers from now on */
+            usbctrl_store_release(&(ctx_devid_map[cell]), ctxh + 1);
+            return;
+        }
+        cell = (cell + 1) % USBCTRL_DEVID_MAP_SIZE;
+    }
+}
+
+/*
+ * Endpoint table handling. The table of a given configuration is cleared when the
+ * configuration is (re)initialized and filled at interface declaration time.
+ */
+
+/*@
+    @ requires \valid(cfg);
+    @ assigns cfg->ep_table[0 .. USBCTRL_EP_TABLE_SIZE-1];
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+void usbctrl_ep_table_reset(usbctrl_configuration_t *cfg)
+{
+    /*@
+      @ loop invariant 0 <= i <= USBCTRL_EP_TABLE_SIZE ;
+      @ loop assigns i, cfg->ep_table[0 .. USBCTRL_EP_TABLE_SIZE-1] ;
+      @ loop variant (USBCTRL_EP_TABLE_SIZE - i) ;
+      */
+    for (uint8_t i = 0; i < USBCTRL_EP_TABLE_SIZE; ++i) {
+        cfg->ep_table[i].declared = false;
+        cfg->ep_table[i].iface_id = 0;
+        cfg->ep_table[i].ep_id = 0;
+        cfg->ep_table[i].handler = NULL;
+    }
+}
+
+/*@
+    @ requires \valid(cfg);
+    @ requires iface_id < MAX_INTERFACES_PER_DEVICE ;
+    @ requires ep_id < MAX_EP_PER_INTERFACE ;
+    @ requires cfg->interfaces[iface_id].eps[ep_id].ep_num < USBCTRL_MAX_EP_NUM ;
+    @ assigns cfg->ep_table[0 .. USBCTRL_EP_TABLE_SIZE-1];
+*/
+#ifndef __FRAMAC__
+static
+#endif
+void usbctrl_ep_table_register(usbctrl_configuration_t *cfg,
+                               uint8_t                  iface_id,
+                               uint8_t                  ep_id)
+{
+    usb_ep_infos_t *ep = &(cfg->interfaces[iface_id].eps[ep_id]);
+    usbctrl_ep_entry_t *entry = NULL;
+
+    /* only the EPs of the current interface alternate setting are reachable */
+    if (ep->alt_setting != cfg->interfaces[iface_id].alt_setting) {
+        return;
+    }
+    /* Full duplex EP hold both their IN and OUT address. When an address is
+     * already held (EP0 may be declared by multiple interfaces), the first
+     * declaration is kept. */
+    if (ep->dir == USB_EP_DIR_IN || ep->dir == USB_EP_DIR_BOTH) {
+        entry = &(cfg->ep_table[USBCTRL_EP_ADDR_TO_IDX(ep->ep_num | USBCTRL_EP_ADDR_DIR_IN)]);
+        if (entry->declared == false) {
+            entry->iface_id = iface_id;
+            entry->ep_id = ep_id;
+            entry->handler = ep->handler;
+            entry->declared = true;
+        }
+    }
+    if (ep->dir == USB_EP_DIR_OUT || ep->dir == USB_EP_DIR_BOTH) {
+        entry = &(cfg->ep_table[USBCTRL_EP_ADDR_TO_IDX(ep->ep_num)]);
+        if (entry->declared == false) {
+            entry->iface_id = iface_id;
+            entry->ep_id = ep_id;
+            entry->handler = ep->handler;
+            entry->declared = true;
+        }
+    }
+}
+
+/*
+ * Release the EP table entries held by the given interface. EP0 entries, shared by
+ * all interfaces, are kept unless keep_ep0 is false.
+ */
+/*@
+    @ requires \valid(cfg);
+    @ assigns cfg->ep_table[0 .. USBCTRL_EP_TABLE_SIZE-1];
+*/
+#ifndef __FRAMAC__
+static
+#endif
+void usbctrl_ep_table_release(usbctrl_configuration_t *cfg,
+                              uint8_t                  iface_id,
+                              bool                     keep_ep0)
+{
+    /*@
+      @ loop invariant 0 <= i <= USBCTRL_EP_TABLE_SIZE ;
+      @ loop assigns i, cfg->ep_table[0 .. USBCTRL_EP_TABLE_SIZE-1] ;
+      @ loop variant (USBCTRL_EP_TABLE_SIZE - i) ;
+      */
+    for (uint8_t i = 0; i < USBCTRL_EP_TABLE_SIZE; ++i) {
+        if (keep_ep0 &&
+            (i == USBCTRL_EP_ADDR_TO_IDX(0) ||
+             i == USBCTRL_EP_ADDR_TO_IDX(USBCTRL_EP_ADDR_DIR_IN))) {
+            continue;
+        }
+        if (cfg->ep_table[i].declared == true && cfg->ep_table[i].iface_id == iface_id) {
+            cfg->ep_table[i].declared = false;
+            cfg->ep_table[i].iface_id = 0;
+            cfg->ep_table[i].ep_id = 0;
+            cfg->ep_table[i].handler = NULL;
+        }
+    }
+}
+
+/*
+ * Select another alternate setting for the given interface: the EP table entries
+ * held by the interface are released, and the new alternate setting EPs registered.
+ * EP0 entries, shared by all interfaces, are kept.
+ */
+/*@
+    @ requires \valid(cfg);
+    @ requires iface_id < MAX_INTERFACES_PER_DEVICE ;
+    @ assigns cfg->ep_table[0 .. USBCTRL_EP_TABLE_SIZE-1], cfg->interfaces[iface_id].alt_setting;
+*/
+void usbctrl_ep_table_set_altsetting(usbctrl_configuration_t *cfg,
+                                     uint8_t                  iface_id,
+                                     uint8_t                  alt_setting)
+{
+    usbctrl_ep_table_release(cfg, iface_id, true);
+    cfg->interfaces[iface_id].alt_setting = alt_setting;
+    /*@
+      @ loop invariant 0 <= i <= cfg->interfaces[iface_id].usb_ep_number ;
+      @ loop assigns i, cfg->ep_table[0 .. USBCTRL_EP_TABLE_SIZE-1] ;
+      @ loop variant (cfg->interfaces[iface_id].usb_ep_number - i) ;
+      */
+    for (uint8_t i = 0; i < cfg->interfaces[iface_id].usb_ep_number; ++i) {
+        usbctrl_ep_table_register(cfg, iface_id, i);
+    }
+}
+
+/*
+ * String descriptors handling. Strings are encoded once, when declared, so that
+ * GET_DESCRIPTOR(STRING) requests only have to send the table cell content.
+ */
+
+#if !defined(CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS) && \
+    ((CONFIG_USB_DEV_MANUFACTURER_INDEX >= CONFIG_USBCTRL_MAX_STRINGS) || \
+     (CONFIG_USB_DEV_PRODNAME_INDEX >= CONFIG_USBCTRL_MAX_STRINGS) || \
+     (CONFIG_USB_DEV_SERIAL_INDEX >= CONFIG_USBCTRL_MAX_STRINGS))
+# error "device strings index must be smaller than CONFIG_USBCTRL_MAX_STRINGS"
+#endif
+
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+/*@
+    @ requires \valid(desc + (0 .. USBCTRL_STRING_DESC_SIZE-1));
+    @ requires \valid_read(string);
+    @ assigns desc[0 .. USBCTRL_STRING_DESC_SIZE-1];
+*/
+#ifndef __FRAMAC__
+static
+#endif
+void usbctrl_string_encode(uint8_t *desc, const char *string)
+{
+    uint8_t len = 0;
+
+    /* ASCII to UTF-16LE, truncated to CONFIG_USBCTRL_STRING_MAX_LEN characters */
+    /*@
+      @ loop invariant 0 <= len <= CONFIG_USBCTRL_STRING_MAX_LEN ;
+      @ loop assigns len, desc[2 .. USBCTRL_STRING_DESC_SIZE-1] ;
+      @ loop variant (CONFIG_USBCTRL_STRING_MAX_LEN - len) ;
+      */
+    while (len < CONFIG_USBCTRL_STRING_MAX_LEN && string[len] != '\0') {
+        desc[2 + 2 * len] = (uint8_t)string[len];
+        desc[2 + 2 * len + 1] = 0;
+        len++;
+    }
+    if (string[len] != '\0') {
+        log_printf("[USBCTRL] string truncated to %d chars\n", len);
+    }
+    desc[0] = (uint8_t)(2 + 2 * len);
+    desc[1] = USB_DESC_STRING;
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->strings[0 .. CONFIG_USBCTRL_MAX_STRINGS-1][0 .. USBCTRL_STRING_DESC_SIZE-1];
+*/
+#ifndef __FRAMAC__
+static
+#endif
+void usbctrl_strings_init(usbctrl_context_t *ctx)
+{
+    /*@
+      @ loop invariant 0 <= i <= CONFIG_USBCTRL_MAX_STRINGS ;
+      @ loop assigns i, ctx->strings[0 .. CONFIG_USBCTRL_MAX_STRINGS-1][0] ;
+      @ loop variant (CONFIG_USBCTRL_MAX_STRINGS - i) ;
+      */
+    for (uint8_t i = 0; i < CONFIG_USBCTRL_MAX_STRINGS; ++i) {
+        ctx->strings[i][0] = 0;
+    }
+    /* string index 0 hold the supported languages */
+    ctx->strings[0][0] = 4;
+    ctx->strings[0][1] = USB_DESC_STRING;
+    ctx->strings[0][2] = (uint8_t)(LANGUAGE_ENGLISH & 0xff);
+    ctx->strings[0][3] = (uint8_t)((LANGUAGE_ENGLISH >> 8) & 0xff);
+    /* device strings, from the configuration */
+    usbctrl_string_encode(&(ctx->strings[CONFIG_USB_DEV_MANUFACTURER_INDEX][0]), CONFIG_USB_DEV_MANUFACTURER);
+    usbctrl_string_encode(&(ctx->strings[CONFIG_USB_DEV_PRODNAME_INDEX][0]), CONFIG_USB_DEV_PRODNAME);
+    usbctrl_string_encode(&(ctx->strings[CONFIG_USB_DEV_SERIAL_INDEX][0]), CONFIG_USB_DEV_SERIAL);
+}
+#endif
+
+/*
+ * Default backend driver: the usb_backend_drv_*() symbols, resolved at link time
+ */
+const usb_backend_drv_ops_t usbctrl_backend_drv_default_ops = {
+    .declare              = usb_backend_drv_declare,
+    .configure            = usb_backend_drv_configure,
+    .activate_endpoint    = usb_backend_drv_activate_endpoint,
+    .configure_endpoint   = usb_backend_drv_configure_endpoint,
+    .deconfigure_endpoint = usb_backend_drv_deconfigure_endpoint,
+    .get_ep_state         = usb_backend_drv_get_ep_state,
+    .send_data            = usb_backend_drv_send_data,
+    .send_zlp             = usb_backend_drv_send_zlp,
+    .set_address          = usb_backend_drv_set_address,
+    .set_recv_fifo        = usb_backend_drv_set_recv_fifo,
+    .ack                  = usb_backend_drv_ack,
+    .nak                  = usb_backend_drv_nak,
+    .stall                = usb_backend_drv_stall,
+    .endpoint_disable     = usb_backend_drv_endpoint_disable,
+    .endpoint_enable      = usb_backend_drv_endpoint_enable,
+    .get_ep_mpsize        = usb_backend_drv_get_ep_mpsize,
+    .get_speed            = usb_backend_drv_get_speed,
+#if CONFIG_USBCTRL_BACKEND_FRAME_NUMBER
+    .get_frame_number     = usb_backend_drv_get_frame_number,
+#endif
+};
+
+/*
+ * Backend drivers operations are called without any check: a declared table
+ * must be complete, except the optional operations (get_frame_number), which
+ * are checked by their callers.
+ */
+
+/*@
+    @ requires \valid_read(ops);
+    @ assigns \nothing ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+bool usbctrl_backend_ops_valid(const usb_backend_drv_ops_t *ops)
+{
+    return ops->declare != NULL && ops->configure != NULL &&
+           ops->activate_endpoint != NULL && ops->configure_endpoint != NULL &&
+           ops->deconfigure_endpoint != NULL && ops->get_ep_state != NULL &&
+           ops->send_data != NULL && ops->send_zlp != NULL &&
+           ops->set_address != NULL && ops->set_recv_fifo != NULL &&
+           ops->ack != NULL && ops->nak != NULL && ops->stall != NULL &&
+           ops->endpoint_disable != NULL && ops->endpoint_enable != NULL &&
+           ops->get_ep_mpsize != NULL && ops->get_speed != NULL;
+}
+
 /*@
     @ requires \separated(&num_ctx,&GHOST_num_ctx,ctxh+(..), ctx_list+ (..),&GHOST_opaque_libusbdci_privates);
     @ assigns num_ctx,  GHOST_num_ctx, ctx_list[\old(num_ctx)], GHOST_opaque_drv_privates;
@@ -85,7 +386,9 @@ usbctrl_context_t ctx_list[MAX_USB_CTRL_CTX] = { 0 };
 //         (\result == MBED_ERROR_NONE || \result == MBED_ERROR_UNKNOWN));
 
 */
-mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
+mbed_error_t usbctrl_declare_backend(uint32_t                     dev_id,
+                                     const usb_backend_drv_ops_t *ops,
+                                     uint32_t                    *ctxh)
 {
     log_printf("[USBCTRL] declaring USB backend\n");
     mbed_error_t errcode = MBED_ERROR_NONE;
@@ -94,7 +397,7 @@ mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
    //@ ghost GHOST_opaque_libusbdci_privates = 1;
 
     /* sanitiation */
-    if (ctxh == NULL) {
+    if (ctxh == NULL || ops == NULL || !usbctrl_backend_ops_valid(ops)) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
@@ -106,11 +409,13 @@ mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
     switch (dev_id){
 #if defined(CONFIG_STM32F439)
         case USB_OTG_HS_ID:
-            errcode = usb_backend_drv_declare() ;
-            break;
 #endif
         case USB_OTG_FS_ID:
+#if defined(__FRAMAC__)
             errcode = usb_backend_drv_declare() ;
+#else
+            errcode = ops->declare() ;
+#endif
             break;
         default:
             errcode = MBED_ERROR_NOBACKEND;
@@ -119,7 +424,13 @@ mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
     }
 
     /*  assert ctx_list[GHOST_num_ctx] == ctx_list[num_ctx] ; */
-    set_u32_with_membarrier(&(ctx_list[num_ctx].dev_id), dev_id);
+    /* published with the context, at the end of the declaration */
+    ctx_list[num_ctx].dev_id = dev_id;
+    ctx_list[num_ctx].backend = ops;
+    ctx_list[num_ctx].ctxh = num_ctx;
+    /* the port speed is negotiated at reset, the device starts at full-speed */
+    ctx_list[num_ctx].speed = USB_BACKEND_DRV_PORT_FULLSPEED;
+    ctx_list[num_ctx].ep0_mpsize = USBCTRL_EP0_MPSIZE;
     *ctxh = num_ctx;
 
     #if defined(__FRAMAC__)
@@ -153,11 +464,60 @@ mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
     for (i = 0; i < CONFIG_USBCTRL_MAX_CFG; ++i) {
         ctx->cfg[i].interface_num = 0;
         ctx->cfg[i].first_free_epid = 1;
+        usbctrl_ep_table_reset(&(ctx->cfg[i]));
+        ctx->cfg[i].cfg_string = 0;
+        memset(&(ctx->cfg[i].iface_string[0]), 0x0, sizeof(ctx->cfg[i].iface_string));
+        memset(&(ctx->cfg[i].function_string[0]), 0x0, sizeof(ctx->cfg[i].function_string));
+        memset(&(ctx->cfg[i].ctrl_data[0]), 0x0, sizeof(ctx->cfg[i].ctrl_data));
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+        ctx->cfg[i].desc_valid = false;
+        ctx->cfg[i].desc_size = 0;
+#endif
     }
 
 
     ctx->curr_cfg = 0;
 
+    /* no vendor request declared yet */
+    ctx->vendor_rqst_num = 0;
+    /* no control transfer in progress */
+    ctx->ep0_out.handler = NULL;
+    ctx->ep0_out.buf = NULL;
+    ctx->ep0_out.size = 0;
+    ctx->ep0_out.offset = 0;
+    ctx->ep0_in.data = NULL;
+    ctx->ep0_in.size = 0;
+    ctx->ep0_in.offset = 0;
+    ctx->ep0_in.zlp = false;
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+    memset(&(ctx->ep_events[0]), 0x0, sizeof(ctx->ep_events));
+#endif
+#if CONFIG_USBCTRL_SOF_HOOK
+    ctx->sof_handler = NULL;
+    ctx->sof_divisor = 1;
+    ctx->sof_count = 0;
+#endif
+    /*@
+        @ loop invariant 0 <= i <= USBCTRL_VENDOR_RQST_MAP_SIZE;
+        @ loop assigns i, ctx->vendor_rqst_map[0 .. USBCTRL_VENDOR_RQST_MAP_SIZE-1] ;
+        @ loop variant (USBCTRL_VENDOR_RQST_MAP_SIZE - i);
+    */
+    for (i = 0; i < USBCTRL_VENDOR_RQST_MAP_SIZE; ++i) {
+        ctx->vendor_rqst_map[i] = 0;
+    }
+
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    /* device strings are encoded once for all */
+    usbctrl_strings_init(ctx);
+#endif
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+    usbctrl_event_queue_init(&(ctx->event_queue));
+#endif
+
+    /* the context is fully initialized: it can now be resolved by the event handlers
+     * of its device */
+    usbctrl_devid_map_register(dev_id, ctx->ctxh);
+
     /*  assert GHOST_num_ctx == num_ctx ; */
     /*  assert ctx_list[GHOST_num_ctx-1] == ctx_list[GHOST_num_ctx-1] ; */
     /*  assert *ctxh == GHOST_num_ctx-1 ; */
@@ -167,6 +527,11 @@ mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
 err:
     return errcode;
 }
+
+mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
+{
+    return usbctrl_declare_backend(dev_id, &usbctrl_backend_drv_default_ops, ctxh);
+}
 /*
  * basics for now
  */
@@ -217,6 +582,14 @@ mbed_error_t usbctrl_initialize(uint32_t ctxh)
             ctx->cfg[ctx->curr_cfg].interfaces[i].rqst_handler = 0 ;
             ctx->cfg[ctx->curr_cfg].interfaces[i].class_desc_handler = 0 ;
             ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number = 0 ;
+            ctx->cfg[ctx->curr_cfg].interfaces[i].alt_setting_num = 0 ;
+            ctx->cfg[ctx->curr_cfg].interfaces[i].alt_setting = 0 ;
+            ctx->cfg[ctx->curr_cfg].interfaces[i].altsetting_handler = NULL ;
+            ctx->cfg[ctx->curr_cfg].iface_string[i] = 0;
+            ctx->cfg[ctx->curr_cfg].function_string[i] = 0;
+            ctx->cfg[ctx->curr_cfg].ctrl_data[i].buf = NULL;
+            ctx->cfg[ctx->curr_cfg].ctrl_data[i].size = 0;
+            ctx->cfg[ctx->curr_cfg].ctrl_data[i].handler = NULL;
             /*@
               @ loop invariant 0 <= j <= MAX_EP_PER_INTERFACE ;
               @ loop invariant \valid(ctx->cfg[ctx->curr_cfg].interfaces[i].eps + (0..(MAX_EP_PER_INTERFACE-1))) ;
@@ -229,12 +602,25 @@ mbed_error_t usbctrl_initialize(uint32_t ctxh)
                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].attr = 0;
                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].usage = 0;
                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].pkt_maxsize = 0;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].pkt_maxsize_fs = 0;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].pkt_maxsize_hs = 0;
                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].handler = NULL;
                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num = 0;
                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].poll_interval = 0;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].alt_setting = 0;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].pingpong_buf = NULL;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].pingpong_size = 0;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].pingpong_handler = NULL;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].iso_fill_handler = NULL;
+               ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].iso_feedback = 0;
                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].configured = false;
             }
         }
+        usbctrl_ep_table_reset(&(ctx->cfg[ctx->curr_cfg]));
+        ctx->cfg[ctx->curr_cfg].cfg_string = 0;
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+        ctx->cfg[ctx->curr_cfg].desc_valid = false;
+#endif
 
 
     /* receive FIFO is not set in the driver. Wait for USB reset */
@@ -242,7 +628,14 @@ mbed_error_t usbctrl_initialize(uint32_t ctxh)
 
     /* control pipe recv FIFO is ready to be used */
     ctx->ctrl_fifo_state = USB_CTRL_RCV_FIFO_SATE_FREE;
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+    ctx->ctrl_phase = USBCTRL_CTRL_PHASE_IDLE;
+    ctx->setup_ring.head = 0;
+    ctx->setup_ring.tail = 0;
+    ctx->setup_ring.max_depth = 0;
+    ctx->setup_ring.deep = 0;
+    ctx->setup_ring.lost = 0;
+    /* no transfer submitted yet */
+    usbctrl_xfer_flush(ctx);
 
     /* default config is 0. In it, first free EP id is 1 */
     ctx->cfg[0].first_free_epid = 1;
@@ -286,24 +679,13 @@ mbed_error_t usbctrl_get_handler(usbctrl_context_t *ctx,
         errcode = MBED_ERROR_INVPARAM;
         goto end;
     }
-    /* search */
-
-/*@
-        @ loop invariant 0 <= i <= GHOST_num_ctx;
-        @ loop invariant  \valid_read(ctx_list + (0..(GHOST_num_ctx-1))) ;
-        @ loop invariant \forall integer prei; 0<=prei<i ==> &(ctx_list[prei]) != ctx;
-        @ loop assigns i ;
-        @ loop variant (GHOST_num_ctx - i);
-*/
-
-    for (uint8_t i = 0; i < num_ctx; ++i) {
-        if (&(ctx_list[i]) == ctx) {
-            *handler = i;
-            goto end;
-        }
+    /* the context knows its own handle. It is checked against the context list to
+     * detect any invalid context pointer */
+    if (ctx->ctxh < num_ctx && &(ctx_list[ctx->ctxh]) == ctx) {
+        *handler = ctx->ctxh;
+        goto end;
     }
 
-
     errcode = MBED_ERROR_NOTFOUND;
 end:
     return errcode;
@@ -352,25 +734,31 @@ mbed_error_t usbctrl_get_context(uint32_t device_id,
         errcode = MBED_ERROR_INVPARAM;
         goto end;
     }
-    /* search */
-
+    /* search, starting at the dev_id cell of the index, up to the first free cell */
+    uint8_t cell = device_id % USBCTRL_DEVID_MAP_SIZE;
 
     /*@
-        @ loop invariant 0 <= i <= GHOST_num_ctx;
+        @ loop invariant 0 <= i <= USBCTRL_DEVID_MAP_SIZE;
+        @ loop invariant 0 <= cell < USBCTRL_DEVID_MAP_SIZE;
         @ loop invariant \valid_read(ctx_list + (0..(GHOST_num_ctx-1))) ;
-        @ loop invariant \forall integer prei; 0<=prei<i ==> ctx_list[prei].dev_id != device_id   ;
         @ loop invariant \at(ctx,LoopEntry) == \at(ctx,LoopCurrent) ;
 	    @ loop invariant GHOST_idx_ctx == MAX_USB_CTRL_CTX;
-        @ loop assigns i ;
-        @ loop variant (GHOST_num_ctx - i);
+        @ loop assigns i, cell ;
+        @ loop variant (USBCTRL_DEVID_MAP_SIZE - i);
     */
 
-    for (uint8_t i = 0; i < num_ctx; ++i) {
-        if (ctx_list[i].dev_id == device_id) {
-            *ctx = &(ctx_list[i]);
-            /*@ ghost GHOST_idx_ctx = i ; */
+    for (uint8_t i = 0; i < USBCTRL_DEVID_MAP_SIZE; ++i) {
+        uint8_t idx = usbctrl_load_acquire(&(ctx_devid_map[cell]));
+        if (idx == 0 || idx > num_ctx) {
+            /* free cell: dev_id is not declared */
+            break;
+        }
+        if (ctx_list[idx - 1].dev_id == device_id) {
+            *ctx = &(ctx_list[idx - 1]);
+            /*@ ghost GHOST_idx_ctx = idx - 1 ; */
             goto end;
         }
+        cell = (cell + 1) % USBCTRL_DEVID_MAP_SIZE;
     }
 
     errcode = MBED_ERROR_NOTFOUND;
@@ -379,31 +767,99 @@ end:
     return errcode;
 }
 
+/*
+ * Resolve the given endpoint address (EP number, with bit 7 set for IN endpoints)
+ * in the current configuration. Returns NULL if no interface holds it.
+ */
 /*@
-    @ requires 0 <= ep <= 255 ;
+    @ requires 0 <= ep_addr <= 255 ;
     @ assigns \nothing ;
 
     @ behavior bad_ctx:
     @   assumes ctx == \null ;
-    @   ensures \result == USB_EP_DIR_NONE ;
+    @   ensures \result == \null ;
+
+    @ behavior bad_addr:
+    @   assumes ctx != \null ;
+    @   assumes (ep_addr & 0x70) != 0 ;
+    @   ensures \result == \null ;
 
     @ behavior EP_not_found:
     @   assumes ctx != \null ;
-    @   assumes ep != EP0 ;
-    @   assumes !(\exists integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num && 0 <= j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number &&
-                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep) ;
-    @   ensures \result == USB_EP_DIR_NONE;
+    @   assumes (ep_addr & 0x70) == 0 ;
+    @   assumes ctx->cfg[ctx->curr_cfg].ep_table[USBCTRL_EP_ADDR_TO_IDX(ep_addr)].declared == \false ;
+    @   ensures \result == \null ;
+
+    @ behavior EP_found:
+    @   assumes ctx != \null ;
+    @   assumes (ep_addr & 0x70) == 0 ;
+    @   assumes ctx->cfg[ctx->curr_cfg].ep_table[USBCTRL_EP_ADDR_TO_IDX(ep_addr)].declared == \true ;
+    @   ensures \result == &(ctx->cfg[ctx->curr_cfg].ep_table[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]) ;
+
+    @ complete behaviors;
+    @ disjoint behaviors;
+*/
+usbctrl_ep_entry_t *usbctrl_get_endpoint_entry(usbctrl_context_t *ctx, uint8_t ep_addr)
+{
+    usbctrl_ep_entry_t *entry = NULL;
+
+    /* sanitize */
+    if (ctx == NULL) {
+        goto err;
+    }
+    /* bits 4..6 of an EP address are reserved */
+    if ((ep_addr & 0x70) != 0) {
+        goto err;
+    }
+    entry = &(ctx->cfg[ctx->curr_cfg].ep_table[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]);
+    if (entry->declared == false) {
+        entry = NULL;
+    }
+err:
+    return entry;
+}
+
+/*
+ * EP direction, existence and halt state requests target an EP number, whatever
+ * its direction. The IN address is checked first, then the OUT one.
+ */
+/*@
+    @ assigns \nothing ;
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+usbctrl_ep_entry_t *usbctrl_get_endpoint_entry_by_num(usbctrl_context_t *ctx, uint8_t ep)
+{
+    usbctrl_ep_entry_t *entry = NULL;
+
+    if (ep >= USBCTRL_MAX_EP_NUM) {
+        goto err;
+    }
+    entry = usbctrl_get_endpoint_entry(ctx, ep | USBCTRL_EP_ADDR_DIR_IN);
+    if (entry == NULL) {
+        entry = usbctrl_get_endpoint_entry(ctx, ep);
+    }
+err:
+    return entry;
+}
+
+/*@
+    @ requires 0 <= ep <= 255 ;
+    @ assigns \nothing ;
+
+    @ behavior bad_ctx:
+    @   assumes ctx == \null ;
+    @   ensures \result == USB_EP_DIR_NONE ;
 
     @ behavior EP0_found:
     @   assumes ctx != \null ;
     @   assumes ep == EP0 ;
     @   ensures \result == USB_EP_DIR_BOTH ;
 
-    @ behavior EPx_found:
+    @ behavior EPx:
     @   assumes ctx != \null ;
     @   assumes ep != EP0 ;
-    @   assumes (\exists  integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num && 0 <= j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number &&
-                     ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep) ;
     @   ensures (\result == USB_EP_DIR_IN || \result == USB_EP_DIR_OUT || \result == USB_EP_DIR_BOTH || \result == USB_EP_DIR_NONE ) ;
 
     @ complete behaviors;
@@ -412,10 +868,8 @@ end:
 
 usb_ep_dir_t usbctrl_get_endpoint_direction(usbctrl_context_t *ctx, uint8_t ep)
 {
-    uint8_t i = 0 ;
-    uint8_t j = 0 ;
     usb_ep_dir_t dir = USB_EP_DIR_NONE;
-
+    usbctrl_ep_entry_t *entry = NULL;
 
     /* sanitize */
     if (ctx == NULL) {
@@ -429,37 +883,14 @@ usb_ep_dir_t usbctrl_get_endpoint_direction(usbctrl_context_t *ctx, uint8_t ep)
         goto err;
     }
 
-/*@
-        @ loop invariant 0 <= i <= ctx->cfg[ctx->curr_cfg].interface_num ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces + (0..(ctx->cfg[ctx->curr_cfg].interface_num-1))) ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces[i].eps + (0..(ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number-1))) ;
-        @ loop invariant (\forall integer prei; 0<=prei<i ==>(\forall integer jj;
-            0 <= jj < ctx->cfg[ctx->curr_cfg].interfaces[prei].usb_ep_number ==>  ctx->cfg[ctx->curr_cfg].interfaces[prei].eps[jj].ep_num != ep));
-        @ loop assigns i, j ;
-        @ loop variant (ctx->cfg[ctx->curr_cfg].interface_num - i);
-*/
-
-    for (i = 0; i < ctx->cfg[ctx->curr_cfg].interface_num; ++i) {
-
-/*@
-        @ loop invariant 0 <= j <= ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces + (0..(ctx->cfg[ctx->curr_cfg].interface_num-1))) ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces[i].eps + (0..(ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number-1))) ;
-        @ loop invariant (\forall integer prej ; 0<=prej<j ==> ctx->cfg[ctx->curr_cfg].interfaces[i].eps[prej].ep_num != ep) ;
-        @ loop assigns j ;
-        @ loop variant (ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number - j);
-*/
-
-        for ( j = 0; j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number; ++j) {
-            if (ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep) {
-                dir = ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].dir;
-                if (dir != USB_EP_DIR_IN && dir != USB_EP_DIR_OUT && dir != USB_EP_DIR_BOTH) {
-                    /* this should not happen, this means that the EP is not correctly defined */
-                    dir = USB_EP_DIR_NONE;
-                }
-                goto err;
-            }
-        }
+    entry = usbctrl_get_endpoint_entry_by_num(ctx, ep);
+    if (entry == NULL) {
+        goto err;
+    }
+    dir = ctx->cfg[ctx->curr_cfg].interfaces[entry->iface_id].eps[entry->ep_id].dir;
+    if (dir != USB_EP_DIR_IN && dir != USB_EP_DIR_OUT && dir != USB_EP_DIR_BOTH) {
+        /* this should not happen, this means that the EP is not correctly defined */
+        dir = USB_EP_DIR_NONE;
     }
 
 err:
@@ -474,18 +905,15 @@ err:
     @   assumes ctx == \null ;
     @   ensures \result == \false ;
 
-    @ behavior EP_not_found:
+    @ behavior EP0:
     @   assumes ctx != \null ;
-    @   assumes ep != EP0 ;
-    @   assumes !(\exists integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num && 0 <= j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number &&
-                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep &&  ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].configured == \true) ;
-    @   ensures \result == \true;
+    @   assumes ep == EP0 ;
+    @   ensures \result == \false;
 
-    @ behavior EP_found:
+    @ behavior EPx:
     @   assumes ctx != \null ;
-    @   assumes (\exists  integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num && 0 <= j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number &&
-                     ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep && ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].configured == \true) || ep == EP0 ;
-    @   ensures \result == \false;
+    @   assumes ep != EP0 ;
+    @   ensures \result == \true || \result == \false;
 
     @ complete behaviors;
     @ disjoint behaviors;
@@ -493,9 +921,7 @@ err:
 
 bool usbctrl_is_endpoint_halted(usbctrl_context_t *ctx, uint8_t ep)
 {
-    uint8_t i = 0 ;
-    uint8_t j = 0 ;
-
+    usbctrl_ep_entry_t *entry = NULL;
 
     /* sanitize */
     if (ctx == NULL) {
@@ -506,38 +932,13 @@ bool usbctrl_is_endpoint_halted(usbctrl_context_t *ctx, uint8_t ep)
         return false;
     }
 
-/*@
-        @ loop invariant 0 <= i <= ctx->cfg[ctx->curr_cfg].interface_num ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces + (0..(ctx->cfg[ctx->curr_cfg].interface_num-1))) ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces[i].eps + (0..(ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number-1))) ;
-        @ loop invariant (\forall integer prei; 0<=prei<i ==>(\forall integer jj;
-            0 <= jj < ctx->cfg[ctx->curr_cfg].interfaces[prei].usb_ep_number ==>  ctx->cfg[ctx->curr_cfg].interfaces[prei].eps[jj].ep_num != ep));
-        @ loop assigns i, j ;
-        @ loop variant (ctx->cfg[ctx->curr_cfg].interface_num - i);
-*/
-
-    for (i = 0; i < ctx->cfg[ctx->curr_cfg].interface_num; ++i) {
-
-/*@
-        @ loop invariant 0 <= j <= ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces + (0..(ctx->cfg[ctx->curr_cfg].interface_num-1))) ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces[i].eps + (0..(ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number-1))) ;
-        @ loop invariant (\forall integer prej ; 0<=prej<j ==> ctx->cfg[ctx->curr_cfg].interfaces[i].eps[prej].ep_num != ep) ;
-        @ loop assigns j ;
-        @ loop variant (ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number - j);
-*/
-
-        for ( j = 0; j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number; ++j) {
-            if (ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep) {
-                if (ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].configured == true) {
-                    return false;
-                } else {
-                    return true;
-                }
-            }
-        }
+    entry = usbctrl_get_endpoint_entry_by_num(ctx, ep);
+    if (entry == NULL) {
+        return true;
+    }
+    if (ctx->cfg[ctx->curr_cfg].interfaces[entry->iface_id].eps[entry->ep_id].configured == true) {
+        return false;
     }
-
     return true;
 }
 
@@ -551,18 +952,15 @@ bool usbctrl_is_endpoint_halted(usbctrl_context_t *ctx, uint8_t ep)
     @   assumes ctx == \null ;
     @   ensures \result == \false ;
 
-    @ behavior EP_not_found:
+    @ behavior EP0:
     @   assumes ctx != \null ;
-    @   assumes ep != EP0 ;
-    @   assumes !(\exists integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num && 0 <= j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number &&
-                ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep) ;
-    @   ensures \result == \false;
+    @   assumes ep == EP0 ;
+    @   ensures \result == \true ;
 
-    @ behavior EP_found:
+    @ behavior EPx:
     @   assumes ctx != \null ;
-    @   assumes (\exists  integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num && 0 <= j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number &&
-                     ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep) || ep == EP0 ;
-    @   ensures \result == \true ;
+    @   assumes ep != EP0 ;
+    @   ensures \result == \true || \result == \false;
 
     @ complete behaviors;
     @ disjoint behaviors;
@@ -570,10 +968,6 @@ bool usbctrl_is_endpoint_halted(usbctrl_context_t *ctx, uint8_t ep)
 
 bool usbctrl_is_endpoint_exists(usbctrl_context_t *ctx, uint8_t ep)
 {
-    uint8_t i = 0 ;
-    uint8_t j = 0 ;
-
-
     /* sanitize */
     if (ctx == NULL) {
         return false;
@@ -583,38 +977,12 @@ bool usbctrl_is_endpoint_exists(usbctrl_context_t *ctx, uint8_t ep)
         return true;
     }
 
-/*@
-        @ loop invariant 0 <= i <= ctx->cfg[ctx->curr_cfg].interface_num ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces + (0..(ctx->cfg[ctx->curr_cfg].interface_num-1))) ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces[i].eps + (0..(ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number-1))) ;
-        @ loop invariant (\forall integer prei; 0<=prei<i ==>(\forall integer jj;
-            0 <= jj < ctx->cfg[ctx->curr_cfg].interfaces[prei].usb_ep_number ==>  ctx->cfg[ctx->curr_cfg].interfaces[prei].eps[jj].ep_num != ep));
-        @ loop assigns i, j ;
-        @ loop variant (ctx->cfg[ctx->curr_cfg].interface_num - i);
-*/
-
-    for (i = 0; i < ctx->cfg[ctx->curr_cfg].interface_num; ++i) {
-
-/*@
-        @ loop invariant 0 <= j <= ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces + (0..(ctx->cfg[ctx->curr_cfg].interface_num-1))) ;
-        @ loop invariant \valid_read(ctx->cfg[ctx->curr_cfg].interfaces[i].eps + (0..(ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number-1))) ;
-        @ loop invariant (\forall integer prej ; 0<=prej<j ==> ctx->cfg[ctx->curr_cfg].interfaces[i].eps[prej].ep_num != ep) ;
-        @ loop assigns j ;
-        @ loop variant (ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number - j);
-*/
-
-        for ( j = 0; j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number; ++j) {
-            if (ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == ep) {
-                return true;
-            }
-        }
+    if (usbctrl_get_endpoint_entry_by_num(ctx, ep) != NULL) {
+        return true;
     }
-
     return false;
 }
 
-
 /*@
     @ requires 0 <= iface <= 255 ;
     @ assigns \nothing ;
@@ -688,16 +1056,146 @@ usbctrl_interface_t* usbctrl_get_interface(usbctrl_context_t *ctx, uint8_t iface
 }
 
 /*
- * Here we declare a new USB interface for the given context.
+ * About endpoints max packet size and port speed.
+ *
+ * Each EP holds a max packet size per speed: pkt_maxsize_fs and pkt_maxsize_hs,
+ * either declared by the upper layer or derived from pkt_maxsize. Both are bounded
+ * to the USB 2.0 limits of their speed (USB 2.0 chap. 5.6 to 5.8) and to the backend
+ * driver EP max packet size at declaration time.
+ * The device starts at full-speed. The speed negotiated with the host is read at
+ * reset and at the first device descriptor request (see usbctrl_update_speed()):
+ * pkt_maxsize is then set to the size of the negotiated speed, which is used by the
+ * descriptors, the backend EP configuration and the transfers.
  */
 
-/*
-    TODO : test spec with greater value for CONFIG_USBCTRL_MAX_CFG & MAX_USB_CTRL_CFG : dead code with value == 2
-*/
-
 /*@
-  @ requires GHOST_num_ctx == num_ctx ;
-  @ requires \separated(iface+(..), ctx_list+(..));
+    @ assigns \nothing ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+uint16_t usbctrl_ep_speed_mpsize(usb_ep_type_t                type,
+                                 uint16_t                     mpsize,
+                                 usb_backend_drv_port_speed_t speed,
+                                 uint16_t                     drv_mpsize)
+{
+    uint16_t limit = drv_mpsize;
+
+    switch (type) {
+        case USB_EP_TYPE_BULK:
+            if (speed == USB_BACKEND_DRV_PORT_HIGHSPEED) {
+                /* HS bulk EPs max packet size is always 512 */
+                mpsize = 512;
+            } else if (limit > 64) {
+                limit = 64;
+            }
+            break;
+        case USB_EP_TYPE_INTERRUPT:
+            if (speed != USB_BACKEND_DRV_PORT_HIGHSPEED && limit > 64) {
+                limit = 64;
+            }
+            break;
+        case USB_EP_TYPE_ISOCHRONOUS:
+            if (speed != USB_BACKEND_DRV_PORT_HIGHSPEED && limit > 1023) {
+                limit = 1023;
+            }
+            break;
+        default:
+            break;
+    }
+    if (limit > 1024) {
+        limit = 1024;
+    }
+    if (mpsize > limit) {
+        mpsize = limit;
+    }
+    return mpsize;
+}
+
+/*@
+    @ requires \valid_read(ep) ;
+    @ assigns \nothing ;
+*/
+uint16_t usbctrl_ep_mpsize(usb_ep_infos_t const * const     ep,
+                           usb_backend_drv_port_speed_t     speed)
+{
+    return (speed == USB_BACKEND_DRV_PORT_HIGHSPEED) ? ep->pkt_maxsize_hs : ep->pkt_maxsize_fs;
+}
+
+/*
+ * Called at reset and at device descriptor request, in the context events path
+ * only, while the data EPs are not active yet or already configured at the same
+ * speed.
+ */
+
+/*@
+    @ requires \valid(ctx) ;
+*/
+void usbctrl_update_speed(usbctrl_context_t *ctx)
+{
+    usb_backend_drv_port_speed_t speed = usbctrl_drv_get_speed(ctx);
+
+    if (speed == ctx->speed) {
+        goto end;
+    }
+    log_printf("[USBCTRL] port speed is now %d\n", speed);
+    ctx->speed = speed;
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    /* FS and HS control pipes both support 64 bytes packets, LS only 8 */
+    ctx->ep0_mpsize = (speed == USB_BACKEND_DRV_PORT_LOWSPEED) ? 8 : USBCTRL_EP0_MPSIZE;
+#else
+    /* the build-time device descriptor advertises a 64 bytes control pipe: low-speed
+     * ports are not supported in this mode */
+    if (speed == USB_BACKEND_DRV_PORT_LOWSPEED) {
+        log_printf("[USBCTRL] low-speed not supported with build-time descriptors\n");
+    }
+#endif
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    /* build-time descriptors are generated for a single speed: in this case, the
+     * declared max packet sizes are kept as is */
+    /*@
+      @ loop invariant 0 <= i <= ctx->num_cfg ;
+      @ loop assigns i, ctx->cfg[0 .. CONFIG_USBCTRL_MAX_CFG-1] ;
+      @ loop variant (ctx->num_cfg - i) ;
+      */
+    for (uint8_t i = 0; i < ctx->num_cfg; ++i) {
+        /*@
+          @ loop invariant 0 <= j <= ctx->cfg[i].interface_num ;
+          @ loop assigns j, ctx->cfg[i].interfaces[0 .. MAX_INTERFACES_PER_DEVICE-1] ;
+          @ loop variant (ctx->cfg[i].interface_num - j) ;
+          */
+        for (uint8_t j = 0; j < ctx->cfg[i].interface_num; ++j) {
+            usbctrl_interface_t *iface = &(ctx->cfg[i].interfaces[j]);
+            /*@
+              @ loop invariant 0 <= k <= iface->usb_ep_number ;
+              @ loop assigns k, iface->eps[0 .. MAX_EP_PER_INTERFACE-1] ;
+              @ loop variant (iface->usb_ep_number - k) ;
+              */
+            for (uint8_t k = 0; k < iface->usb_ep_number; ++k) {
+                if (iface->eps[k].type != USB_EP_TYPE_CONTROL) {
+                    iface->eps[k].pkt_maxsize = usbctrl_ep_mpsize(&(iface->eps[k]), speed);
+                }
+            }
+        }
+        /* the configuration descriptor must be forged again */
+        ctx->cfg[i].desc_valid = false;
+    }
+#endif
+end:
+    return;
+}
+
+/*
+ * Here we declare a new USB interface for the given context.
+ */
+
+/*
+    TODO : test spec with greater value for CONFIG_USBCTRL_MAX_CFG & MAX_USB_CTRL_CFG : dead code with value == 2
+*/
+
+/*@
+  @ requires GHOST_num_ctx == num_ctx ;
+  @ requires \separated(iface+(..), ctx_list+(..));
   @ assigns ctx_list[ctxh] ;
   @ ensures GHOST_num_ctx == num_ctx ;
 
@@ -745,8 +1243,14 @@ mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
 {
     uint8_t iface_config = 0;
     uint8_t i = 0 ;
+    bool new_cfg = false;
     mbed_error_t errcode = MBED_ERROR_NONE;
     uint16_t drv_ep_mpsize ;
+#ifndef __FRAMAC__
+    /* EPs of each alternate setting are numbered from the same base */
+    uint8_t alt_ep_base = 0;
+    uint8_t alt_ep_pos[MAX_ALTSETTINGS_PER_INTERFACE] = { 0 };
+#endif
 
     // ghost GHOST_opaque_libusbdci_privates = 1;
 
@@ -764,6 +1268,23 @@ mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
 
     usbctrl_context_t *ctx = &(ctx_list[ctxh]);
 
+#ifndef __FRAMAC__
+    /* each EP must belong to a declared alternate setting */
+    if (iface->alt_setting_num > MAX_ALTSETTINGS_PER_INTERFACE ||
+        iface->usb_ep_number > MAX_EP_PER_INTERFACE) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    for (i = 0; i < iface->usb_ep_number; ++i) {
+        if (iface->eps[i].alt_setting != 0 &&
+            iface->eps[i].alt_setting >= iface->alt_setting_num) {
+            log_printf("[USBCTRL] EP %d: invalid alternate setting %d\n", i, iface->eps[i].alt_setting);
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+        }
+    }
+#endif
+
     /* check space */
     if (ctx->cfg[ctx->curr_cfg].interface_num >= MAX_INTERFACES_PER_DEVICE) {
         errcode = MBED_ERROR_NOMEM;
@@ -774,15 +1295,13 @@ mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
             /*
                 check space
             */
-
-    	ctx->num_cfg++;
-
-        if(ctx->num_cfg > (CONFIG_USBCTRL_MAX_CFG - 1)){
+        if((ctx->num_cfg + 1) > (CONFIG_USBCTRL_MAX_CFG - 1)){
             errcode = MBED_ERROR_NOMEM;
             goto err;
         }
-
-        iface_config = ctx->num_cfg;
+        /* the new configuration is accounted once the interface is registered */
+        iface_config = ctx->num_cfg + 1;
+        new_cfg = true;
         ctx->cfg[iface_config].first_free_epid = 1;
     } else {
         iface_config = ctx->curr_cfg;
@@ -797,6 +1316,8 @@ mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
 
     /* iface identifier in target configuration */
     uint8_t iface_num = ctx->cfg[iface_config].interface_num;
+    /* restored if the declaration fails */
+    uint8_t prev_free_epid = ctx->cfg[iface_config].first_free_epid;
 
     /* let's register */
    //log_printf("declaring new interface class %x, %d EPs in Cfg %d/%d\n", iface->usb_class, iface->usb_ep_number, iface_config, iface_num);
@@ -828,7 +1349,11 @@ mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
 
    /* 2) set the interface identifier */
    ctx->cfg[iface_config].interfaces[iface_num].id = iface_num;
-   iface->id = iface_num;
+   /* the default alternate setting is active until the host selects another one */
+   ctx->cfg[iface_config].interfaces[iface_num].alt_setting = 0;
+#ifndef __FRAMAC__
+   alt_ep_base = ctx->cfg[iface_config].first_free_epid;
+#endif
    uint8_t max_ep = ctx->cfg[iface_config].interfaces[iface_num].usb_ep_number ;
    /* 3) or, depending on the interface flags, add it to current config or to a new config */
    /* at declaration time, all interface EPs are disabled  and calculate EP identifier for the interface */
@@ -866,12 +1391,14 @@ mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
            /* FIXME: max EP num must be compared to the MAX supported EP num at driver level */
            /* check that declared ep mpsize is compatible with backend driver */
 
-           drv_ep_mpsize = usb_backend_drv_get_ep_mpsize(ctx->cfg[iface_config].interfaces[iface_num].eps[i].type);
+           drv_ep_mpsize = usbctrl_drv_get_ep_mpsize(ctx, ctx->cfg[iface_config].interfaces[iface_num].eps[i].type);
 
            if (ctx->cfg[iface_config].interfaces[iface_num].eps[i].pkt_maxsize > drv_ep_mpsize) {
                log_printf("truncating EP max packet size to backend driver EP max pktsize\n");
                ctx->cfg[iface_config].interfaces[iface_num].eps[i].pkt_maxsize = drv_ep_mpsize;
            }
+           ctx->cfg[iface_config].interfaces[iface_num].eps[i].pkt_maxsize_fs = ctx->cfg[iface_config].interfaces[iface_num].eps[i].pkt_maxsize;
+           ctx->cfg[iface_config].interfaces[iface_num].eps[i].pkt_maxsize_hs = ctx->cfg[iface_config].interfaces[iface_num].eps[i].pkt_maxsize;
        }
 
     #else
@@ -883,37 +1410,539 @@ mbed_error_t usbctrl_declare_interface(__in     uint32_t ctxh,
            ep->ep_num = 0;
            iface->eps[i].ep_num = 0;
        } else {
-           ep->ep_num = ctx->cfg[iface_config].first_free_epid;
+           /* alternate settings are exclusive: they reuse the same EP addresses */
+           ep->ep_num = (uint8_t)(alt_ep_base + alt_ep_pos[ep->alt_setting]);
+           alt_ep_pos[ep->alt_setting]++;
            iface->eps[i].ep_num = ep->ep_num;
            log_printf("declare EP (not control) id %d\n", ep->ep_num);
            if (iface->eps[i].dir == USB_EP_DIR_BOTH) {
                log_printf("[USBCTRL] EP set as full duplex\n");
            }
-           ctx->cfg[iface_config].first_free_epid++;
+           if (ep->ep_num >= ctx->cfg[iface_config].first_free_epid) {
+               ctx->cfg[iface_config].first_free_epid = (uint8_t)(ep->ep_num + 1);
+           }
            /* max supported EP by device driver is handled at set_configuration time, as the
             * configure_endpoint will fail. This is not the usbctrl responsability to handle
             * the max number of hardware EP. Thus, the device driver should pretty print
             * that there is no more space to help debugging this behavior. */
 
-           drv_ep_mpsize = usb_backend_drv_get_ep_mpsize((usb_backend_drv_ep_type_t)ep->type);
+           drv_ep_mpsize = usbctrl_drv_get_ep_mpsize(ctx, (usb_backend_drv_ep_type_t)ep->type);
 
            if (ep->pkt_maxsize > drv_ep_mpsize) {
                log_printf("truncating EP max packet size to backend driver EP max pktsize\n");
                ep->pkt_maxsize = drv_ep_mpsize;
            }
+           /* per-speed max packet sizes, derived from pkt_maxsize if not declared */
+           ep->pkt_maxsize_fs = usbctrl_ep_speed_mpsize(ep->type,
+                                   (ep->pkt_maxsize_fs != 0) ? ep->pkt_maxsize_fs : ep->pkt_maxsize,
+                                   USB_BACKEND_DRV_PORT_FULLSPEED, drv_ep_mpsize);
+           ep->pkt_maxsize_hs = usbctrl_ep_speed_mpsize(ep->type,
+                                   (ep->pkt_maxsize_hs != 0) ? ep->pkt_maxsize_hs : ep->pkt_maxsize,
+                                   USB_BACKEND_DRV_PORT_HIGHSPEED, drv_ep_mpsize);
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+           /* until the port speed is negotiated, the device runs at full-speed */
+           ep->pkt_maxsize = usbctrl_ep_mpsize(ep, ctx->speed);
+#endif
+           if (ep->pingpong_buf != NULL && ep->dir == USB_EP_DIR_IN &&
+               (ep->type != USB_EP_TYPE_ISOCHRONOUS || ep->pingpong_size == 0 ||
+                (ep->iso_fill_handler == NULL && ep->usage != USB_EP_USAGE_FEEDBACK) ||
+                (ep->usage == USB_EP_USAGE_FEEDBACK && ep->pingpong_size < USBCTRL_ISO_FEEDBACK_HS_LEN) ||
+                CONFIG_USBCTRL_XFER_QUEUE_DEPTH < 2)) {
+               /* isochronous IN double buffering */
+               log_printf("[USBCTRL] invalid isochronous double buffering on EP %d\n", ep->ep_num);
+               errcode = MBED_ERROR_INVPARAM;
+               goto err_release;
+           }
+           ep->iso_feedback = 0;
+           if (ep->pingpong_buf != NULL && ep->dir != USB_EP_DIR_IN &&
+               (ep->pingpong_handler == NULL ||
+                ep->pkt_maxsize_fs == 0 || ep->pkt_maxsize_hs == 0 || ep->pingpong_size == 0 ||
+                (ep->pingpong_size % ep->pkt_maxsize_fs) != 0 ||
+                (ep->pingpong_size % ep->pkt_maxsize_hs) != 0 ||
+                CONFIG_USBCTRL_XFER_QUEUE_DEPTH < 2)) {
+               log_printf("[USBCTRL] invalid ping-pong reception on EP %d\n", ep->ep_num);
+               errcode = MBED_ERROR_INVPARAM;
+               goto err_release;
+           }
        }
 
     #endif/*!__FRAMAC__*/
 
+       /* EP address must fit in the USB standard EP numbering */
+       if (ctx->cfg[iface_config].interfaces[iface_num].eps[i].ep_num >= USBCTRL_MAX_EP_NUM) {
+           log_printf("[USBCTRL] no more EP address available in config %d\n", iface_config);
+           errcode = MBED_ERROR_NOMEM;
+           goto err_release;
+       }
+       usbctrl_ep_table_register(&(ctx->cfg[iface_config]), iface_num, i);
    }
 
    /* 4) now that everything is Okay, consider iface registered */
    ctx->cfg[iface_config].interface_num++;
+   if (new_cfg) {
+       ctx->num_cfg = iface_config;
+   }
+   iface->id = iface_num;
+   iface->cfg_id = iface_config;
+   iface->alt_setting = 0;
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+   /* the configuration descriptor must be forged again */
+   ctx->cfg[iface_config].desc_valid = false;
+#endif
    /* 5) iface EPs should be configured when receiving setConfiguration or SetInterface */
+   return errcode;
+
+err_release:
+   /* invalid EP: the partially declared interface is rolled back, so that the
+    * context is left as before the call */
+   usbctrl_ep_table_release(&(ctx->cfg[iface_config]), iface_num, false);
+   ctx->cfg[iface_config].first_free_epid = prev_free_epid;
+   memset(&(ctx->cfg[iface_config].interfaces[iface_num]), 0x0, sizeof(usbctrl_interface_t));
 err:
    return errcode;
 }
 
+/*
+ * Here we declare a new vendor request for the given context.
+ */
+
+/*@
+  @ requires GHOST_num_ctx == num_ctx ;
+  @ requires \separated(rqst+(..), ctx_list+(..));
+  @ assigns ctx_list[ctxh] ;
+  @ ensures GHOST_num_ctx == num_ctx ;
+  @ ensures ( ctxh >= num_ctx || rqst == \null ) ==> \result == MBED_ERROR_INVPARAM ;
+ */
+mbed_error_t usbctrl_declare_vendor_request(__in uint32_t                           ctxh,
+                                            __in usbctrl_vendor_rqst_t const * const rqst)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_context_t *ctx = NULL;
+
+    /* sanitize */
+    if (ctxh >= num_ctx) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (rqst == NULL || rqst->handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (rqst->dir != USB_EP_DIR_IN && rqst->dir != USB_EP_DIR_OUT) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* recipient is set on 5 bits, 4 to 31 are reserved */
+    if (rqst->recipient > 3) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* data stage is handled through the context data stage buffer */
+    if (rqst->max_len > CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE) {
+        log_printf("[USBCTRL] vendor rqst %x: data stage too long\n", rqst->bRequest);
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    ctx = &(ctx_list[ctxh]);
+    if (usbctrl_get_vendor_request(ctx, rqst->bRequest, rqst->recipient) != NULL) {
+        log_printf("[USBCTRL] vendor rqst %x already declared\n", rqst->bRequest);
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* check space */
+    if (ctx->vendor_rqst_num >= CONFIG_USBCTRL_MAX_VENDOR_RQST) {
+        errcode = MBED_ERROR_NOMEM;
+        goto err;
+    }
+
+    uint8_t num = ctx->vendor_rqst_num;
+    ctx->vendor_rqst[num].bRequest = rqst->bRequest;
+    ctx->vendor_rqst[num].recipient = rqst->recipient;
+    ctx->vendor_rqst[num].dir = rqst->dir;
+    ctx->vendor_rqst[num].max_len = rqst->max_len;
+    ctx->vendor_rqst[num].handler = rqst->handler;
+
+    /* index the request. There is always a free cell, as the index is twice as
+     * large as the requests list */
+    uint8_t cell = rqst->bRequest % USBCTRL_VENDOR_RQST_MAP_SIZE;
+    /*@
+      @ loop invariant 0 <= i <= USBCTRL_VENDOR_RQST_MAP_SIZE ;
+      @ loop invariant 0 <= cell < USBCTRL_VENDOR_RQST_MAP_SIZE ;
+      @ loop assigns i, cell, ctx->vendor_rqst_map[0 .. USBCTRL_VENDOR_RQST_MAP_SIZE-1] ;
+      @ loop variant (USBCTRL_VENDOR_RQST_MAP_SIZE - i) ;
+      */
+    for (uint8_t i = 0; i < USBCTRL_VENDOR_RQST_MAP_SIZE; ++i) {
+        if (ctx->vendor_rqst_map[cell] == 0) {
+            ctx->vendor_rqst_map[cell] = num + 1;
+            break;
+        }
+        cell = (cell + 1) % USBCTRL_VENDOR_RQST_MAP_SIZE;
+    }
+    ctx->vendor_rqst_num++;
+err:
+    return errcode;
+}
+
+/*@
+    @ assigns \nothing ;
+
+    @ behavior bad_ctx:
+    @   assumes ctx == \null ;
+    @   ensures \result == \null ;
+
+    @ behavior ok:
+    @   assumes ctx != \null ;
+    @   ensures \result == \null ||
+                (\result->bRequest == bRequest && \result->recipient == recipient) ;
+
+    @ complete behaviors;
+    @ disjoint behaviors;
+*/
+usbctrl_vendor_rqst_t *usbctrl_get_vendor_request(usbctrl_context_t *ctx,
+                                                  uint8_t            bRequest,
+                                                  uint8_t            recipient)
+{
+    usbctrl_vendor_rqst_t *rqst = NULL;
+
+    /* sanitize */
+    if (ctx == NULL) {
+        goto err;
+    }
+    /* search, starting at the bRequest cell of the index, up to the first free cell */
+    uint8_t cell = bRequest % USBCTRL_VENDOR_RQST_MAP_SIZE;
+    /*@
+      @ loop invariant 0 <= i <= USBCTRL_VENDOR_RQST_MAP_SIZE ;
+      @ loop invariant 0 <= cell < USBCTRL_VENDOR_RQST_MAP_SIZE ;
+      @ loop assigns i, cell ;
+      @ loop variant (USBCTRL_VENDOR_RQST_MAP_SIZE - i) ;
+      */
+    for (uint8_t i = 0; i < USBCTRL_VENDOR_RQST_MAP_SIZE; ++i) {
+        uint8_t idx = ctx->vendor_rqst_map[cell];
+        if (idx == 0 || idx > ctx->vendor_rqst_num) {
+            break;
+        }
+        if (ctx->vendor_rqst[idx - 1].bRequest == bRequest &&
+            ctx->vendor_rqst[idx - 1].recipient == recipient) {
+            rqst = &(ctx->vendor_rqst[idx - 1]);
+            break;
+        }
+        cell = (cell + 1) % USBCTRL_VENDOR_RQST_MAP_SIZE;
+    }
+err:
+    return rqst;
+}
+
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+/*
+ * With build-time descriptors, strings are already encoded in flash. Declared
+ * strings are resolved to their build-time index by content.
+ */
+/*@
+    @ requires \valid_read(string);
+    @ assigns \nothing;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+bool usbctrl_string_match(usbctrl_static_desc_t const * const desc, const char *string)
+{
+    uint8_t len = 0;
+
+    if (desc->desc == NULL) {
+        return false;
+    }
+    /*@
+      @ loop invariant 0 <= len ;
+      @ loop assigns len ;
+      */
+    while (string[len] != '\0') {
+        if ((uint16_t)(2 + 2 * len + 1) >= desc->size ||
+            desc->desc[2 + 2 * len] != (uint8_t)string[len] ||
+            desc->desc[2 + 2 * len + 1] != 0) {
+            return false;
+        }
+        len++;
+    }
+    return (desc->size == (uint16_t)(2 + 2 * len));
+}
+#endif
+
+/*
+ * Here we declare a string for a given interface, function or configuration.
+ */
+
+/*@
+  @ requires GHOST_num_ctx == num_ctx ;
+  @ requires \separated(iface+(..), string+(..), ctx_list+(..));
+  @ assigns ctx_list[ctxh] ;
+  @ ensures GHOST_num_ctx == num_ctx ;
+*/
+mbed_error_t usbctrl_declare_string(__in uint32_t                         ctxh,
+                                    __in usbctrl_interface_t const * const iface,
+                                    __in usbctrl_string_type_t             type,
+                                    __in const char                       *string)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_context_t *ctx = NULL;
+    usbctrl_configuration_t *cfg = NULL;
+    uint8_t *field = NULL;
+    uint8_t index = 0;
+
+    /* sanitize */
+    if (ctxh >= num_ctx) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (iface == NULL || string == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    ctx = &(ctx_list[ctxh]);
+    if (iface->cfg_id >= CONFIG_USBCTRL_MAX_CFG ||
+        iface->id >= ctx->cfg[iface->cfg_id].interface_num) {
+        /* interface not declared */
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    cfg = &(ctx->cfg[iface->cfg_id]);
+
+    switch (type) {
+        case USBCTRL_STRING_INTERFACE:
+            field = &(cfg->iface_string[iface->id]);
+            break;
+        case USBCTRL_STRING_FUNCTION:
+            if (cfg->interfaces[iface->id].composite_function == false) {
+                errcode = MBED_ERROR_INVPARAM;
+                goto err;
+            }
+            field = &(cfg->function_string[iface->id]);
+            break;
+        case USBCTRL_STRING_CONFIGURATION:
+            field = &(cfg->cfg_string);
+            break;
+        default:
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+    }
+
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    /*@
+      @ loop invariant 1 <= i <= usbctrl_static_string_desc_num ;
+      @ loop assigns i, index ;
+      @ loop variant (usbctrl_static_string_desc_num - i) ;
+      */
+    for (uint8_t i = 1; i < usbctrl_static_string_desc_num; ++i) {
+        if (usbctrl_string_match(&(usbctrl_static_string_desc[i]), string)) {
+            index = i;
+            break;
+        }
+    }
+    if (index == 0) {
+        log_printf("[USBCTRL] string not found in build-time descriptors\n");
+        errcode = MBED_ERROR_NOTFOUND;
+        goto err;
+    }
+#else
+    if (*field != 0) {
+        /* already declared: replacing its content */
+        index = *field;
+    } else {
+        /*@
+          @ loop invariant 1 <= i <= CONFIG_USBCTRL_MAX_STRINGS ;
+          @ loop assigns i, index ;
+          @ loop variant (CONFIG_USBCTRL_MAX_STRINGS - i) ;
+          */
+        for (uint8_t i = 1; i < CONFIG_USBCTRL_MAX_STRINGS; ++i) {
+            if (ctx->strings[i][0] == 0) {
+                index = i;
+                break;
+            }
+        }
+        if (index == 0) {
+            log_printf("[USBCTRL] no more string slot available\n");
+            errcode = MBED_ERROR_NOMEM;
+            goto err;
+        }
+    }
+    usbctrl_string_encode(&(ctx->strings[index][0]), string);
+    /* string indexes are part of the configuration descriptor */
+    cfg->desc_valid = false;
+#endif
+    *field = index;
+err:
+    return errcode;
+}
+
+/*
+ * Here we declare the control data stage handler of a given interface.
+ */
+
+/*@
+  @ requires GHOST_num_ctx == num_ctx ;
+  @ requires \separated(iface+(..), buf+(..), ctx_list+(..));
+  @ assigns ctx_list[ctxh] ;
+  @ ensures GHOST_num_ctx == num_ctx ;
+*/
+mbed_error_t usbctrl_declare_ctrl_data_handler(__in uint32_t                         ctxh,
+                                               __in usbctrl_interface_t const * const iface,
+                                               __in uint8_t                          *buf,
+                                               __in uint16_t                          buf_size,
+                                               __in usb_rqst_data_handler_t           handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_context_t *ctx = NULL;
+    usbctrl_ctrl_data_t *ctrl_data = NULL;
+
+    /* sanitize */
+    if (ctxh >= num_ctx) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (iface == NULL || handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (buf != NULL && buf_size == 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    ctx = &(ctx_list[ctxh]);
+    if (iface->cfg_id >= CONFIG_USBCTRL_MAX_CFG ||
+        iface->id >= ctx->cfg[iface->cfg_id].interface_num) {
+        /* interface not declared */
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    ctrl_data = &(ctx->cfg[iface->cfg_id].ctrl_data[iface->id]);
+    if (buf == NULL) {
+        ctrl_data->buf = &(ctx->ctrl_data_buf[0]);
+        ctrl_data->size = CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE;
+    } else {
+        ctrl_data->buf = buf;
+        ctrl_data->size = buf_size;
+    }
+    ctrl_data->handler = handler;
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_submit_in(__in uint32_t               ctxh,
+                               __in uint8_t                ep,
+                               __in const uint8_t         *buf,
+                               __in uint32_t               len,
+                               __in uint32_t               flags,
+                               __in usbctrl_xfer_handler_t handler,
+                               __in void                  *cookie)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || ep >= USBCTRL_MAX_EP_NUM) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    errcode = usbctrl_xfer_submit(&(ctx_list[ctxh]), ep | USBCTRL_EP_ADDR_DIR_IN,
+                                  (uint8_t*)buf, len, flags, handler, cookie);
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_submit_in_iov(__in uint32_t                ctxh,
+                                   __in uint8_t                 ep,
+                                   __in const usbctrl_iovec_t  *iov,
+                                   __in uint8_t                 iovcnt,
+                                   __in uint32_t                flags,
+                                   __in usbctrl_xfer_handler_t  handler,
+                                   __in void                   *cookie)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || ep >= USBCTRL_MAX_EP_NUM) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    errcode = usbctrl_xfer_submit_iov(&(ctx_list[ctxh]), ep | USBCTRL_EP_ADDR_DIR_IN,
+                                      iov, iovcnt, flags, handler, cookie);
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_submit_out(__in uint32_t               ctxh,
+                                __in uint8_t                ep,
+                                __in uint8_t               *buf,
+                                __in uint32_t               len,
+                                __in uint32_t               flags,
+                                __in usbctrl_xfer_handler_t handler,
+                                __in void                  *cookie)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || ep >= USBCTRL_MAX_EP_NUM) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    errcode = usbctrl_xfer_submit(&(ctx_list[ctxh]), ep, buf, len, flags, handler, cookie);
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_iso_set_feedback(__in uint32_t ctxh,
+                                      __in uint8_t  ep,
+                                      __in uint32_t rate)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || ep >= USBCTRL_MAX_EP_NUM) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    errcode = usbctrl_xfer_iso_set_feedback(&(ctx_list[ctxh]), ep | USBCTRL_EP_ADDR_DIR_IN, rate);
+err:
+    return errcode;
+}
+
+/*
+ * String descriptor resolution, in constant time, by string index.
+ */
+
+/*@
+    @ requires \separated(ctx, desc, desc_size);
+    @ assigns *desc, *desc_size;
+*/
+mbed_error_t usbctrl_get_string_desc(usbctrl_context_t *ctx,
+                                     uint8_t            index,
+                                     uint8_t const    **desc,
+                                     uint32_t          *desc_size)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (ctx == NULL || desc == NULL || desc_size == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    if (index >= usbctrl_static_string_desc_num ||
+        usbctrl_static_string_desc[index].desc == NULL) {
+        errcode = MBED_ERROR_UNSUPORTED_CMD;
+        goto err;
+    }
+    *desc = usbctrl_static_string_desc[index].desc;
+    *desc_size = usbctrl_static_string_desc[index].size;
+#else
+    if (index >= CONFIG_USBCTRL_MAX_STRINGS || ctx->strings[index][0] == 0) {
+        errcode = MBED_ERROR_UNSUPORTED_CMD;
+        goto err;
+    }
+    *desc = &(ctx->strings[index][0]);
+    *desc_size = ctx->strings[index][0];
+#endif
+err:
+    return errcode;
+}
+
 /*
  * Libctrl is a device-side control plane, the device is configured in device mode
  */
@@ -955,17 +1984,41 @@ mbed_error_t usbctrl_start_device(uint32_t ctxh)
 
     log_printf("[USBCTRL] configuring backend driver\n");
 
-    if ((errcode = usb_backend_drv_configure(USB_BACKEND_DRV_MODE_DEVICE, usbctrl_handle_inepevent, usbctrl_handle_outepevent)) != MBED_ERROR_NONE) {
+    if ((errcode = usbctrl_drv_configure(ctx, USB_BACKEND_DRV_MODE_DEVICE, usbctrl_handle_inepevent, usbctrl_handle_outepevent)) != MBED_ERROR_NONE) {
         log_printf("[USBCTRL] failed while initializing backend: err=%d\n", errcode);
         goto end;
     }
 
     /* Initialize EP0 with first FIFO. Should be reconfigued at Reset time */
-    if ((errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0)) != MBED_ERROR_NONE) {
+    if ((errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0)) != MBED_ERROR_NONE) {
         log_printf("[USBCTRL] failed to initialize EP0 FIFO!\n");
         goto end;
     }
 
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    /* Interfaces are all declared: build-time descriptors must match them */
+    if ((errcode = usbctrl_check_static_descriptors(ctx)) != MBED_ERROR_NONE) {
+        log_printf("[USBCTRL] build-time descriptors do not match declared interfaces!\n");
+        goto end;
+    }
+#else
+    /* Interfaces are all declared: forge the configuration descriptors now, instead of
+     * doing it in the handler context at enumeration time. A failure here is not fatal,
+     * the descriptor is forged again at the first GET_DESCRIPTOR request. */
+    /*@
+      @ loop invariant 0 <= i <= ctx->num_cfg ;
+      @ loop assigns i, ctx->cfg[0 .. CONFIG_USBCTRL_MAX_CFG-1], SIZE_DESC_FIXED, FLAG ;
+      @ loop variant (ctx->num_cfg - i) ;
+      */
+    for (uint8_t i = 0; i < ctx->num_cfg; ++i) {
+        uint8_t const *desc = NULL;
+        uint32_t desc_size = 0;
+        if (usbctrl_get_configuration_desc(ctx, i, &desc, &desc_size) != MBED_ERROR_NONE) {
+            log_printf("[USBCTRL] unable to forge config %d descriptor yet\n", i);
+        }
+    }
+#endif
+
 end:
     return errcode;
 }
@@ -996,3 +2049,334 @@ mbed_error_t usbctrl_stop_device(uint32_t ctxh)
 err:
     return errcode;
 }
+
+/*
+ * Queue a received SETUP packet (raw content, 8 bytes), converted into current
+ * endianess. Called at driver event time.
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid_read(setup_packet + (0 .. 7));
+    @ assigns ctx->setup_ring ;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_setup_ring_push(usbctrl_context_t *ctx,
+                                     const uint8_t     *setup_packet)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_setup_ring_t *ring = &(ctx->setup_ring);
+    uint8_t head = ring->head;
+    uint8_t depth = (uint8_t)(head - ring->tail);
+
+    if (depth >= CONFIG_USBCTRL_SETUP_RING_SIZE) {
+        ring->lost++;
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto err;
+    }
+    if (depth > 0) {
+        /* previous SETUP packet(s) not handled yet */
+        ring->deep++;
+    }
+    if (depth + 1 > ring->max_depth) {
+        ring->max_depth = depth + 1;
+    }
+    usbctrl_setup_pkt_t *pkt = &(ring->pkt[head & (CONFIG_USBCTRL_SETUP_RING_SIZE - 1)]);
+    pkt->bmRequestType = setup_packet[0];
+    pkt->bRequest = setup_packet[1];
+    pkt->wValue = (uint16_t)(setup_packet[3] << 8 | setup_packet[2]);
+    pkt->wIndex = (uint16_t)(setup_packet[5] << 8 | setup_packet[4]);
+    pkt->wLength = (uint16_t)(setup_packet[7] << 8 | setup_packet[6]);
+    /* the packet must be written before being published */
+    usbctrl_store_release(&(ring->head), head + 1);
+err:
+    return errcode;
+}
+
+/*
+ * Get back the oldest SETUP packet not handled yet. Returns false if there is none.
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid(pkt);
+    @ assigns *pkt, ctx->setup_ring.tail ;
+*/
+bool usbctrl_setup_ring_pop(usbctrl_context_t   *ctx,
+                            usbctrl_setup_pkt_t *pkt)
+{
+    usbctrl_setup_ring_t *ring = &(ctx->setup_ring);
+    uint8_t tail = ring->tail;
+
+    if (tail == usbctrl_load_acquire(&(ring->head))) {
+        return false;
+    }
+    *pkt = ring->pkt[tail & (CONFIG_USBCTRL_SETUP_RING_SIZE - 1)];
+    usbctrl_store_release(&(ring->tail), tail + 1);
+    return true;
+}
+
+/*
+ * Drop the last queued SETUP packet, when its driver event could not be posted.
+ * Called at driver event time: as each SETUP event pops a single packet, the
+ * consumer never reaches a packet whose event is not posted yet.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->setup_ring.head, ctx->setup_ring.lost ;
+*/
+void usbctrl_setup_ring_cancel(usbctrl_context_t *ctx)
+{
+    usbctrl_setup_ring_t *ring = &(ctx->setup_ring);
+
+    ring->lost++;
+    usbctrl_store_release(&(ring->head), (uint8_t)(ring->head - 1));
+}
+
+/*
+ * Drop the SETUP packets queued before the given head (captured at driver event
+ * time), at bus reset execution time. These packets belong to the previous bus
+ * session, and would otherwise shift the following requests handling.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->setup_ring.tail ;
+*/
+void usbctrl_setup_ring_flush(usbctrl_context_t *ctx,
+                              uint8_t            head)
+{
+    usbctrl_setup_ring_t *ring = &(ctx->setup_ring);
+
+    /* packets received after the reset (i.e. after head) are kept */
+    if ((uint8_t)(head - ring->tail) <= CONFIG_USBCTRL_SETUP_RING_SIZE) {
+        usbctrl_store_release(&(ring->tail), head);
+    }
+}
+
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+/*
+ * About EP completions coalescing.
+ *
+ * Instead of calling the upper layer EP handler, each EP completion is only
+ * accounted in the EP record, in the EP events context. The upper layer task
+ * collects all the EPs having pending completions at once (usbctrl_wait_events()),
+ * and then their completions count and size (usbctrl_get_ep_events()).
+ * Each record field has a single writer, so no lock is required.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->ep_events[USBCTRL_EP_ADDR_TO_IDX(ep_addr)] ;
+*/
+void usbctrl_ep_events_record(usbctrl_context_t *ctx,
+                              uint8_t            ep_addr,
+                              uint32_t           size)
+{
+    usbctrl_ep_events_t *events = &(ctx->ep_events[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]);
+
+    /* size must be visible before the completion is published */
+    events->size += size;
+    usbctrl_store_release(&(events->count), events->count + 1);
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns \nothing ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+uint32_t usbctrl_ep_events_pending(usbctrl_context_t const * const ctx,
+                                   uint32_t                       mask)
+{
+    uint32_t pending = 0;
+
+    /*@
+      @ loop invariant 0 <= i <= USBCTRL_EP_TABLE_SIZE ;
+      @ loop assigns i, pending ;
+      @ loop variant (USBCTRL_EP_TABLE_SIZE - i) ;
+      */
+    for (uint8_t i = 0; i < USBCTRL_EP_TABLE_SIZE; ++i) {
+        if ((mask & ((uint32_t)1 << i)) &&
+            ctx->ep_events[i].count != ctx->ep_events[i].count_seen) {
+            pending |= ((uint32_t)1 << i);
+        }
+    }
+    return pending;
+}
+#endif
+
+mbed_error_t usbctrl_wait_events(uint32_t  ctxh,
+                                 uint32_t  mask,
+                                 uint32_t *pending)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || mask == 0 || pending == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+    usbctrl_context_t *ctx = &(ctx_list[ctxh]);
+    for (;;) {
+        bool busy = false;
+# if CONFIG_USBCTRL_DEFERRED_DISPATCH
+        /* EP completions are accounted when the driver events are executed */
+        busy = (usbctrl_dispatch_ctx(ctxh) == MBED_ERROR_BUSY);
+# endif
+        *pending = usbctrl_ep_events_pending(ctx, mask);
+        if (*pending != 0) {
+            break;
+        }
+        if (!busy) {
+            /* woken up by the next USB IRQ */
+            sys_yield();
+        }
+    }
+#else
+    errcode = MBED_ERROR_UNSUPORTED_CMD;
+#endif
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_get_ep_events(uint32_t      ctxh,
+                                   uint8_t       ep,
+                                   usb_ep_dir_t  dir,
+                                   uint32_t     *count,
+                                   uint32_t     *size)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || ep >= USBCTRL_MAX_EP_NUM || dir == USB_EP_DIR_BOTH ||
+        count == NULL || size == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+    uint8_t ep_addr = (dir == USB_EP_DIR_IN) ? (ep | USBCTRL_EP_ADDR_DIR_IN) : ep;
+    usbctrl_ep_events_t *events = &(ctx_list[ctxh].ep_events[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]);
+    uint32_t ev_count;
+    uint32_t ev_size;
+
+    /* the record may be updated by an EP event meanwhile: read it again in that case */
+    do {
+        ev_count = usbctrl_load_acquire(&(events->count));
+        ev_size = events->size;
+    } while (ev_count != usbctrl_load_acquire(&(events->count)));
+    *count = ev_count - events->count_seen;
+    *size = ev_size - events->size_seen;
+    events->count_seen = ev_count;
+    events->size_seen = ev_size;
+#else
+    errcode = MBED_ERROR_UNSUPORTED_CMD;
+#endif
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_get_frame_number(uint32_t  ctxh,
+                                      uint16_t *frame)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || frame == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (!usbctrl_drv_has_frame_number(&(ctx_list[ctxh]))) {
+        errcode = MBED_ERROR_UNSUPORTED_CMD;
+        goto err;
+    }
+    *frame = usbctrl_drv_get_frame_number(&(ctx_list[ctxh]));
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_register_sof_handler(uint32_t              ctxh,
+                                          usbctrl_sof_handler_t handler __attribute__((unused)),
+                                          uint16_t              divisor)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || divisor == 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USBCTRL_SOF_HOOK
+    usbctrl_context_t *ctx = &(ctx_list[ctxh]);
+# ifndef __FRAMAC__
+    if (handler != NULL && handler_sanity_check((physaddr_t)handler)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+# endif
+    /* the SOF events stop while the period is updated, the hook being published
+     * last */
+    usbctrl_store_release(&(ctx->sof_handler), NULL);
+    ctx->sof_divisor = divisor;
+    ctx->sof_count = 0;
+    usbctrl_store_release(&(ctx->sof_handler), handler);
+#else
+    errcode = MBED_ERROR_UNSUPORTED_CMD;
+#endif
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_dispatch_ctx(uint32_t ctxh)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+    errcode = usbctrl_event_dispatch(&(ctx_list[ctxh].event_queue));
+#endif
+err:
+    return errcode;
+}
+
+mbed_error_t usbctrl_dispatch(void)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /*@
+      @ loop invariant 0 <= i <= num_ctx ;
+      @ loop assigns i, errcode ;
+      @ loop variant (num_ctx - i) ;
+      */
+    for (uint8_t i = 0; i < num_ctx; ++i) {
+        mbed_error_t err = usbctrl_dispatch_ctx(i);
+        if (err != MBED_ERROR_NONE) {
+            errcode = err;
+        }
+    }
+    return errcode;
+}
+
+mbed_error_t usbctrl_get_dispatch_stats(uint32_t                  ctxh,
+                                        usbctrl_dispatch_stats_t *stats)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /* sanitize */
+    if (ctxh >= num_ctx || stats == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+    *stats = ctx_list[ctxh].event_queue.stats;
+#else
+    errcode = MBED_ERROR_UNSUPORTED_CMD;
+#endif
+err:
+    return errcode;
+}
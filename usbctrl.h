@@ -27,6 +27,7 @@
 #include "libc/types.h"
 #include "libc/stdio.h"
 #include "api/libusbctrl.h"
+#include "usbctrl_event.h"
 
 #include "libc/sanhandlers.h"
 
@@ -78,13 +79,116 @@
 
 #define MAX_INTERFACES_PER_DEVICE 4
 
+/*
+ * Max descriptor len in bytes. Descriptor may include successive descriptors,
+ * for e.g. in case of configuration descriptor requests, to which we respond
+ * by returning the current device descriptor, configuration descriptor, and,
+ * for each interface active, the interface descriptor and associated
+ * endpoint descriptors.
+ * Other descriptor, for e.g. for String descriptors, may also be large, for
+ * example for internationalization, for which the size is 255.
+ */
+#define MAX_DESCRIPTOR_LEN 256
+
+/* standard descriptors are forged in the context data stage buffer */
+#if CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE < MAX_DESCRIPTOR_LEN
+# error "CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE must be at least MAX_DESCRIPTOR_LEN"
+#endif
+
+/*
+ * Max configuration descriptor len in bytes (wTotalLength). The complete
+ * configuration descriptor (with IAD, interface, class and EP descriptors) of
+ * composite devices may be larger than the other descriptors, and is sent in
+ * multiple packets on the control pipe.
+ */
+#define MAX_CFG_DESCRIPTOR_LEN CONFIG_USBCTRL_MAX_CFG_DESC_LEN
+
+/*
+ * Control pipe max packet size (bMaxPacketSize0), supported by both FS and HS.
+ * Low-speed ports use 8 bytes packets (see usbctrl_update_speed()).
+ */
+#define USBCTRL_EP0_MPSIZE 64
+
+/*
+ * Isochronous feedback value size: 10.14 fixed point on 3 bytes in full-speed,
+ * 16.16 fixed point on 4 bytes in high-speed (USB 2.0 chap. 5.12.4.2)
+ */
+#define USBCTRL_ISO_FEEDBACK_FS_LEN 3
+#define USBCTRL_ISO_FEEDBACK_HS_LEN 4
+
+/*
+ * USB 2.0 defines up to 16 endpoint numbers per direction. The endpoint address
+ * (EP number, with bit 7 set for IN endpoints) is folded into a 32 cells index:
+ * cells 0..15 hold OUT endpoints, cells 16..31 hold IN endpoints.
+ */
+#define USBCTRL_MAX_EP_NUM          16
+
+/*
+ * Gather transfers bounce buffers are only held for the EP numbers handled by the
+ * backend drivers (EP0 to EP8, see usb_backend_drv_ep_nb_t).
+ */
+#define USBCTRL_GATHER_MAX_EP_NUM   (EP8 + 1)
+#define USBCTRL_EP_ADDR_DIR_IN      0x80
+#define USBCTRL_EP_TABLE_SIZE       (2 * USBCTRL_MAX_EP_NUM)
+
+#define USBCTRL_EP_ADDR_TO_IDX(addr) \
+    ((uint8_t)(((addr) & 0x0f) | (((addr) & USBCTRL_EP_ADDR_DIR_IN) >> 3)))
+
+/*
+ * Endpoint table cell. Each endpoint address used by the configuration
+ * references its owning interface and its usb_ep_infos_t cell in it, so that
+ * data-path events are resolved in a single access instead of walking the
+ * whole interfaces list.
+ */
+typedef struct {
+    bool                   declared;          /*< EP address is held by an interface */
+    uint8_t                iface_id;          /*< owning interface cell in the configuration */
+    uint8_t                ep_id;             /*< EP cell in the owning interface */
+    usb_ioep_handler_t     handler;           /*< upper layer data handler (may be NULL) */
+} usbctrl_ep_entry_t;
+
+/*
+ * Control data stage reception, declared by an interface: buffer in which the data
+ * stage is received (NULL for the context buffer) and handler called with the complete
+ * payload.
+ */
+typedef struct {
+    uint8_t                *buf;              /*< reception buffer (NULL: context buffer) */
+    uint16_t                size;             /*< reception buffer size */
+    usb_rqst_data_handler_t handler;          /*< complete payload handler (NULL if not declared) */
+} usbctrl_ctrl_data_t;
+
 typedef struct {
     uint8_t                first_free_epid;   /* first free EP identifier (starting with 1, as 0 is control) */
     uint8_t                interface_num;     /*< Number of interfaces registered */
     usbctrl_interface_t    interfaces[MAX_INTERFACES_PER_DEVICE];     /*< For each registered interface */
+    usbctrl_ep_entry_t     ep_table[USBCTRL_EP_TABLE_SIZE]; /*< EP address to iface/EP resolution */
+    uint8_t                cfg_string;        /*< iConfiguration string index (0 if none) */
+    uint8_t                iface_string[MAX_INTERFACES_PER_DEVICE];    /*< iInterface string index, per interface */
+    uint8_t                function_string[MAX_INTERFACES_PER_DEVICE]; /*< iFunction string index, per composite function master interface */
+    usbctrl_ctrl_data_t    ctrl_data[MAX_INTERFACES_PER_DEVICE];       /*< control data stage reception, per interface */
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    bool                   desc_valid;        /*< cached configuration descriptor is up to date */
+    uint16_t               desc_size;         /*< cached configuration descriptor size */
+    uint8_t                desc[MAX_CFG_DESCRIPTOR_LEN]; /*< cached configuration descriptor */
+#endif
 } usbctrl_configuration_t;
 
 
+/*
+ * Vendor requests are indexed by their bRequest code in an open addressing
+ * table, twice as large as the vendor requests list. Each cell holds the
+ * request cell + 1, 0 meaning a free cell.
+ */
+#define USBCTRL_VENDOR_RQST_MAP_SIZE (2 * CONFIG_USBCTRL_MAX_VENDOR_RQST)
+
+/*
+ * String descriptors are stored already encoded (bLength, bDescriptorType, then
+ * the UTF-16LE string content), in a table indexed by the string index. Cell 0
+ * holds the supported languages list. A cell with a null bLength is free.
+ */
+#define USBCTRL_STRING_DESC_SIZE (2 + 2 * CONFIG_USBCTRL_STRING_MAX_LEN)
+
 typedef enum {
    USB_CTRL_RCV_FIFO_SATE_NOSTORAGE, /*< No receive FIFO set yet */
    USB_CTRL_RCV_FIFO_SATE_FREE,  /*< Receive FIFO is free (no active content in it) */
@@ -95,10 +199,142 @@ typedef enum {
 } ctrl_plane_rx_fifo_state_t;
 
 
+/*
+ * Control pipe IN data stage. Responses larger than the control pipe max packet
+ * size are sent packet per packet, the next packet being sent at the previous one
+ * transmission completion (iepint).
+ */
+typedef struct {
+    const uint8_t          *data;            /*< data stage content, must stay valid up to the stage end */
+    uint16_t                size;            /*< data stage size (truncated to wLength) */
+    uint16_t                offset;          /*< amount of bytes already sent */
+    bool                    zlp;             /*< a ZLP must terminate the data stage */
+} usbctrl_ep0_in_xfer_t;
+
+/*
+ * Control pipe OUT data stage. The data stage is received in the target buffer,
+ * possibly in multiple packets, then the handler is called with the complete
+ * payload.
+ */
+typedef struct {
+    usbctrl_setup_pkt_t     pkt;             /*< SETUP packet of the pending request */
+    usb_rqst_data_handler_t handler;         /*< complete payload handler (NULL: no data stage pending) */
+    uint8_t                *buf;             /*< reception buffer */
+    uint16_t                size;            /*< data stage size (wLength) */
+    uint16_t                offset;          /*< amount of bytes already received */
+} usbctrl_ep0_out_xfer_t;
+
+/*
+ * Endpoint transfers queue. Each EP address has its own queue of submitted
+ * transfers (see usbctrl_submit_in()/usbctrl_submit_out()). The transfer at
+ * tail is in progress. head is only written at submission time, tail at transfer
+ * completion time. Indexes are free running.
+ */
+#if (CONFIG_USBCTRL_XFER_QUEUE_DEPTH & (CONFIG_USBCTRL_XFER_QUEUE_DEPTH - 1)) != 0
+# error "CONFIG_USBCTRL_XFER_QUEUE_DEPTH must be a power of 2"
+#endif
+
+typedef struct {
+    uint8_t                *buf;             /*< transfer buffer */
+    uint32_t                len;             /*< transfer length */
+    uint32_t                flags;           /*< USBCTRL_XFER_FLAG_* */
+    usbctrl_xfer_handler_t  handler;         /*< completion handler */
+    void                   *cookie;          /*< completion handler argument */
+    const usbctrl_iovec_t  *iov;             /*< gather list (IN only), used instead of buf if not NULL */
+    uint8_t                 iovcnt;          /*< gather list length */
+} usbctrl_xfer_t;
+
+/*
+ * Coalesced EP completions record (CONFIG_USBCTRL_EP_EVENTS_COALESCING). count and
+ * size are free running, and only written by the EP events handlers. The *_seen
+ * fields are only written by the usbctrl_get_ep_events() caller. The EP has pending
+ * completions while count != count_seen.
+ */
+typedef struct {
+    volatile uint32_t       count;           /*< completions */
+    volatile uint32_t       size;            /*< bytes sent (IN) or received (OUT) */
+    uint32_t                count_seen;      /*< completions already collected */
+    uint32_t                size_seen;       /*< bytes already collected */
+} usbctrl_ep_events_t;
+
+typedef struct {
+    usbctrl_xfer_t          xfer[CONFIG_USBCTRL_XFER_QUEUE_DEPTH]; /*< submitted transfers */
+    volatile uint8_t        head;            /*< next free slot */
+    volatile uint8_t        tail;            /*< transfer in progress */
+    volatile uint8_t        busy;            /*< EP start ownership, see usbctrl_xfer_push() */
+    uint32_t                offset;          /*< amount of bytes of the current transfer already sent/received */
+    uint16_t                chunk;           /*< size of the IN packet in flight */
+    bool                    zlp;             /*< the terminating ZLP is in flight */
+} usbctrl_xfer_queue_t;
+
+/*
+ * SETUP packets ring. The OTG core can receive up to three back-to-back SETUP
+ * packets before the previous one is handled. Each received SETUP packet is
+ * decoded and queued at driver event time (ISR), then handled in order. head is
+ * only written by the producer (driver event), tail by the consumer (request
+ * handling). Indexes are free running.
+ */
+#if (CONFIG_USBCTRL_SETUP_RING_SIZE & (CONFIG_USBCTRL_SETUP_RING_SIZE - 1)) != 0
+# error "CONFIG_USBCTRL_SETUP_RING_SIZE must be a power of 2"
+#endif
+
+typedef struct {
+    usbctrl_setup_pkt_t     pkt[CONFIG_USBCTRL_SETUP_RING_SIZE]; /*< queued SETUP packets */
+    volatile uint8_t        head;            /*< next free slot */
+    volatile uint8_t        tail;            /*< next SETUP packet to handle */
+    uint8_t                 max_depth;       /*< max number of queued SETUP packets seen */
+    uint32_t                deep;            /*< number of SETUP packets queued behind a pending one */
+    uint32_t                lost;            /*< number of SETUP packets lost (ring full) */
+} usbctrl_setup_ring_t;
+
+/*
+ * Control transfer phases. A control transfer starts with the SETUP packet,
+ * may have a data stage (IN or OUT), then finishes with the status stage.
+ */
+typedef enum {
+    USBCTRL_CTRL_PHASE_IDLE = 0,     /*< no control transfer in progress */
+    USBCTRL_CTRL_PHASE_SETUP,        /*< SETUP packet being handled */
+    USBCTRL_CTRL_PHASE_DATA_IN,      /*< device-to-host data stage in progress */
+    USBCTRL_CTRL_PHASE_DATA_OUT,     /*< host-to-device data stage in progress */
+    USBCTRL_CTRL_PHASE_STATUS,       /*< status stage in progress */
+    USBCTRL_CTRL_PHASE_NUM
+} usbctrl_ctrl_phase_t;
+
+/*
+ * About contexts concurrency.
+ *
+ * All the libusbctrl mutable state is held in the context of each device, so
+ * that several devices can be handled concurrently, from their own ISR or task,
+ * without any shared lock. Inside a context:
+ * - the declaration fields (configurations, interfaces, strings, vendor requests)
+ *   are only written by the API, before usbctrl_start_device(). The context is
+ *   visible from the event handlers only once fully declared.
+ * - the device state (state, address, curr_cfg, ctrl_fifo_state, ctrl_phase,
+ *   control transfers, EP tables activation) is only written by the context
+ *   events path: the device ISR or, in deferred mode, the usbctrl_dispatch_ctx()
+ *   caller. The device state change is its publish point (see usbctrl_sync.h):
+ *   the API reads the device state first, with an acquire load.
+ * - the rings (SETUP ring, deferred events ring, coalesced completions) are
+ *   single-producer, single-consumer, each index or counter having a single
+ *   writer.
+ * - each transfers queue has a single producer, which writes head, both to
+ *   queue a transfer and to withdraw it when it can't be started: the API
+ *   caller for submitted transfers, the events context for ping-pong and
+ *   isochronous EPs, which are re-armed from the completion path (ISR). tail
+ *   is only written by the events context. Starting the transfer at tail is
+ *   owned by whoever takes the queue busy flag, with an atomic exchange (see
+ *   usbctrl_xfer_push()), so that a transfer is never started twice.
+ * The contexts table itself is only written by usbctrl_declare(), which must be
+ * called by a single task at initialization time.
+ */
 typedef struct usbctrl_context {
     /* first, about device driver interactions */
     uint32_t               dev_id;              /*< device id, from the USB device driver */
+    const usb_backend_drv_ops_t *backend;       /*< backend driver operations of the device */
+    uint32_t               ctxh;                /*< context handle, as returned by usbctrl_declare() */
     uint16_t               address;             /*< device address, to be set by std req */
+    usb_backend_drv_port_speed_t speed;         /*< port speed negotiated at reset */
+    uint8_t                ep0_mpsize;          /*< control pipe max packet size at the negotiated speed */
     /* then current context state, associated to the USB standard state automaton  */
     uint8_t                 num_cfg;        /*< number of different onfigurations */
     uint8_t                 curr_cfg;       /*< current configuration */
@@ -106,7 +342,40 @@ typedef struct usbctrl_context {
     uint8_t                 state;          /*< USB state machine current state */
     uint8_t                 ctrl_fifo[CONFIG_USBCTRL_EP0_FIFO_SIZE]; /* RECV FIFO for EP0 */
     ctrl_plane_rx_fifo_state_t ctrl_fifo_state; /*< RECV FIFO of control plane state */
-    bool           ctrl_req_processing; /* a control level request is being processed */
+    usbctrl_setup_ring_t    setup_ring;     /*< received SETUP packets, not handled yet */
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+    usbctrl_event_queue_t   event_queue;    /*< driver events, not executed yet */
+#endif
+    usbctrl_xfer_queue_t    xfer_queue[USBCTRL_EP_TABLE_SIZE]; /*< per EP address submitted transfers */
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+    usbctrl_ep_events_t     ep_events[USBCTRL_EP_TABLE_SIZE]; /*< per EP address coalesced completions */
+#endif
+#if CONFIG_USBCTRL_SOF_HOOK
+    usbctrl_sof_handler_t   sof_handler;    /*< upper layer SOF hook (NULL: none) */
+    uint16_t                sof_divisor;    /*< SOF hook period, in SOF */
+    uint16_t                sof_count;      /*< SOF since the last hook period (driver ISR only) */
+#endif
+#if CONFIG_USBCTRL_XFER_GATHER_BOUNCE_SIZE > 0
+    uint8_t                 gather_bounce[USBCTRL_GATHER_MAX_EP_NUM][CONFIG_USBCTRL_XFER_GATHER_BOUNCE_SIZE]; /*< per IN EP, packets crossing gather segments */
+#endif
+    usbctrl_ctrl_phase_t    ctrl_phase;     /*< current control transfer phase */
+#if CONFIG_USBCTRL_CTRL_TIMESTAMPS
+    uint64_t                ctrl_phase_ts[USBCTRL_CTRL_PHASE_NUM]; /*< last phases entry timestamps (cycles) */
+#endif
+    usbctrl_ep0_in_xfer_t   ep0_in;         /*< control pipe IN data stage in progress */
+    usbctrl_ep0_out_xfer_t  ep0_out;        /*< control pipe OUT data stage in progress */
+    uint8_t                 ctrl_data_buf[CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE]; /*< control requests data stage buffer */
+    /* vendor requests */
+    uint8_t                 vendor_rqst_num;  /*< number of declared vendor requests */
+    usbctrl_vendor_rqst_t   vendor_rqst[CONFIG_USBCTRL_MAX_VENDOR_RQST]; /*< declared vendor requests */
+    uint8_t                 vendor_rqst_map[USBCTRL_VENDOR_RQST_MAP_SIZE]; /*< bRequest to vendor request cell */
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    /* string descriptors */
+    uint8_t                 strings[CONFIG_USBCTRL_MAX_STRINGS][USBCTRL_STRING_DESC_SIZE]; /*< encoded string descriptors */
+#endif
+#ifdef CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE
+    uint8_t                 other_speed_desc[MAX_CFG_DESCRIPTOR_LEN]; /*< last forged other-speed configuration descriptor */
+#endif
 } usbctrl_context_t;
 
 
@@ -131,12 +400,49 @@ bool usbctrl_is_endpoint_halted(usbctrl_context_t *ctx, uint8_t ep);
 
 usb_ep_dir_t usbctrl_get_endpoint_direction(usbctrl_context_t *ctx, uint8_t ep);
 
+usbctrl_ep_entry_t *usbctrl_get_endpoint_entry(usbctrl_context_t *ctx, uint8_t ep_addr);
+
+void usbctrl_ep_table_set_altsetting(usbctrl_configuration_t *cfg,
+                                     uint8_t                  iface_id,
+                                     uint8_t                  alt_setting);
+
 bool usbctrl_is_interface_exists(usbctrl_context_t *ctx, uint8_t iface);
 
+uint16_t usbctrl_ep_mpsize(usb_ep_infos_t const * const     ep,
+                           usb_backend_drv_port_speed_t     speed);
+
+void usbctrl_update_speed(usbctrl_context_t *ctx);
+
+usbctrl_vendor_rqst_t *usbctrl_get_vendor_request(usbctrl_context_t *ctx,
+                                                  uint8_t            bRequest,
+                                                  uint8_t            recipient);
+
 usbctrl_interface_t* usbctrl_get_interface(usbctrl_context_t *ctx, uint8_t iface);
 
+mbed_error_t usbctrl_get_string_desc(usbctrl_context_t *ctx,
+                                     uint8_t            index,
+                                     uint8_t const    **desc,
+                                     uint32_t          *desc_size);
+
 mbed_error_t usbctrl_get_handler(usbctrl_context_t *ctx,
                                  uint32_t *handler);
 
+mbed_error_t usbctrl_setup_ring_push(usbctrl_context_t *ctx,
+                                     const uint8_t     *setup_packet);
+
+bool usbctrl_setup_ring_pop(usbctrl_context_t   *ctx,
+                            usbctrl_setup_pkt_t *pkt);
+
+void usbctrl_setup_ring_cancel(usbctrl_context_t *ctx);
+
+void usbctrl_setup_ring_flush(usbctrl_context_t *ctx,
+                              uint8_t            head);
+
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+void usbctrl_ep_events_record(usbctrl_context_t *ctx,
+                              uint8_t            ep_addr,
+                              uint32_t           size);
+#endif
+
 
 #endif/*!USBCTRL_H_*/
@@ -3,8 +3,9 @@
 #include "api/libusbctrl.h"
 #include "usbctrl_descriptors.h"
 #include "usbctrl.h"
+#include "usbctrl_drv.h"
+#include "usbctrl_static_desc.h"
 
-#define MAX_DESC_STRING_SIZE 32 /* max unicode string size supported (to define properly) */
 /*
  * USB configuration descriptor. Global to the device, specify the
  * device configuration (number of interfaces, power, ...)
@@ -63,7 +64,7 @@ typedef struct __packed usb_ctrl_full_configuration_descriptor {
     @ requires \separated(&ctx_list + (0..(GHOST_num_ctx-1)),&GHOST_num_ctx);
 
     @   ensures  \result == MBED_ERROR_NONE || \result == MBED_ERROR_UNKNOWN || \result ==  MBED_ERROR_INVPARAM || \result == MBED_ERROR_UNSUPORTED_CMD ;
-    @ ensures 0 <= *total_size <=  MAX_DESCRIPTOR_LEN ;
+    @ ensures 0 <= *total_size <=  MAX_CFG_DESCRIPTOR_LEN ;
     @ assigns *total_size, *desc_size, SIZE_DESC_FIXED, FLAG ;
 */
 
@@ -80,7 +81,7 @@ mbed_error_t usbctrl_handle_configuration_size(__out uint8_t                  *b
                                                __out uint32_t                 *total_size)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint8_t class_desc_size = 0;
+    uint32_t class_desc_size = 0;
     uint8_t iad_size = 0;
     uint8_t curr_cfg = ctx->curr_cfg;
     uint8_t iface_num = ctx->cfg[curr_cfg].interface_num;
@@ -129,7 +130,7 @@ mbed_error_t usbctrl_handle_configuration_size(__out uint8_t                  *b
             composite = false;
         }
         if (ctx->cfg[curr_cfg].interfaces[i].class_desc_handler != NULL) {
-            uint8_t max_buf_size = 255 ; /* max for uint8_t, still smaller than current MAX_BUF_SIZE */
+            uint8_t max_buf_size = 255 ; /* max for uint8_t, per-interface class descriptor max size */
 
 #ifndef __FRAMAC__
             if (handler_sanity_check_with_panic((physaddr_t)ctx->cfg[curr_cfg].interfaces[i].class_desc_handler)) {
@@ -152,14 +153,14 @@ mbed_error_t usbctrl_handle_configuration_size(__out uint8_t                  *b
                 goto err;
             }
             log_printf("[LIBCTRL] found one class level descriptor of size %d\n", max_buf_size);
-            if (max_buf_size > (255 - class_desc_size)) {
-                /* uint8_t overflow check */
+            if (class_desc_size + max_buf_size >= MAX_CFG_DESCRIPTOR_LEN) {
+                /* class descriptors alone do not fit in the configuration descriptor */
                 log_printf("[LIBCTRL] class descriptor len too long!\n");
                 errcode = MBED_ERROR_UNSUPORTED_CMD;
                 goto err;
             }
-            /*@ assert max_buf_size <= (255 - class_desc_size); */
-            class_desc_size += (uint8_t)(max_buf_size & 0xff); // CDE in order to calculate size of all class descriptor
+            /*@ assert class_desc_size + max_buf_size < MAX_CFG_DESCRIPTOR_LEN; */
+            class_desc_size += max_buf_size; // CDE in order to calculate size of all class descriptor
         } else {
             class_desc_size += 0;
         }
@@ -193,6 +194,11 @@ mbed_error_t usbctrl_handle_configuration_size(__out uint8_t                  *b
          * because num_ep is <= 8 (case EP_DIR=BOTH) */
 
         local_iface_desc_size += sizeof(usbctrl_interface_descriptor_t) + num_ep * sizeof(usbctrl_endpoint_descriptor_t);
+        /* each alternate setting other than the default one has its own interface descriptor,
+         * the EPs being split between the alternate settings */
+        if (ctx->cfg[curr_cfg].interfaces[i].alt_setting_num > 1) {
+            local_iface_desc_size += (ctx->cfg[curr_cfg].interfaces[i].alt_setting_num - 1) * sizeof(usbctrl_interface_descriptor_t);
+        }
         descriptor_size += local_iface_desc_size;  // CDE : descriptor size without class size
         descriptor_size += iad_size;
 
@@ -207,24 +213,24 @@ mbed_error_t usbctrl_handle_configuration_size(__out uint8_t                  *b
 
     /* now, we have calculated the total amount of bytes required:
      * - configuration descriptor
-     * - for each iface:
+     * - for each iface, for each alternate setting:
      *   * iface descriptor
-     *   * class descriptor (if exists)
+     *   * class descriptor (if exists, default alternate setting only)
      *   * for each endpoint other than control:
      *     x endpoint descriptor
      *
-     * the overall descriptor size in bytes must be smaller or equal to the given buffer size (MAX_DESCRIPTOR_LEN).
+     * the overall descriptor size in bytes must be smaller or equal to the given buffer size (MAX_CFG_DESCRIPTOR_LEN).
      */
 
     //@ split descriptor_size ;
-    if((descriptor_size + class_desc_size) >= MAX_DESCRIPTOR_LEN) {
+    if((descriptor_size + class_desc_size) >= MAX_CFG_DESCRIPTOR_LEN) {
         log_printf("[USBCTRL] not enough space for config descriptor !!!\n");
         errcode = MBED_ERROR_UNSUPORTED_CMD;
         *desc_size = 0;
-        /*@ assert ((class_desc_size + descriptor_size) >= MAX_DESCRIPTOR_LEN); */
+        /*@ assert ((class_desc_size + descriptor_size) >= MAX_CFG_DESCRIPTOR_LEN); */
         goto err;
     }
-    /*@ assert class_desc_size + descriptor_size <= MAX_DESCRIPTOR_LEN; */
+    /*@ assert class_desc_size + descriptor_size <= MAX_CFG_DESCRIPTOR_LEN; */
     *total_size = descriptor_size + class_desc_size ;
 
 #if defined(__FRAMAC__)
@@ -286,6 +292,30 @@ void usbctrl_device_desc_to_buff(__in const usbctrl_device_descriptor_t *cfg, __
     return;
 }
 
+/*@
+    @ requires \separated(cfg + (0 .. sizeof(usbctrl_device_qualifier_descriptor_t)-1), buf + (0 .. sizeof(usbctrl_device_qualifier_descriptor_t)-1));
+    @ requires \valid_read(cfg) && \valid(buf + (0 .. sizeof(usbctrl_device_qualifier_descriptor_t)-1)) ;
+    @ assigns buf[0 .. sizeof(usbctrl_device_qualifier_descriptor_t)-1] ;
+ */
+#ifndef __FRAMAC__
+static inline
+#endif
+void usbctrl_device_qualifier_desc_to_buff(__in const usbctrl_device_qualifier_descriptor_t *cfg, __out uint8_t *buf)
+{
+    buf[0] = cfg->bLength;
+    buf[1] = cfg->bDescriptorType;
+    buf[2] = (uint8_t)(cfg->bcdUSB & 0xff);
+    buf[3] = (uint8_t)(cfg->bcdUSB >> 8) & 0xff;
+    buf[4] = cfg->bDeviceClass;
+    buf[5] = cfg->bDeviceSubClass;
+    buf[6] = cfg->bDeviceProtocol;
+    buf[7] = cfg->bMaxPacketSize0;
+    buf[8] = cfg->bNumConfigurations;
+    buf[9] = cfg->bReserved;
+
+    return;
+}
+
 
 
 /*@
@@ -384,37 +414,6 @@ void usbctrl_interface_desc_to_buff(__in const usbctrl_interface_descriptor_t *c
 }
 
 
-/*@
-    @ requires \separated(cfg + (0 .. sizeof(usbctrl_string_descriptor_t)-1), buf + (0 .. sizeof(usbctrl_string_descriptor_t)-1));
-    @ requires \valid_read(cfg) && \valid(buf + (0 .. sizeof(usbctrl_string_descriptor_t)-1)) ;
-    @ assigns buf[0 .. sizeof(usbctrl_string_descriptor_t)-1] ;
-    //@ ensures \forall integer i; 0 <= i < sizeof(usbctrl_string_descriptor_t) ==> \at(buf[i],Post) == \at(((uint8_t*)cfg)[i],Pre);
- */
-#ifndef __FRAMAC__
-static inline
-#endif
-void usbctrl_string_desc_to_buff(__in const usbctrl_string_descriptor_t *cfg, __out uint8_t *buf)
-{
-    buf[0] = cfg->bLength;
-    buf[1] = cfg->bDescriptorType;
-#ifdef __FRAMAC__
-    /* XXX: PTH: the copy is not exalty (functionaly) the same as the memcpy (which is operational) and must be reviewed */
-    /*@
-      @ loop invariant 0 <= i <= MAX_DESC_STRING_SIZE ;
-      @ loop assigns i, buf[2 .. (2 + (2*(MAX_DESC_STRING_SIZE-1)))] ;
-      @ loop variant MAX_DESC_STRING_SIZE - i ;
-     */
-    for(uint32_t i = 0; i < MAX_DESC_STRING_SIZE; i++){
-        buf[2 + i]   = (uint8_t)(cfg->wString[i] & 0xff);
-        buf[2 + i + 1] = (uint8_t)(cfg->wString[i] >> 8) & 0xff;
-    }
-#else
-    memcpy(&buf[2], &cfg->wString[0], 2*(MAX_DESC_STRING_SIZE));
-#endif
-
-    return;
-}
-
 /*
  * End of the local descriptor to/from buffer assignation functions.
  *
@@ -423,7 +422,7 @@ void usbctrl_string_desc_to_buff(__in const usbctrl_string_descriptor_t *cfg, __
 
 /*@
     @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(..),curr_offset);
-    @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1] ;
+    @ assigns buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1] ;
     @ assigns *curr_offset ;
 
     @ behavior INVPARAM:
@@ -433,13 +432,13 @@ void usbctrl_string_desc_to_buff(__in const usbctrl_string_descriptor_t *cfg, __
 
     @ behavior NOSTORAGE:
     @   assumes !(curr_offset == \null || buf == \null) ;
-    @   assumes (*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
+    @   assumes (*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
     @   ensures \result == MBED_ERROR_NOSTORAGE ;
     @   assigns \nothing ;
 
     @ behavior OK:
     @   assumes !(curr_offset == \null || buf == \null) ;
-    @   assumes !(*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
+    @   assumes !(*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
     @   ensures \result == MBED_ERROR_NONE ;
     @   ensures *curr_offset == \old(*curr_offset) + (uint32_t)sizeof(usbctrl_configuration_descriptor_t) ;
 
@@ -458,7 +457,9 @@ static
 #endif
 mbed_error_t usbctrl_handle_configuration_write_config_desc(uint8_t *buf,
                                                             uint32_t descriptor_size,
+                                                            uint8_t  desc_type,
                                                             uint8_t  iface_num,
+                                                            uint8_t  cfg_string,
                                                             uint32_t *curr_offset)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
@@ -469,7 +470,7 @@ mbed_error_t usbctrl_handle_configuration_write_config_desc(uint8_t *buf,
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    if (*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) {
+    if (*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) {
         errcode = MBED_ERROR_NOSTORAGE;
         goto err;
     }
@@ -484,10 +485,11 @@ mbed_error_t usbctrl_handle_configuration_write_config_desc(uint8_t *buf,
         goto err;
     }
     cfg->wTotalLength = descriptor_size & 0xffff;
-    cfg->bDescriptorType = USB_DESC_CONFIGURATION;
+    /* configuration or other speed configuration */
+    cfg->bDescriptorType = desc_type;
     cfg->bNumInterfaces = iface_num;
     cfg->bConfigurationValue = 1;
-    cfg->iConfiguration = 0;
+    cfg->iConfiguration = cfg_string;
     cfg->bmAttributes.reserved7 = 1;
     cfg->bmAttributes.self_powered = 1;
     cfg->bmAttributes.remote_wakeup = 0;
@@ -504,12 +506,12 @@ err:
 }
 
 /*@
-  @ requires \separated(&SIZE_DESC_FIXED, &FLAG, composite, buf+(0 .. MAX_DESCRIPTOR_LEN-1),curr_offset, ctx + (..));
+  @ requires \separated(&SIZE_DESC_FIXED, &FLAG, composite, buf+(0 .. MAX_CFG_DESCRIPTOR_LEN-1),curr_offset, ctx + (..));
   @ requires \valid(composite);
   @ requires iface_id < ctx->cfg[ctx->curr_cfg].interface_num;
-  @ requires \valid(buf + (0 .. MAX_DESCRIPTOR_LEN-1));
+  @ requires \valid(buf + (0 .. MAX_CFG_DESCRIPTOR_LEN-1));
   @ assigns *composite;
-  @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1 ];
+  @ assigns buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1 ];
   @ assigns *curr_offset;
 
   @ behavior INVPARAM:
@@ -535,7 +537,7 @@ err:
   @   assumes !(curr_offset == \null || buf == \null || ctx == \null) ;
   @   assumes (ctx->cfg[ctx->curr_cfg].interfaces[iface_id].composite_function == \true);
   @   assumes (*composite == \false);
-  @   assumes (*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
+  @   assumes (*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
   @   ensures *composite == \old(*composite);
   @   ensures \result == MBED_ERROR_NOSTORAGE ;
 
@@ -543,7 +545,7 @@ err:
   @   assumes !(curr_offset == \null || buf == \null || ctx == \null) ;
   @   assumes (ctx->cfg[ctx->curr_cfg].interfaces[iface_id].composite_function == \true);
   @   assumes (*composite == \false);
-  @   assumes (*curr_offset <= (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
+  @   assumes (*curr_offset <= (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
   @   ensures \result == MBED_ERROR_NONE ;
 
   @ behavior curcomposite_NOSTORAGE:
@@ -551,7 +553,7 @@ err:
   @   assumes (ctx->cfg[ctx->curr_cfg].interfaces[iface_id].composite_function == \true);
   @   assumes (*composite == \true);
   @   assumes (composite_id != ctx->cfg[ctx->curr_cfg].interfaces[iface_id].composite_function_id) ;
-  @   assumes (*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
+  @   assumes (*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
   @   ensures \result == MBED_ERROR_NOSTORAGE ;
 
   @ behavior curcomposite_OK:
@@ -559,7 +561,7 @@ err:
   @   assumes (ctx->cfg[ctx->curr_cfg].interfaces[iface_id].composite_function == \true);
   @   assumes (*composite == \true);
   @   assumes (composite_id != ctx->cfg[ctx->curr_cfg].interfaces[iface_id].composite_function_id) ;
-  @   assumes (*curr_offset <= (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
+  @   assumes (*curr_offset <= (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
   @   ensures \result == MBED_ERROR_NONE ;
 
   @ complete behaviors ;
@@ -592,14 +594,14 @@ mbed_error_t usbctrl_handle_configuration_write_iad_desc(uint8_t *buf,
             goto err;
         }
         /* overflow check */
-        if (*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_iad_descriptor_t))) {
+        if (*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_iad_descriptor_t))) {
             errcode = MBED_ERROR_NOSTORAGE;
             goto err;
         }
 
         /* new function: new IAD */
         /* composite ifaces start with 0 */
-        /*@ assert *curr_offset < (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_iad_descriptor_t));*/
+        /*@ assert *curr_offset < (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_iad_descriptor_t));*/
         //usbctrl_iad_descriptor_t *cfg = (usbctrl_iad_descriptor_t*)&(buf[*curr_offset]);
         usbctrl_iad_descriptor_t _cfg;
         usbctrl_iad_descriptor_t *cfg = &_cfg;
@@ -625,7 +627,7 @@ mbed_error_t usbctrl_handle_configuration_write_iad_desc(uint8_t *buf,
         cfg->bFunctionClass = ctx->cfg[curr_cfg].interfaces[iface_id].usb_class;
         cfg->bFunctionSubClass = ctx->cfg[curr_cfg].interfaces[iface_id].usb_subclass;
         cfg->bFunctionProtocol = ctx->cfg[curr_cfg].interfaces[iface_id].usb_protocol;
-        cfg->iFunction = 0x04;
+        cfg->iFunction = ctx->cfg[curr_cfg].function_string[iface_id];
 
         usbctrl_iad_desc_to_buff(cfg, (uint8_t*)&(buf[*curr_offset]));
 
@@ -642,7 +644,7 @@ err:
 
 /*@
     @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(..),curr_offset, ctx + (..));
-    @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1 ];
+    @ assigns buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1 ];
     @ assigns *curr_offset;
 
     @ behavior INVPARAM:
@@ -652,20 +654,20 @@ err:
 
     @ behavior NOSTORAGE:
     @   assumes !(curr_offset == \null || buf == \null || ctx == \null) ;
-    @   assumes (*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
+    @   assumes (*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
     @   ensures \result == MBED_ERROR_NOSTORAGE ;
     @   ensures *curr_offset == \old(*curr_offset);
 
     @ behavior bad_iface:
     @   assumes !(curr_offset == \null || buf == \null || ctx == \null) ;
-    @   assumes !(*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
+    @   assumes !(*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
     @   assumes iface_id >= MAX_INTERFACES_PER_DEVICE ;
     @   ensures \result == MBED_ERROR_INVPARAM ;
     @   ensures *curr_offset == \old(*curr_offset);
 
     @ behavior OK:
     @   assumes !(curr_offset == \null || buf == \null || ctx == \null) ;
-    @   assumes !(*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
+    @   assumes !(*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_configuration_descriptor_t))) ;
     @   assumes iface_id < MAX_INTERFACES_PER_DEVICE ;
     @   ensures \result == MBED_ERROR_NONE ;
     @   ensures *curr_offset == \old(*curr_offset) + sizeof(usbctrl_interface_descriptor_t) ;
@@ -685,6 +687,7 @@ static
 mbed_error_t usbctrl_handle_configuration_write_iface_desc(uint8_t *buf,
                                                            usbctrl_context_t const * const ctx,
                                                            uint8_t iface_id,
+                                                           uint8_t alt_setting,
                                                            uint32_t * curr_offset)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
@@ -695,7 +698,7 @@ mbed_error_t usbctrl_handle_configuration_write_iface_desc(uint8_t *buf,
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    if (*curr_offset > (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_interface_descriptor_t))) {
+    if (*curr_offset > (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_interface_descriptor_t))) {
         errcode = MBED_ERROR_NOSTORAGE;
         goto err;
     }
@@ -716,7 +719,7 @@ mbed_error_t usbctrl_handle_configuration_write_iface_desc(uint8_t *buf,
     cfg->bLength = sizeof(usbctrl_interface_descriptor_t);
     cfg->bDescriptorType = USB_DESC_INTERFACE;
     cfg->bInterfaceNumber = iface_id;
-    cfg->bAlternateSetting = 0;
+    cfg->bAlternateSetting = alt_setting;
 
     /*@
        @ loop invariant 0 <= ep <= ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number ;
@@ -726,6 +729,10 @@ mbed_error_t usbctrl_handle_configuration_write_iface_desc(uint8_t *buf,
     */
 
     for (uint8_t ep = 0; ep < ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number; ++ep) {
+        if (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep].alt_setting != alt_setting) {
+            /* EP of another alternate setting */
+            continue;
+        }
         if (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep].type != USB_EP_TYPE_CONTROL) {
             ++num_ep;
         }
@@ -737,7 +744,7 @@ mbed_error_t usbctrl_handle_configuration_write_iface_desc(uint8_t *buf,
     cfg->bInterfaceClass = (uint8_t)ctx->cfg[curr_cfg].interfaces[iface_id].usb_class;
     cfg->bInterfaceSubClass = ctx->cfg[curr_cfg].interfaces[iface_id].usb_subclass;
     cfg->bInterfaceProtocol = ctx->cfg[curr_cfg].interfaces[iface_id].usb_protocol;
-    cfg->iInterface = iface_id;
+    cfg->iInterface = ctx->cfg[curr_cfg].iface_string[iface_id];
 
     usbctrl_interface_desc_to_buff(cfg, (uint8_t*)&(buf[*curr_offset]));
 
@@ -750,7 +757,7 @@ err:
 
 /*@
     @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(..),curr_offset, ctx + (..));
-    @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1 ];
+    @ assigns buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1 ];
     @ assigns *curr_offset, FLAG;
 
     @ behavior INVPARAM:
@@ -807,7 +814,7 @@ mbed_error_t usbctrl_handle_configuration_write_class_desc(usbctrl_context_t * c
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    max_buf_size = MAX_DESCRIPTOR_LEN - *curr_offset;
+    max_buf_size = MAX_CFG_DESCRIPTOR_LEN - *curr_offset;
     // class level descriptor of current interface
 
     if (ctx->cfg[curr_cfg].interfaces[iface_id].class_desc_handler) {
@@ -823,8 +830,8 @@ mbed_error_t usbctrl_handle_configuration_write_class_desc(usbctrl_context_t * c
         /* FIXME: there is a RTE here, to check if the semantic of __FRAMAC__ version is okay, using a noRTE statement globaly */
         /* we need to get back class level descriptor from upper layer. Although, we have already consumed a part of the target buffer and
          * thus we reduce the max allowed size for class descriptor.
-         * normally we can assert cur_offset >= MAX_DESCRIPTOR_LEN */
-        if (max_buf_size > 256) {
+         * normally we can assert cur_offset >= MAX_CFG_DESCRIPTOR_LEN */
+        if (max_buf_size > 255) {
             class_desc_max_size = 255;
         } else {
             /* reducing buffer to effective max buf size if shorter than uint8_t size */
@@ -855,11 +862,40 @@ err:
     return errcode;
 }
 
+/*
+ * About other speed descriptors.
+ *
+ * A high-speed capable device describes, with the device qualifier and the other
+ * speed configuration descriptors, how it would behave when operating at the other
+ * speed (full-speed when the port is high-speed, and conversely). The other speed
+ * configuration is forged from the same declared interfaces. Only the endpoints max
+ * packet size (the EP size of the other speed, see usbctrl_ep_mpsize()) and the
+ * interrupt polling interval encoding differ.
+ */
+
 /*@
-    @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(0 .. MAX_DESCRIPTOR_LEN-1),curr_offset, ctx + (..));
+    @ requires \valid_read(ctx);
+*/
+#ifndef __FRAMAC__
+static
+#endif
+usb_backend_drv_port_speed_t usbctrl_get_desc_speed(usbctrl_context_t const * const ctx,
+                                                    bool                            other_speed)
+{
+    usb_backend_drv_port_speed_t speed = usbctrl_drv_get_speed(ctx);
+
+    if (other_speed == true) {
+        speed = (speed == USB_BACKEND_DRV_PORT_HIGHSPEED) ?
+                    USB_BACKEND_DRV_PORT_FULLSPEED : USB_BACKEND_DRV_PORT_HIGHSPEED;
+    }
+    return speed;
+}
+
+/*@
+    @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(0 .. MAX_CFG_DESCRIPTOR_LEN-1),curr_offset, ctx + (..));
     @ requires iface_id < ctx->cfg[ctx->curr_cfg].interface_num;
-    @ requires \valid(buf + (0 .. MAX_DESCRIPTOR_LEN-1));
-    @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1 ];
+    @ requires \valid(buf + (0 .. MAX_CFG_DESCRIPTOR_LEN-1));
+    @ assigns buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1 ];
     @ assigns *curr_offset;
 
     @ behavior INVPARAM:
@@ -869,13 +905,13 @@ err:
 
     @ behavior NOSTORAGE:
     @   assumes !(curr_offset == \null || buf == \null || ctx == \null) ;
-    @   assumes (*curr_offset >= (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
+    @   assumes (*curr_offset >= (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
     @   ensures \result == MBED_ERROR_NOSTORAGE ;
     @   ensures *curr_offset == \old(*curr_offset) ;
 
     @ behavior OK:
     @   assumes !(curr_offset == \null || buf == \null || ctx == \null) ;
-    @   assumes !(*curr_offset >= (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
+    @   assumes !(*curr_offset >= (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) ;
     @   ensures \result == MBED_ERROR_NONE ;
     @   ensures *curr_offset == \old(*curr_offset) + sizeof(usbctrl_endpoint_descriptor_t) ;
 
@@ -897,18 +933,20 @@ mbed_error_t usbctrl_handle_configuration_write_ep_desc(usbctrl_context_t const
                                                         usb_ep_dir_t ep_dir,
                                                         uint8_t    iface_id,
                                                         uint8_t    curr_cfg,
+                                                        bool       other_speed,
                                                         uint32_t * curr_offset)
 {
 
     mbed_error_t errcode = MBED_ERROR_NONE;
 
     uint8_t poll = 0;
+    usb_backend_drv_port_speed_t speed;
 
     if (buf == NULL || curr_offset == NULL || ctx == NULL) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    if (*curr_offset >= (MAX_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) {
+    if (*curr_offset >= (MAX_CFG_DESCRIPTOR_LEN - sizeof(usbctrl_endpoint_descriptor_t))) {
         errcode = MBED_ERROR_NOSTORAGE;
         goto err;
     }
@@ -927,7 +965,12 @@ mbed_error_t usbctrl_handle_configuration_write_ep_desc(usbctrl_context_t const
         (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].type       |
          ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].attr << 2  |
          ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].usage << 4);
-    cfg->wMaxPacketSize = ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].pkt_maxsize;
+    speed = usbctrl_get_desc_speed(ctx, other_speed);
+    if (other_speed == true) {
+        cfg->wMaxPacketSize = usbctrl_ep_mpsize(&(ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number]), speed);
+    } else {
+        cfg->wMaxPacketSize = ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].pkt_maxsize;
+    }
 
     /* See table 9.3: microframe interval: bInterval specification */
     if (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].type == USB_EP_TYPE_INTERRUPT) {
@@ -946,7 +989,7 @@ mbed_error_t usbctrl_handle_configuration_write_ep_desc(usbctrl_context_t const
             log_printf("[USBCTRL] invalid poll interval %d\n", poll);
             poll = 1;
         }
-        if (usb_backend_drv_get_speed() == USB_BACKEND_DRV_PORT_HIGHSPEED) {
+        if (speed == USB_BACKEND_DRV_PORT_HIGHSPEED) {
             /* value in poll is set in ms, in HS, value is 2^(interval-1)*125us
              * here, we get the position of the first bit at 1 in poll value, and add 2 to this
              * value, to get the same result as the above */
@@ -1056,8 +1099,7 @@ mbed_error_t usbctrl_handle_device_desc(uint8_t                   *buf,
     cfg->bDeviceClass = 0; /* replaced by default iface */
     cfg->bDeviceSubClass = 0;
     cfg->bDeviceProtocol = 0;
-    cfg->bMaxPacketSize = 64; /* on EP0. TODO: requests MPsize from driver, depends on speed negociation,
-                                  HS & FS supports 64, but FS allows smaller mpsize. */
+    cfg->bMaxPacketSize = ctx->ep0_mpsize; /* on EP0, depends on the negotiated speed */
     cfg->idVendor = CONFIG_USR_LIB_USBCTRL_DEV_VENDORID;
     cfg->idProduct = CONFIG_USR_LIB_USBCTRL_DEV_PRODUCTID;
     cfg->bcdDevice = 0x000;
@@ -1074,163 +1116,508 @@ err:
     return errcode;
 }
 
-
-
-/*********************************************************************************
- * string descriptor handling fonction
+#ifdef CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE
+/*
+ * The device qualifier holds the device descriptor fields that may change at the
+ * other speed. The control pipe max packet size (64) is the same in FS and HS.
  */
 
 /*@
-    @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(0 .. MAX_DESCRIPTOR_LEN-1),desc_size+(..),pkt+(..));
-//    @ ensures (\result == MBED_ERROR_UNSUPORTED_CMD &&  *desc_size == 0) ||
-//         (\result == MBED_ERROR_NONE && (*desc_size == 4 || *desc_size == (2 + 2 * sizeof(CONFIG_USB_DEV_MANUFACTURER))
-//                                    || *desc_size == (2 + 2 * sizeof(CONFIG_USB_DEV_PRODNAME)) || *desc_size == (2 + 2 * sizeof(CONFIG_USB_DEV_SERIAL) ))) ;
+    @ requires \separated(buf+(0 .. MAX_DESCRIPTOR_LEN-1),desc_size,ctx+(..));
+    @ requires \valid(buf + (0 .. MAX_DESCRIPTOR_LEN-1));
+    @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1];
+    @ assigns *desc_size;
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_handle_device_qualifier_desc(uint8_t                   *buf,
+                                                  uint32_t                  *desc_size,
+                                                  usbctrl_context_t const   * const ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_device_qualifier_descriptor_t _cfg;
+    usbctrl_device_qualifier_descriptor_t *cfg = &_cfg;
 
-    @  assigns buf[0 .. MAX_DESCRIPTOR_LEN-1], *desc_size;
+    if (buf == NULL || desc_size == NULL || ctx == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    log_printf("[USBCTRL] request device qualifier desc (num cfg: %d)\n", ctx->num_cfg);
 
-    @ behavior INVPARAM:
-    @   assumes (desc_size == \null || buf == \null || pkt == \null) ;
-    @   ensures \result == MBED_ERROR_INVPARAM ;
+    cfg->bLength = sizeof(usbctrl_device_qualifier_descriptor_t);
+    cfg->bDescriptorType = USB_DESC_DEV_QUALIFIER;
+    cfg->bcdUSB = 0x0200; /* USB 2.0 */
+    cfg->bDeviceClass = 0; /* replaced by default iface */
+    cfg->bDeviceSubClass = 0;
+    cfg->bDeviceProtocol = 0;
+    cfg->bMaxPacketSize0 = USBCTRL_EP0_MPSIZE;
+    cfg->bNumConfigurations = ctx->num_cfg;
+    cfg->bReserved = 0;
 
-    @ behavior INVCMD:
-    @   assumes !(desc_size == \null || buf == \null || pkt == \null) ;
-    @   assumes (((pkt->wValue & 0xff) != (uint16_t)0x0) &&
-               ((pkt->wValue & 0xff) != (uint16_t)CONFIG_USB_DEV_MANUFACTURER_INDEX) &&
-               ((pkt->wValue & 0xff) != (uint16_t)CONFIG_USB_DEV_PRODNAME_INDEX) &&
-               ((pkt->wValue & 0xff) != (uint16_t)CONFIG_USB_DEV_SERIAL_INDEX));
-    @   ensures \result == MBED_ERROR_UNSUPORTED_CMD;
+    *desc_size = sizeof(usbctrl_device_qualifier_descriptor_t);
 
-    @ behavior ok:
-    @   assumes !(desc_size == \null || buf == \null || pkt == \null) ;
-    @   assumes !(((pkt->wValue & 0xff) != (uint16_t)0x0) &&
-                ((pkt->wValue & 0xff) != (uint16_t)CONFIG_USB_DEV_MANUFACTURER_INDEX) &&
-                ((pkt->wValue & 0xff) != (uint16_t)CONFIG_USB_DEV_PRODNAME_INDEX) &&
-                ((pkt->wValue & 0xff) != (uint16_t)CONFIG_USB_DEV_SERIAL_INDEX));
-    @   ensures \result == MBED_ERROR_NONE;
+    usbctrl_device_qualifier_desc_to_buff(cfg, buf);
+err:
+    return errcode;
+}
+#endif
 
 
-    @ complete behaviors;
-    @ disjoint behaviors;
 
+/*********************************************************************************
+ * string descriptor handling fonction
+ */
+
+/*
+ * String descriptors are encoded once, when declared (see usbctrl_declare_string()).
+ * Here, the requested one is only copied from the strings table.
+ */
+
+/*@
+    @ requires \separated(buf+(0 .. MAX_DESCRIPTOR_LEN-1),desc_size+(..),ctx+(..),pkt+(..));
+    @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1], *desc_size;
+    @ ensures \result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM || \result == MBED_ERROR_UNSUPORTED_CMD ;
 */
 
 #ifndef __FRAMAC__
 static
 #endif
-mbed_error_t usbctrl_handle_string_desc(__out uint8_t    *buf,
-                                        __out uint32_t              *desc_size,
+mbed_error_t usbctrl_handle_string_desc(__out uint8_t                     *buf,
+                                        __out uint32_t                    *desc_size,
+                                        __in  usbctrl_context_t           *ctx,
                                         __in  usbctrl_setup_pkt_t  const  * const pkt)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    if (buf == NULL || desc_size == NULL || pkt == NULL) {
+    uint8_t const *desc = NULL;
+    uint32_t size = 0;
+
+    if (buf == NULL || desc_size == NULL || ctx == NULL || pkt == NULL) {
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
-    /*@ assert \valid(buf + (0 .. MAX_DESCRIPTOR_LEN-1)); */
-    /*@ assert \valid(desc_size); */
-    /*@ assert \valid_read(pkt); */
+    errcode = usbctrl_get_string_desc(ctx, (pkt->wValue & 0xff), &desc, &size);
+    if (errcode != MBED_ERROR_NONE) {
+        log_printf("[USBCTRL] Unsupported string index requested.\n");
+        goto err;
+    }
+    /*@ assert size < MAX_DESCRIPTOR_LEN; */
+    memcpy(buf, desc, size);
+    *desc_size = size;
+err:
+    return errcode;
+}
 
-    /*@ assert sizeof(usbctrl_string_descriptor_t) < MAX_DESCRIPTOR_LEN; */
-    const char *USB_DEV_MANUFACTURER = CONFIG_USB_DEV_MANUFACTURER;
-    const char *USB_DEV_PRODNAME = CONFIG_USB_DEV_PRODNAME;
-    const char *USB_DEV_SERIAL = CONFIG_USB_DEV_SERIAL;
-    uint8_t string_type = pkt->wValue & 0xff;
 
-    log_printf("[USBCTRL] create string desc\n");
-    //usbctrl_string_descriptor_t *cfg = (usbctrl_string_descriptor_t *)&(buf[0]);
-    usbctrl_string_descriptor_t _cfg;
-    usbctrl_string_descriptor_t *cfg = &_cfg;
-    /* wString content has a dynamic len, depending on the string index reference.
-     * For defense in depth, the overall wString content is purged */
+/*
+ * Forge the complete configuration descriptor of the current configuration
+ * (configuration descriptor, then for each interface its IAD, interface,
+ * class and EP descriptors) in the given buffer. When other_speed is set, the
+ * other speed configuration descriptor is forged instead.
+ */
+
+/*@
+    @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(0 .. MAX_CFG_DESCRIPTOR_LEN-1),desc_size,ctx+(..));
+    @ requires \valid(buf + (0 .. MAX_CFG_DESCRIPTOR_LEN-1));
+    @ requires \valid(desc_size);
+    @ assigns buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1];
+    @ assigns *desc_size;
+    @ assigns SIZE_DESC_FIXED, FLAG;
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_handle_configuration_desc(__out uint8_t            *buf,
+                                               __out uint32_t           *desc_size,
+                                               __in  usbctrl_context_t  *ctx,
+                                               __in  bool                other_speed)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    /* is there, at upper layer, an additional class descriptor for
+     * current configuration ? if yes, we get back this descriptor
+     * and add it to the complete configuration descriptor we send
+     * to the host. */
+    /* Here, we only calculate, for each interface, if there is a
+     * class descriptor, its size. The effective descriptor will
+     * be stored later, when the overall configuration descriptor
+     * is forged. */
+    uint32_t descriptor_size = 0;
+    uint8_t curr_cfg = ctx->curr_cfg;
 
-    /*@
-      @ loop invariant 0 <= i <= MAX_DESC_STRING_SIZE ;
-      @ loop assigns i, cfg->wString[0 .. MAX_DESC_STRING_SIZE-1] ;
-      @ loop variant MAX_DESC_STRING_SIZE - i ;
-      */
-    for (uint32_t i = 0; i < MAX_DESC_STRING_SIZE; ++i) {
-        cfg->wString[i] = (uint16_t)0x0;
+    errcode = usbctrl_handle_configuration_size(buf, desc_size, ctx, &descriptor_size);
+    if (errcode != MBED_ERROR_NONE) {
+        log_printf("[USBCTRL] failure while calculating total desc size\n");
+        goto err;
     }
+    /*@ assert descriptor_size < MAX_CFG_DESCRIPTOR_LEN; */
 
-    uint32_t maxlen = 0;
-    /* INFO:  UTF16 double each size */
+    /*
+     * From now on, we *know* that the overall descriptor size is smaller than the buffer max supported
+     * length. We can add successive descriptors into it without risking to overflow the buffer.
+     * Descriptors are concatenated with regard to the USB configuration descriptor standard hierarchy,
+     * using the same list of descriptor as calculated above.
+     *
+     * The input buffer is a uint8_t* generic buffer as USB descriptor content is a dynamic, runtime
+     * caclucated, list of structure. To handle this, as unions can't be used due to dynamicity, we
+     * use an offset in the buffer (a uint8_t * pointer) which always target the begining of the currently
+     * being written descriptor. This pointer is explicitely casted into the descriptor that need to be
+     * written in order to properly handle the descriptor fields. The offset is then incremented using
+     * the descriptor size.
+     *
+     * C scoping is used for each descriptor handling to avoid any variable shadowing. Each typed
+     * descriptor pointer is named 'cfg' and its scope is reduced to the currently being handled descriptor
+     * only.
+     */
+    uint32_t curr_offset = 0;
+    uint8_t iface_num = ctx->cfg[curr_cfg].interface_num;
 
-    switch (string_type) {
-        case 0:
-            cfg->bDescriptorType = USB_DESC_STRING;
-            cfg->bLength = 4;
-            cfg->wString[0] = LANGUAGE_ENGLISH;
-            *desc_size = 4;
-            break;
+    log_printf("[USBCTRL] create config desc of size %d with %d ifaces\n", descriptor_size, iface_num);
+    /*
+     * First, creating the configuration descriptor
+     */
+    errcode = usbctrl_handle_configuration_write_config_desc(buf, descriptor_size,
+                                                             other_speed ? USB_DESC_OTHER_SPEED_CFG : USB_DESC_CONFIGURATION,
+                                                             iface_num, ctx->cfg[curr_cfg].cfg_string, &curr_offset);
+    if (errcode != MBED_ERROR_NONE) {
+        /* by now, this should be dead code as the above function should  never fails*/
+        goto err;
+    }
 
-        case CONFIG_USB_DEV_MANUFACTURER_INDEX:
-            maxlen = (sizeof(CONFIG_USB_DEV_MANUFACTURER) > 32 ? 32 : sizeof(CONFIG_USB_DEV_MANUFACTURER));
-            cfg->bDescriptorType = USB_DESC_STRING;
-            cfg->bLength = 2 + 2 * maxlen;
+    /* there can be 1, 2 or more interfaces. interfaces offset depends on the previous
+     * interfaces number, and are calculated depending on the previous interfaces
+     * descriptors (iface+ep) size.
+     * To do this, we start at offset 0 after configuration descriptor for the first
+     * interface, and at the end of each interface, we increment the offset of the size
+     * of the complete interface descriptor, including EP. */
+    uint8_t max_ep_number ;  // new variable for variant and invariant proof
+
+    /* @
+       @ loop invariant 0 <= iface_id <= iface_num ;
+       @ loop invariant 0 <= curr_offset <= MAX_CFG_DESCRIPTOR_LEN ;
+       @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces + (0..(iface_num -1))) ;
+       @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces[iface_id].eps + (0..(ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number -1))) ;
+       @ loop invariant \valid(buf + (0..(MAX_CFG_DESCRIPTOR_LEN-1)));
+       @ loop invariant \separated(ctx->cfg[curr_cfg].interfaces[iface_id].eps + (0..(ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number -1)),buf + (0..(MAX_CFG_DESCRIPTOR_LEN-1)));
+       */
 
-            /*@
-              @ loop invariant 0 <= i <= maxlen ;
-              @ loop assigns i, *cfg ;
-              @ loop variant maxlen - i ;
-              */
-            for (uint32_t i = 0; i < maxlen; ++i) {
-                cfg->wString[i] = USB_DEV_MANUFACTURER[i];
+    bool composite = false;
+    uint8_t composite_id = 0;
+    /*@
+      @ loop invariant 0 <= iface_id <= iface_num;
+      @ loop invariant \separated(&SIZE_DESC_FIXED, &FLAG, &composite, buf + (0 .. MAX_CFG_DESCRIPTOR_LEN-1), &curr_offset, &max_ep_number, &iface_id, &errcode, ctx_list + (0 .. MAX_USB_CTRL_CTX-1));
+      @ loop assigns max_ep_number, iface_id, errcode, composite, buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1 ], curr_offset, FLAG;
+      @ loop variant iface_num - iface_id;
+     */
+    for (uint8_t iface_id = 0; iface_id < iface_num; ++iface_id) {
+        /*
+         * for each interface, we first need to add the interface descriptor
+         */
+        // COMPOSITE IAD header
+        errcode = usbctrl_handle_configuration_write_iad_desc(buf, ctx, &composite, composite_id, iface_id, &curr_offset);
+        if (errcode != MBED_ERROR_NONE) {
+            /* by now, this should be dead code as the above function should  never fails*/
+            goto err;
+        }
+        /*
+         * then, for each alternate setting, the interface descriptor followed by the
+         * alternate setting EPs
+         */
+        uint8_t alt_num = ctx->cfg[curr_cfg].interfaces[iface_id].alt_setting_num;
+        if (alt_num == 0) {
+            alt_num = 1;
+        }
+        /*@
+          @ loop invariant 0 <= alt <= alt_num;
+          @ loop assigns max_ep_number, alt, errcode, buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1 ], curr_offset, FLAG;
+          @ loop variant alt_num - alt;
+          */
+        for (uint8_t alt = 0; alt < alt_num; ++alt) {
+            errcode = usbctrl_handle_configuration_write_iface_desc(buf, ctx, iface_id, alt, &curr_offset);
+            if (errcode != MBED_ERROR_NONE) {
+                /* by now, this should be dead code as the above function should  never fails*/
+                goto err;
             }
-            *desc_size = 2 + 2 * maxlen;
-            break;
 
-        case CONFIG_USB_DEV_PRODNAME_INDEX:
-            maxlen = (sizeof(CONFIG_USB_DEV_PRODNAME) > 32 ? 32 : sizeof(CONFIG_USB_DEV_PRODNAME));
-            cfg->bDescriptorType = USB_DESC_STRING;
-            cfg->bLength = 2 + 2 * maxlen;
-
-            /*@
-              @ loop invariant 0 <= i <= maxlen ;
-              @ loop assigns i, *cfg ;
-              @ loop variant maxlen - i ;
-              */
-            for (uint32_t i = 0; i < maxlen; ++i) {
-                cfg->wString[i] = USB_DEV_PRODNAME[i];
+            /*
+             * for each interface, we may then add the associated class descriptor, if it exsists.
+             * The class descriptor getter is not alternate setting aware: the class descriptor
+             * is sent with the default alternate setting.
+             */
+            if (alt == 0) {
+                errcode = usbctrl_handle_configuration_write_class_desc(ctx, buf, iface_id, &curr_offset);
+                if (errcode != MBED_ERROR_NONE) {
+                    goto err;
+                }
             }
-            *desc_size = 2 + 2 * maxlen;
-            break;
 
-        case CONFIG_USB_DEV_SERIAL_INDEX:
-            maxlen = (sizeof(CONFIG_USB_DEV_SERIAL) > 32 ? 32 : sizeof(CONFIG_USB_DEV_SERIAL));
-            cfg->bDescriptorType = USB_DESC_STRING;
-            cfg->bLength = 2 + 2 * maxlen;
+            /*
+             * for each interface, we finish with each endpoint descriptor, for all non-control EP
+             * INFO: libusbctrl consider that the device handle a signe control EP: EP0
+             */
+            /* and for this interface, handling each EP */
+
+
+            max_ep_number = ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number ;  // variable change in loop
 
             /*@
-              @ loop invariant 0 <= i <= maxlen ;
-              @ loop assigns i, *cfg ;
-              @ loop variant maxlen - i ;
+              @ loop invariant 0 <= iface_id <= iface_num;
+              @ loop invariant 0 <= alt <= alt_num;
+              @ loop invariant 0 <= ep_number <= max_ep_number;
+              @ loop invariant \separated(buf + (0 .. MAX_CFG_DESCRIPTOR_LEN-1), &curr_offset, &ep_number, &errcode, ctx_list + (0 .. MAX_USB_CTRL_CTX-1));
+              @ loop assigns buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1], curr_offset, ep_number, errcode;
+              @ loop variant max_ep_number - ep_number;
               */
-            for (uint32_t i = 0; i < maxlen; ++i) {
-                cfg->wString[i] = USB_DEV_SERIAL[i];
+            for (uint8_t ep_number = 0; ep_number < max_ep_number; ++ep_number) {
+
+                usb_ep_dir_t ep_dir = ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].dir;
+
+                if (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].type == USB_EP_TYPE_CONTROL) {
+                    /* Control EP (EP0 usage) are not declared here */
+                    continue;
+                }
+                if (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].alt_setting != alt) {
+                    /* EP of another alternate setting */
+                    continue;
+                }
+                switch (ep_dir) {
+                    case USB_EP_DIR_BOTH:
+                        /* full duplex EP, first handling IP EP descriptor, then handling OUT just after */
+                        errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_IN, iface_id, curr_cfg, other_speed, &curr_offset);
+                        if (errcode != MBED_ERROR_NONE) {
+                            goto err;
+                        }
+                        errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_OUT, iface_id, curr_cfg, other_speed, &curr_offset);
+                        if (errcode != MBED_ERROR_NONE) {
+                            goto err;
+                        }
+                        break;
+                    case USB_EP_DIR_IN:
+                        errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_IN, iface_id, curr_cfg, other_speed, &curr_offset);
+                        if (errcode != MBED_ERROR_NONE) {
+                            goto err;
+                        }
+                        break;
+                    case USB_EP_DIR_OUT:
+                        errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_OUT, iface_id, curr_cfg, other_speed, &curr_offset);
+                        if (errcode != MBED_ERROR_NONE) {
+                            goto err;
+                        }
+                        break;
+                    default:
+                        errcode = MBED_ERROR_INVPARAM;
+                        goto err;
+
+                }
             }
-            *desc_size = 2 + 2 * maxlen;
-            break;
+        }
+    /* returns the descriptor */
+    }
+    /* total configuration descriptor has be forged, update the size */
+    if (descriptor_size != curr_offset) {
+        /* This SHOULD NOT be possible !!! */
+        log_printf("[USBCTRL] forged descriptor size (%d) different from the calculated one (%d) !!!\n", curr_offset, descriptor_size);
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+    /*@ assert descriptor_size == curr_offset ; */
+    *desc_size = descriptor_size;
+    //@ merge SIZE_DESC_FIXED ;
+err:
+    return errcode;
+}
 
-        default:
-            log_printf("[USBCTRL] Unsupported string index requested.\n");
-            errcode = MBED_ERROR_UNSUPORTED_CMD;
+/*
+ * Configuration descriptor cache accessor.
+ *
+ * The configuration descriptor only depends on the declared interfaces, which do
+ * not change once the device is started. It is then forged once per configuration
+ * and stored in the configuration cell, so that successive GET_DESCRIPTOR requests
+ * (the host usually asks for the 9 bytes header first, then for the whole
+ * descriptor) are served without calling the class handlers again.
+ * The cache is invalidated each time an interface is declared in the configuration.
+ * With build-time descriptors, there is no cache: the generated flash blob is returned.
+ */
+
+/*@
+    @ requires \separated(&SIZE_DESC_FIXED, &FLAG, desc, desc_size, ctx+(..));
+    @ assigns ctx->cfg[cfg_id], *desc, *desc_size;
+    @ assigns SIZE_DESC_FIXED, FLAG;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_get_configuration_desc(__in  usbctrl_context_t  *ctx,
+                                            __in  uint8_t             cfg_id,
+                                            __out uint8_t const     **desc,
+                                            __out uint32_t           *desc_size)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+#ifndef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    usbctrl_configuration_t *cfg = NULL;
+    uint32_t size = 0;
+#endif
+
+    /* sanitation */
+    if (ctx == NULL || desc == NULL || desc_size == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (cfg_id >= ctx->num_cfg) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+    /* build-time descriptors are sent as is, from flash */
+    if (cfg_id >= usbctrl_static_cfg_desc_num) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    *desc = usbctrl_static_cfg_desc[cfg_id].desc;
+    *desc_size = usbctrl_static_cfg_desc[cfg_id].size;
+#else
+    cfg = &(ctx->cfg[cfg_id]);
+
+    if (cfg->desc_valid == false) {
+        /* descriptor forging works on the current configuration */
+        uint8_t curr_cfg = ctx->curr_cfg;
+        ctx->curr_cfg = cfg_id;
+        errcode = usbctrl_handle_configuration_desc(&(cfg->desc[0]), &size, ctx, false);
+        ctx->curr_cfg = curr_cfg;
+        if (errcode != MBED_ERROR_NONE) {
             goto err;
-            break;
+        }
+        cfg->desc_size = (uint16_t)size;
+        cfg->desc_valid = true;
+        log_printf("[USBCTRL] config %d desc cached (%d bytes)\n", cfg_id, size);
     }
-    usbctrl_string_desc_to_buff(cfg, buf);
+    *desc = &(cfg->desc[0]);
+    *desc_size = cfg->desc_size;
+#endif
 err:
     return errcode;
 }
 
+#ifdef CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE
+/*
+ * The other speed configuration descriptor is requested at most once or twice per
+ * enumeration: it is not cached, but forged in the context other speed buffer at
+ * each request, from the declared interfaces, including with build-time descriptors.
+ * The buffer content is valid up to the next request on the control pipe.
+ */
+
+/*@
+    @ requires \separated(&SIZE_DESC_FIXED, &FLAG, desc, desc_size, ctx+(..));
+    @ assigns ctx->other_speed_desc[0 .. MAX_CFG_DESCRIPTOR_LEN-1], *desc, *desc_size;
+    @ assigns SIZE_DESC_FIXED, FLAG;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_get_other_speed_configuration_desc(__in  usbctrl_context_t  *ctx,
+                                                        __in  uint8_t             cfg_id,
+                                                        __out uint8_t const     **desc,
+                                                        __out uint32_t           *desc_size)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t size = 0;
+    uint8_t curr_cfg;
+
+    /* sanitation */
+    if (ctx == NULL || desc == NULL || desc_size == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (cfg_id >= ctx->num_cfg) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* descriptor forging works on the current configuration */
+    curr_cfg = ctx->curr_cfg;
+    ctx->curr_cfg = cfg_id;
+    errcode = usbctrl_handle_configuration_desc(&(ctx->other_speed_desc[0]), &size, ctx, true);
+    ctx->curr_cfg = curr_cfg;
+    if (errcode != MBED_ERROR_NONE) {
+        goto err;
+    }
+    log_printf("[USBCTRL] config %d other speed desc forged (%d bytes)\n", cfg_id, size);
+    *desc = &(ctx->other_speed_desc[0]);
+    *desc_size = size;
+err:
+    return errcode;
+}
+#endif
+
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+/*
+ * Build-time descriptors consistency check.
+ *
+ * Build-time descriptors are generated from the interfaces manifest, not from the
+ * interfaces effectively declared by the upper layers. Before starting the device,
+ * the descriptors are forged once from the declared interfaces and compared to the
+ * generated ones, so that any divergence between the manifest and the upper layers
+ * is detected before the host sees it.
+ */
+
+/*@
+    @ requires \separated(&SIZE_DESC_FIXED, &FLAG, ctx+(..));
+    @ assigns ctx->curr_cfg, SIZE_DESC_FIXED, FLAG;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_check_static_descriptors(usbctrl_context_t *ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t buf[MAX_CFG_DESCRIPTOR_LEN] = { 0 };
+    uint32_t size = 0;
+    uint8_t curr_cfg;
+
+    if (ctx == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    curr_cfg = ctx->curr_cfg;
+
+    usbctrl_handle_device_desc(&(buf[0]), &size, ctx);
+    if (size != usbctrl_static_dev_desc.size ||
+        memcmp(&(buf[0]), usbctrl_static_dev_desc.desc, size) != 0) {
+        log_printf("[USBCTRL] static device desc differs from the declared device\n");
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    if (ctx->num_cfg != usbctrl_static_cfg_desc_num) {
+        log_printf("[USBCTRL] static desc hold %d configs, %d declared\n", usbctrl_static_cfg_desc_num, ctx->num_cfg);
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    /*@
+      @ loop invariant 0 <= i <= ctx->num_cfg ;
+      @ loop assigns i, size, errcode, buf[0 .. MAX_CFG_DESCRIPTOR_LEN-1], ctx->curr_cfg, SIZE_DESC_FIXED, FLAG ;
+      @ loop variant (ctx->num_cfg - i) ;
+      */
+    for (uint8_t i = 0; i < ctx->num_cfg; ++i) {
+        ctx->curr_cfg = i;
+        errcode = usbctrl_handle_configuration_desc(&(buf[0]), &size, ctx, false);
+        if (errcode != MBED_ERROR_NONE) {
+            goto restore;
+        }
+        if (size != usbctrl_static_cfg_desc[i].size ||
+            memcmp(&(buf[0]), usbctrl_static_cfg_desc[i].desc, size) != 0) {
+            log_printf("[USBCTRL] static config %d desc differs from the declared interfaces\n", i);
+            errcode = MBED_ERROR_INVSTATE;
+            goto restore;
+        }
+    }
+restore:
+    ctx->curr_cfg = curr_cfg;
+err:
+    return errcode;
+}
+#endif
 
 /*********************************************************************************
  * head function, handling all descriptor types.
- * This is the only function exported.
  */
 
 /*@
     @ requires \separated(&SIZE_DESC_FIXED, &FLAG, buf+(0 .. MAX_DESCRIPTOR_LEN-1),desc_size+(..),ctx+(..),pkt+(..));
-    @ assigns ctx->curr_cfg;
+    @ assigns ctx->curr_cfg, ctx->other_speed_desc[0 .. MAX_CFG_DESCRIPTOR_LEN-1];
     @ assigns buf[0 .. MAX_DESCRIPTOR_LEN-1];
     @ assigns *desc_size;
     @ assigns SIZE_DESC_FIXED, FLAG;
@@ -1259,9 +1646,7 @@ err:
     @ behavior USB_DESC_STRING:
     @   assumes !(buf == \null || ctx == \null || desc_size == \null || pkt == \null ) ;
     @   assumes type == USB_DESC_STRING ;
-    @   ensures (\result == MBED_ERROR_UNSUPORTED_CMD &&  *desc_size == 0) ||
-         (\result == MBED_ERROR_NONE && (*desc_size == 4 || *desc_size == (2 + 2 * sizeof(CONFIG_USB_DEV_MANUFACTURER))
-                                    || *desc_size == (2 + 2 * sizeof(CONFIG_USB_DEV_PRODNAME)) || *desc_size == (2 + 2 * sizeof(CONFIG_USB_DEV_SERIAL) ))) ;
+    @   ensures \result == MBED_ERROR_UNSUPORTED_CMD || \result == MBED_ERROR_NONE ;
 
     @ behavior USB_DESC_CONFIGURATION:
     @   assumes !(buf == \null || ctx == \null || desc_size == \null || pkt == \null ) ;
@@ -1271,12 +1656,12 @@ err:
     @ behavior USB_DESC_DEV_QUALIFIER:
     @   assumes !(buf == \null || ctx == \null || desc_size == \null || pkt == \null ) ;
     @   assumes type == USB_DESC_DEV_QUALIFIER ;
-    @   ensures  \result == MBED_ERROR_NONE && *desc_size == 0 ;
+    @   ensures is_valid_error(\result) ;
 
     @ behavior USB_DESC_OTHER_SPEED_CFG:
     @   assumes !(buf == \null || ctx == \null || desc_size == \null || pkt == \null ) ;
     @   assumes type == USB_DESC_OTHER_SPEED_CFG ;
-    @   ensures  \result == MBED_ERROR_NONE && *desc_size == 0 ;
+    @   ensures is_valid_error(\result) ;
 
     @ behavior USB_DESC_IFACE_POWER:
     @   assumes !(buf == \null || ctx == \null || desc_size == \null || pkt == \null ) ;
@@ -1319,7 +1704,7 @@ mbed_error_t usbctrl_get_descriptor(__in usbctrl_descriptor_type_t  type,
         case USB_DESC_INTERFACE:
             log_printf("[USBCTRL] request iface desc\n");
             uint8_t iface_id = (pkt->wValue & 0xff);
-            errcode = usbctrl_handle_configuration_write_iface_desc(buf, ctx, iface_id, desc_size);
+            errcode = usbctrl_handle_configuration_write_iface_desc(buf, ctx, iface_id, 0, desc_size);
             break;
         case USB_DESC_ENDPOINT:
             log_printf("[USBCTRL] request EP desc\n");
@@ -1346,31 +1731,20 @@ mbed_error_t usbctrl_get_descriptor(__in usbctrl_descriptor_type_t  type,
                 for (uint8_t ep_number = 0; ep_number < max_ep_number; ++ep_number) {
                     if (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].ep_num == target_ep) {
                         uint8_t ep_dir = ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].dir;
-                        errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, target_ep, ep_dir, iface_id, curr_cfg, desc_size);
+                        errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, target_ep, ep_dir, iface_id, curr_cfg, false, desc_size);
                     }
                 }
             }
             break;
         case USB_DESC_STRING: {
             log_printf("[USBCTRL] request string desc\n");
-            errcode = usbctrl_handle_string_desc(buf, desc_size, pkt);
+            errcode = usbctrl_handle_string_desc(buf, desc_size, ctx, pkt);
             break;
         }
         case USB_DESC_CONFIGURATION: {
             log_printf("[USBCTRL] request configuration desc\n");
-            /* configuration descriptor is dynamic, depends on current config and its number of endpoints... */
-            /* 1) calculating desc size */
-            //uint8_t requested_configuration = pkt->wValue; /* TODO to be used */
-
-            /* is there, at upper layer, an additional class descriptor for
-             * current configuration ? if yes, we get back this descriptor
-             * and add it to the complete configuration descriptor we send
-             * to the host. */
-            /* Here, we only calculate, for each interface, if there is a
-             * class descriptor, its size. The effective descriptor will
-             * be stored later, when the overall configuration descriptor
-             * is forged. */
-            uint32_t descriptor_size = 0;
+            uint8_t const *cfg_desc = NULL;
+            uint32_t cfg_desc_size = 0;
             /* desriptor index is set in WValue low byte. Its value is between 1 and num_cfg */
             uint8_t curr_cfg = pkt->wValue & 0xff;
             if (curr_cfg >= ctx->num_cfg) {
@@ -1380,168 +1754,55 @@ mbed_error_t usbctrl_get_descriptor(__in usbctrl_descriptor_type_t  type,
             /* setting current_cfg to requested cfg in get_descriptor */
             ctx->curr_cfg = curr_cfg;
 
-            errcode = usbctrl_handle_configuration_size(buf, desc_size, ctx, &descriptor_size);
+            /* configuration descriptor is forged once, then served from the configuration cache */
+            errcode = usbctrl_get_configuration_desc(ctx, curr_cfg, &cfg_desc, &cfg_desc_size);
             if (errcode != MBED_ERROR_NONE) {
-                log_printf("[USBCTRL] failure while calculating total desc size\n");
                 goto err;
             }
-            /*@ assert descriptor_size < MAX_DESCRIPTOR_LEN; */
-
-            /*
-             * From now on, we *know* that the overall descriptor size is smaller than the buffer max supported
-             * length. We can add successive descriptors into it without risking to overflow the buffer.
-             * Descriptors are concatenated with regard to the USB configuration descriptor standard hierarchy,
-             * using the same list of descriptor as calculated above.
-             *
-             * The input buffer is a uint8_t* generic buffer as USB descriptor content is a dynamic, runtime
-             * caclucated, list of structure. To handle this, as unions can't be used due to dynamicity, we
-             * use an offset in the buffer (a uint8_t * pointer) which always target the begining of the currently
-             * being written descriptor. This pointer is explicitely casted into the descriptor that need to be
-             * written in order to properly handle the descriptor fields. The offset is then incremented using
-             * the descriptor size.
-             *
-             * C scoping is used for each descriptor handling to avoid any variable shadowing. Each typed
-             * descriptor pointer is named 'cfg' and its scope is reduced to the currently being handled descriptor
-             * only.
-             */
-            uint32_t curr_offset = 0;
-            uint8_t iface_num = ctx->cfg[curr_cfg].interface_num;
-
-            log_printf("[USBCTRL] create config desc of size %d with %d ifaces\n", descriptor_size, iface_num);
-            /*
-             * First, creating the configuration descriptor
-             */
-            errcode = usbctrl_handle_configuration_write_config_desc(buf, descriptor_size, iface_num, &curr_offset);
-            if (errcode != MBED_ERROR_NONE) {
-                /* by now, this should be dead code as the above function should  never fails*/
-                goto err;
-            }
-
-            /* there can be 1, 2 or more interfaces. interfaces offset depends on the previous
-             * interfaces number, and are calculated depending on the previous interfaces
-             * descriptors (iface+ep) size.
-             * To do this, we start at offset 0 after configuration descriptor for the first
-             * interface, and at the end of each interface, we increment the offset of the size
-             * of the complete interface descriptor, including EP. */
-            uint8_t max_ep_number ;  // new variable for variant and invariant proof
-
-            /* @
-               @ loop invariant 0 <= iface_id <= iface_num ;
-               @ loop invariant 0 <= curr_offset <=  255 ;
-               @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces + (0..(iface_num -1))) ;
-               @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces[iface_id].eps + (0..(ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number -1))) ;
-               @ loop invariant \valid(buf + (0..255));
-               @ loop invariant \separated(ctx->cfg[curr_cfg].interfaces[iface_id].eps + (0..(ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number -1)),buf + (0..255));
-               */
-
-            bool composite = false;
-            uint8_t composite_id = 0;
-            /*@
-              @ loop invariant 0 <= iface_id <= iface_num;
-              @ loop invariant \separated(&SIZE_DESC_FIXED, &FLAG, &composite, buf + (0 .. MAX_DESCRIPTOR_LEN-1), &curr_offset, &max_ep_number, &iface_id, &errcode, ctx_list + (0 .. MAX_USB_CTRL_CTX-1));
-              @ loop assigns max_ep_number, iface_id, errcode, composite, buf[0 .. MAX_DESCRIPTOR_LEN-1 ], curr_offset, FLAG;
-              @ loop variant iface_num - iface_id;
-             */
-            for (uint8_t iface_id = 0; iface_id < iface_num; ++iface_id) {
-                /*
-                 * for each interface, we first need to add the interface descriptor
-                 */
-                // COMPOSITE IAD header
-                errcode = usbctrl_handle_configuration_write_iad_desc(buf, ctx, &composite, composite_id, iface_id, &curr_offset);
-                if (errcode != MBED_ERROR_NONE) {
-                    /* by now, this should be dead code as the above function should  never fails*/
-                    goto err;
-                }
-                errcode = usbctrl_handle_configuration_write_iface_desc(buf, ctx, iface_id, &curr_offset);
-                if (errcode != MBED_ERROR_NONE) {
-                    /* by now, this should be dead code as the above function should  never fails*/
-                    goto err;
-                }
-
-                /*
-                 * for each interface, we may then add the associated class descriptor, if it exsists
-                 */
-                errcode = usbctrl_handle_configuration_write_class_desc(ctx, buf, iface_id, &curr_offset);
-                if (errcode != MBED_ERROR_NONE) {
-                    goto err;
-                }
-
-                /*
-                 * for each interface, we finish with each endpoint descriptor, for all non-control EP
-                 * INFO: libusbctrl consider that the device handle a signe control EP: EP0
-                 */
-                /* and for this interface, handling each EP */
-
-
-                max_ep_number = ctx->cfg[curr_cfg].interfaces[iface_id].usb_ep_number ;  // variable change in loop
-
-                /*@
-                  @ loop invariant 0 <= iface_id <= iface_num;
-                  @ loop invariant 0 <= ep_number <= max_ep_number;
-                  @ loop invariant \separated(buf + (0 .. MAX_DESCRIPTOR_LEN-1), &curr_offset, &ep_number, &errcode, ctx_list + (0 .. MAX_USB_CTRL_CTX-1));
-                  @ loop assigns buf[0 .. MAX_DESCRIPTOR_LEN-1], curr_offset, ep_number, errcode;
-                  @ loop variant max_ep_number - ep_number;
-                  */
-                for (uint8_t ep_number = 0; ep_number < max_ep_number; ++ep_number) {
-
-                    usb_ep_dir_t ep_dir = ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].dir;
-
-                    if (ctx->cfg[curr_cfg].interfaces[iface_id].eps[ep_number].type == USB_EP_TYPE_CONTROL) {
-                        /* Control EP (EP0 usage) are not declared here */
-                        continue;
-                    }
-                    switch (ep_dir) {
-                        case USB_EP_DIR_BOTH:
-                            /* full duplex EP, first handling IP EP descriptor, then handling OUT just after */
-                            errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_IN, iface_id, curr_cfg, &curr_offset);
-                            if (errcode != MBED_ERROR_NONE) {
-                                goto err;
-                            }
-                            errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_OUT, iface_id, curr_cfg, &curr_offset);
-                            if (errcode != MBED_ERROR_NONE) {
-                                goto err;
-                            }
-                            break;
-                        case USB_EP_DIR_IN:
-                            errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_IN, iface_id, curr_cfg, &curr_offset);
-                            if (errcode != MBED_ERROR_NONE) {
-                                goto err;
-                            }
-                            break;
-                        case USB_EP_DIR_OUT:
-                            errcode = usbctrl_handle_configuration_write_ep_desc(ctx, buf, ep_number, USB_EP_DIR_OUT, iface_id, curr_cfg, &curr_offset);
-                            if (errcode != MBED_ERROR_NONE) {
-                                goto err;
-                            }
-                            break;
-                        default:
-                            errcode = MBED_ERROR_INVPARAM;
-                            goto err;
-
-                    }
-                }
-            /* returns the descriptor */
-            }
-            /* total configuration descriptor has be forged, update the size */
-            if (descriptor_size != curr_offset) {
-                /* This SHOULD NOT be possible !!! */
-                log_printf("[USBCTRL] forged descriptor size (%d) different from the calculated one (%d) !!!\n", curr_offset, descriptor_size);
-                errcode = MBED_ERROR_UNKNOWN;
+            if (cfg_desc_size > MAX_DESCRIPTOR_LEN) {
+                /* larger configuration descriptors are only sent from the cache
+                 * (see usbctrl_get_configuration_desc()) */
+                errcode = MBED_ERROR_NOSTORAGE;
                 goto err;
             }
-            /*@ assert descriptor_size == curr_offset ; */
-            *desc_size = descriptor_size;
-            //@ merge SIZE_DESC_FIXED ;
+            memcpy(buf, cfg_desc, cfg_desc_size);
+            *desc_size = cfg_desc_size;
             break;
         }
         case USB_DESC_DEV_QUALIFIER:
             log_printf("[USBCTRL] request dev qualifier desc\n");
+#ifdef CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE
+            errcode = usbctrl_handle_device_qualifier_desc(buf, desc_size, ctx);
+#else
+            /* full-speed only device: the request must be stalled */
             *desc_size = 0;
+            errcode = MBED_ERROR_UNSUPORTED_CMD;
+#endif
             break;
-        case USB_DESC_OTHER_SPEED_CFG:
+        case USB_DESC_OTHER_SPEED_CFG: {
             log_printf("[USBCTRL] request other speed cfg desc\n");
+#ifdef CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE
+            uint8_t const *cfg_desc = NULL;
+            uint32_t cfg_desc_size = 0;
+            errcode = usbctrl_get_other_speed_configuration_desc(ctx, (pkt->wValue & 0xff), &cfg_desc, &cfg_desc_size);
+            if (errcode != MBED_ERROR_NONE) {
+                goto err;
+            }
+            if (cfg_desc_size > MAX_DESCRIPTOR_LEN) {
+                /* larger descriptors are only sent from the context buffer
+                 * (see usbctrl_get_other_speed_configuration_desc()) */
+                errcode = MBED_ERROR_NOSTORAGE;
+                goto err;
+            }
+            memcpy(buf, cfg_desc, cfg_desc_size);
+            *desc_size = cfg_desc_size;
+#else
+            /* full-speed only device: the request must be stalled */
             *desc_size = 0;
+            errcode = MBED_ERROR_UNSUPORTED_CMD;
+#endif
             break;
+        }
         case USB_DESC_IFACE_POWER:
             log_printf("[USBCTRL] request iface power desc\n");
             *desc_size = 0;
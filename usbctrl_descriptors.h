@@ -27,8 +27,6 @@
 #include "usbctrl.h"
 #include "usbctrl_requests.h"
 
-#define MAX_DESC_STRING_SIZE		32
-
 #define LANGUAGE_ENGLISH        0x0409
 
 /*
@@ -61,6 +59,23 @@ typedef struct __packed {
 	uint8_t  bNumConfigurations;
 } usbctrl_device_descriptor_t;
 
+/*
+ * Device qualifier descriptor (high-speed capable devices only). It describes
+ * the device fields that would change if the device was operating at the other
+ * speed.
+ */
+typedef struct __packed {
+	uint8_t  bLength;
+	uint8_t  bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t  bDeviceClass;
+	uint8_t  bDeviceSubClass;
+	uint8_t  bDeviceProtocol;
+	uint8_t  bMaxPacketSize0;
+	uint8_t  bNumConfigurations;
+	uint8_t  bReserved;
+} usbctrl_device_qualifier_descriptor_t;
+
 typedef struct __packed {
 	uint8_t bLength;
 	uint8_t bDescriptorType;
@@ -110,12 +125,6 @@ typedef struct __packed {
 	uint8_t  bInterval;
 } usbctrl_endpoint_descriptor_t;
 
-typedef struct __packed {
-	uint8_t bLength;
-	uint8_t bDescriptorType;
-	uint16_t wString[MAX_DESC_STRING_SIZE];
-} usbctrl_string_descriptor_t;
-
 
 
 typedef struct __packed {
@@ -149,4 +158,20 @@ mbed_error_t usbctrl_get_descriptor(usbctrl_descriptor_type_t  type,
                                     usbctrl_context_t         *ctx,
                                     usbctrl_setup_pkt_t       *pkt);
 
+mbed_error_t usbctrl_get_configuration_desc(usbctrl_context_t  *ctx,
+                                            uint8_t             cfg_id,
+                                            uint8_t const     **desc,
+                                            uint32_t           *desc_size);
+
+#ifdef CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE
+mbed_error_t usbctrl_get_other_speed_configuration_desc(usbctrl_context_t  *ctx,
+                                                        uint8_t             cfg_id,
+                                                        uint8_t const     **desc,
+                                                        uint32_t           *desc_size);
+#endif
+
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+mbed_error_t usbctrl_check_static_descriptors(usbctrl_context_t *ctx);
+#endif
+
 #endif/*!USB_CTRL_DESCRIPTORS_H_*/
@@ -0,0 +1,78 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef USBCTRL_DRV_H_
+#define USBCTRL_DRV_H_
+
+#include "libc/types.h"
+#include "api/libusbctrl.h"
+#include "usbctrl.h"
+
+/*
+ * Per context backend driver access. Each call is forwarded to the backend
+ * driver operations the context has been declared with.
+ * Frama-C analyses are made against the usb_backend_drv_*() API directly, as
+ * they rely on the driver functions contracts.
+ */
+
+#if defined(__FRAMAC__)
+# define USBCTRL_DRV_OPS(ctx, fn) usb_backend_drv_##fn
+#else
+# define USBCTRL_DRV_OPS(ctx, fn) ((ctx)->backend->fn)
+#endif
+
+#define usbctrl_drv_configure(ctx, ...)            USBCTRL_DRV_OPS(ctx, configure)(__VA_ARGS__)
+#define usbctrl_drv_activate_endpoint(ctx, ...)    USBCTRL_DRV_OPS(ctx, activate_endpoint)(__VA_ARGS__)
+#define usbctrl_drv_configure_endpoint(ctx, ...)   USBCTRL_DRV_OPS(ctx, configure_endpoint)(__VA_ARGS__)
+#define usbctrl_drv_deconfigure_endpoint(ctx, ...) USBCTRL_DRV_OPS(ctx, deconfigure_endpoint)(__VA_ARGS__)
+#define usbctrl_drv_get_ep_state(ctx, ...)         USBCTRL_DRV_OPS(ctx, get_ep_state)(__VA_ARGS__)
+#define usbctrl_drv_send_data(ctx, ...)            USBCTRL_DRV_OPS(ctx, send_data)(__VA_ARGS__)
+#define usbctrl_drv_send_zlp(ctx, ...)             USBCTRL_DRV_OPS(ctx, send_zlp)(__VA_ARGS__)
+#define usbctrl_drv_set_address(ctx, ...)          USBCTRL_DRV_OPS(ctx, set_address)(__VA_ARGS__)
+#define usbctrl_drv_set_recv_fifo(ctx, ...)        USBCTRL_DRV_OPS(ctx, set_recv_fifo)(__VA_ARGS__)
+#define usbctrl_drv_ack(ctx, ...)                  USBCTRL_DRV_OPS(ctx, ack)(__VA_ARGS__)
+#define usbctrl_drv_nak(ctx, ...)                  USBCTRL_DRV_OPS(ctx, nak)(__VA_ARGS__)
+#define usbctrl_drv_stall(ctx, ...)                USBCTRL_DRV_OPS(ctx, stall)(__VA_ARGS__)
+#define usbctrl_drv_endpoint_disable(ctx, ...)     USBCTRL_DRV_OPS(ctx, endpoint_disable)(__VA_ARGS__)
+#define usbctrl_drv_endpoint_enable(ctx, ...)      USBCTRL_DRV_OPS(ctx, endpoint_enable)(__VA_ARGS__)
+#define usbctrl_drv_get_ep_mpsize(ctx, ...)        USBCTRL_DRV_OPS(ctx, get_ep_mpsize)(__VA_ARGS__)
+#define usbctrl_drv_get_speed(ctx)                 USBCTRL_DRV_OPS(ctx, get_speed)()
+
+/*
+ * Optional operations, NULL when the backend driver does not support them. Under
+ * Frama-C, the default backend driver support follows its configuration.
+ */
+#if defined(__FRAMAC__)
+# if CONFIG_USBCTRL_BACKEND_FRAME_NUMBER
+#  define usbctrl_drv_has_frame_number(ctx)       true
+#  define usbctrl_drv_get_frame_number(ctx)       USBCTRL_DRV_OPS(ctx, get_frame_number)()
+# else
+#  define usbctrl_drv_has_frame_number(ctx)       false
+#  define usbctrl_drv_get_frame_number(ctx)       ((uint16_t)0)
+# endif
+#else
+# define usbctrl_drv_has_frame_number(ctx)        (USBCTRL_DRV_OPS(ctx, get_frame_number) != NULL)
+# define usbctrl_drv_get_frame_number(ctx)        USBCTRL_DRV_OPS(ctx, get_frame_number)()
+#endif
+
+#endif/*!USBCTRL_DRV_H_*/
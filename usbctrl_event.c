@@ -0,0 +1,370 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/sync.h"
+#include "libc/string.h"
+#include "api/libusbctrl.h"
+#include "usbctrl.h"
+#include "usbctrl_sync.h"
+#include "usbctrl_drv.h"
+#include "usbctrl_handlers.h"
+#include "usbctrl_event.h"
+
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+
+#define USBCTRL_EVENT_QUEUE_MASK (CONFIG_USBCTRL_EVENT_QUEUE_SIZE - 1)
+
+/*@
+    @ requires \valid(queue);
+    @ assigns *queue ;
+*/
+void usbctrl_event_queue_init(usbctrl_event_queue_t *queue)
+{
+    memset(queue, 0x0, sizeof(usbctrl_event_queue_t));
+}
+
+/*@
+    @ requires \valid(ring) && \valid_read(event);
+    @ assigns ring->event[0 .. CONFIG_USBCTRL_EVENT_QUEUE_SIZE-1], ring->head ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_event_push(usbctrl_event_ring_t         *ring,
+                                usbctrl_event_t const * const event)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t head = ring->head;
+
+    if ((head - ring->tail) >= CONFIG_USBCTRL_EVENT_QUEUE_SIZE) {
+        /* ring full: the event is lost */
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    ring->event[head & USBCTRL_EVENT_QUEUE_MASK] = *event;
+    /* the event record must be written before being published */
+    usbctrl_store_release(&(ring->head), head + 1);
+err:
+    return errcode;
+}
+
+/*@
+    @ requires \valid(ring) && \valid(event);
+    @ assigns *event, ring->tail ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+bool usbctrl_event_pop(usbctrl_event_ring_t *ring,
+                       usbctrl_event_t      *event)
+{
+    uint32_t tail = ring->tail;
+
+    /* the event record is read only after the head update is seen */
+    if (tail == usbctrl_load_acquire(&(ring->head))) {
+        return false;
+    }
+    *event = ring->event[tail & USBCTRL_EVENT_QUEUE_MASK];
+    /* the slot can be reused by the producer from now on */
+    usbctrl_store_release(&(ring->tail), tail + 1);
+    return true;
+}
+
+/*@
+    @ requires \valid(queue) && \valid(event);
+    @ assigns *queue ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_event_queue_push(usbctrl_event_queue_t *queue,
+                                      usbctrl_event_t       *event)
+{
+    mbed_error_t errcode;
+    usbctrl_event_ring_t *ring = &(queue->ctrl);
+
+    if (((event->type == USBCTRL_EVENT_INEP || event->type == USBCTRL_EVENT_OUTEP) &&
+         event->ep != EP0) || event->type == USBCTRL_EVENT_SOF) {
+        /* SOF hooks are upper layers handlers too: they share the data budget */
+        ring = &(queue->data);
+    }
+    event->seq = queue->seq;
+    errcode = usbctrl_event_push(ring, event);
+    if (errcode != MBED_ERROR_NONE) {
+        queue->lost++;
+        goto err;
+    }
+    queue->seq++;
+err:
+    return errcode;
+}
+
+#endif
+
+/*
+ * Execute a captured driver event.
+ */
+
+/*@
+    @ requires \valid_read(event);
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_event_exec(usbctrl_event_t const * const event)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    switch (event->type) {
+        case USBCTRL_EVENT_EARLYSUSPEND:
+            errcode = usbctrl_exec_earlysuspend(event->dev_id);
+            break;
+        case USBCTRL_EVENT_RESET:
+            errcode = usbctrl_exec_reset(event->dev_id, (uint8_t)event->size);
+            break;
+        case USBCTRL_EVENT_USBSUSPEND:
+            errcode = usbctrl_exec_usbsuspend(event->dev_id);
+            break;
+        case USBCTRL_EVENT_WAKEUP:
+            errcode = usbctrl_exec_wakeup(event->dev_id);
+            break;
+        case USBCTRL_EVENT_INEP:
+            errcode = usbctrl_exec_inepevent(event->dev_id, event->size, event->ep);
+            break;
+        case USBCTRL_EVENT_OUTEP:
+            errcode = usbctrl_exec_outepevent(event->dev_id, event->size, event->ep,
+                                              (usb_backend_drv_ep_state_t)event->ep_state);
+            break;
+        case USBCTRL_EVENT_SOF:
+            errcode = usbctrl_exec_sof(event->dev_id, (uint16_t)event->size);
+            break;
+        default:
+            errcode = MBED_ERROR_INVPARAM;
+            break;
+    }
+    return errcode;
+}
+
+/*
+ * Driver events are executed at once, or queued for usbctrl_dispatch() in
+ * deferred mode.
+ */
+
+/*@
+    @ requires \valid(event);
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+mbed_error_t usbctrl_event_post(usbctrl_event_t * const event)
+{
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+    usbctrl_context_t *ctx = NULL;
+
+    /* each device has its own ring: devices ISRs never share a producer index */
+    if (usbctrl_get_context(event->dev_id, &ctx) != MBED_ERROR_NONE) {
+        return MBED_ERROR_INVPARAM;
+    }
+    return usbctrl_event_queue_push(&(ctx->event_queue), event);
+#else
+    return usbctrl_event_exec(event);
+#endif
+}
+
+/*
+ * Driver triggered handlers
+ */
+
+mbed_error_t usbctrl_handle_earlysuspend(uint32_t dev_id)
+{
+    usbctrl_event_t event = { .type = USBCTRL_EVENT_EARLYSUSPEND, .dev_id = dev_id };
+    return usbctrl_event_post(&event);
+}
+
+mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
+{
+    usbctrl_context_t *ctx = NULL;
+    usbctrl_event_t event = { .type = USBCTRL_EVENT_RESET, .dev_id = dev_id };
+
+    /* SETUP packets queued before the reset are dropped when it is executed */
+    if (usbctrl_get_context(dev_id, &ctx) == MBED_ERROR_NONE) {
+        event.size = ctx->setup_ring.head;
+    }
+    return usbctrl_event_post(&event);
+}
+
+mbed_error_t usbctrl_handle_usbsuspend(uint32_t dev_id)
+{
+    usbctrl_event_t event = { .type = USBCTRL_EVENT_USBSUSPEND, .dev_id = dev_id };
+    return usbctrl_event_post(&event);
+}
+
+mbed_error_t usbctrl_handle_wakeup(uint32_t dev_id)
+{
+    usbctrl_event_t event = { .type = USBCTRL_EVENT_WAKEUP, .dev_id = dev_id };
+    return usbctrl_event_post(&event);
+}
+
+mbed_error_t usbctrl_handle_inepevent(uint32_t dev_id, uint32_t size, uint8_t ep)
+{
+    usbctrl_event_t event = { .type = USBCTRL_EVENT_INEP, .dev_id = dev_id, .size = size, .ep = ep };
+    return usbctrl_event_post(&event);
+}
+
+mbed_error_t usbctrl_handle_outepevent(uint32_t dev_id, uint32_t size, uint8_t ep)
+{
+    mbed_error_t errcode;
+    usbctrl_context_t *ctx = NULL;
+    usbctrl_event_t event = { .type = USBCTRL_EVENT_OUTEP, .dev_id = dev_id, .size = size, .ep = ep };
+
+    /* the EP state and the SETUP packet content are only valid now: the EP0 receive
+     * FIFO is reused for the next SETUP packet, which may be received before this
+     * one is handled */
+    if (usbctrl_get_context(dev_id, &ctx) != MBED_ERROR_NONE) {
+        /* unknown device */
+        return MBED_ERROR_INVPARAM;
+    }
+    event.ep_state = (uint8_t)usbctrl_drv_get_ep_state(ctx, ep, USB_BACKEND_DRV_EP_DIR_OUT);
+    if (event.ep_state == USB_BACKEND_DRV_EP_STATE_SETUP && size >= 8) {
+        if (usbctrl_setup_ring_push(ctx, &(ctx->ctrl_fifo[0])) != MBED_ERROR_NONE) {
+            /* SETUP packet lost, the host will retry */
+            return MBED_ERROR_NOSTORAGE;
+        }
+        errcode = usbctrl_event_post(&event);
+        if (errcode != MBED_ERROR_NONE) {
+            /* no event will pop this SETUP packet: drop it too, not to shift
+             * the next SETUP packets handling */
+            usbctrl_setup_ring_cancel(ctx);
+        }
+        return errcode;
+    }
+    return usbctrl_event_post(&event);
+}
+
+mbed_error_t usbctrl_handle_sof(uint32_t dev_id __attribute__((unused)))
+{
+#if CONFIG_USBCTRL_SOF_HOOK
+    usbctrl_context_t *ctx = NULL;
+    usbctrl_event_t event = { .type = USBCTRL_EVENT_SOF, .dev_id = dev_id };
+
+    if (usbctrl_get_context(dev_id, &ctx) != MBED_ERROR_NONE) {
+        /* unknown device */
+        return MBED_ERROR_INVPARAM;
+    }
+    if (usbctrl_load_acquire(&(ctx->sof_handler)) == NULL) {
+        return MBED_ERROR_NONE;
+    }
+    /* the SOF are decimated here, so that only the hook periods cost an event */
+    if (++ctx->sof_count < ctx->sof_divisor) {
+        return MBED_ERROR_NONE;
+    }
+    ctx->sof_count = 0;
+    /* the frame number is only valid until the next SOF */
+    if (usbctrl_drv_has_frame_number(ctx)) {
+        event.size = usbctrl_drv_get_frame_number(ctx);
+    }
+    return usbctrl_event_post(&event);
+#else
+    return MBED_ERROR_NONE;
+#endif
+}
+
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+/*
+ * Execute the queued driver events of a context, from the task context.
+ *
+ * Control plane events are all executed first, and checked again after each data
+ * event, so that a control transfer never waits for more than one upper layer EP
+ * handler. At most CONFIG_USBCTRL_DISPATCH_DATA_BUDGET data events are executed
+ * per call. Data events received before a bus reset are dropped once the reset
+ * is executed, as they belong to the previous bus session.
+ */
+
+/*@
+    @ requires \valid(queue);
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_event_dispatch(usbctrl_event_queue_t *queue)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    mbed_error_t err;
+    usbctrl_event_t event;
+    uint32_t lost = queue->lost;
+    uint32_t budget = CONFIG_USBCTRL_DISPATCH_DATA_BUDGET;
+
+    if (lost != queue->lost_reported) {
+        log_printf("[USBCTRL] %d driver events lost (queue full)\n", lost - queue->lost_reported);
+        queue->lost_reported = lost;
+    }
+    for (;;) {
+        /* control plane first */
+        while (usbctrl_event_pop(&(queue->ctrl), &event) == true) {
+            if (queue->data.tail != queue->data.head) {
+                queue->stats.ctrl_first++;
+            }
+            if (event.type == USBCTRL_EVENT_RESET) {
+                queue->reset_seq = event.seq;
+                queue->reset_pending = true;
+            }
+            queue->stats.ctrl_events++;
+            err = usbctrl_event_exec(&event);
+            if (err != MBED_ERROR_NONE) {
+                /* an event error does not prevent the next events execution */
+                errcode = err;
+            }
+        }
+        if (budget == 0 || usbctrl_event_pop(&(queue->data), &event) == false) {
+            break;
+        }
+        if (queue->reset_pending) {
+            if ((int32_t)(event.seq - queue->reset_seq) < 0) {
+                /* received before the bus reset */
+                queue->stats.data_dropped++;
+                continue;
+            }
+            queue->reset_pending = false;
+        }
+        budget--;
+        queue->stats.data_events++;
+        err = usbctrl_event_exec(&event);
+        if (err != MBED_ERROR_NONE) {
+            errcode = err;
+        }
+    }
+    if (queue->data.tail != queue->data.head) {
+        /* budget exhausted, data events are still pending */
+        queue->stats.starved_rounds++;
+        queue->starved++;
+        if (queue->starved > queue->stats.max_starved_rounds) {
+            queue->stats.max_starved_rounds = queue->starved;
+        }
+        if (errcode == MBED_ERROR_NONE) {
+            errcode = MBED_ERROR_BUSY;
+        }
+    } else {
+        queue->starved = 0;
+    }
+    return errcode;
+}
+#endif
@@ -25,18 +25,86 @@
 #define USBCTRL_EVENT_H_
 
 /*
- * This file handle the overall reset events, and the associate state change, in
- * interaction with the state automaton.
+ * This file handle the events triggered by the USB driver (reset, suspend, wakeup,
+ * IN and OUT EP events).
  */
 
 #include "libc/types.h"
 #include "api/libusbctrl.h"
 
 /*
- * INFO: functions declared in the usbctrl_event.c file are made to be resolved at link
- * time by the driver. They are not static, but they are not defined in a header, as
- * they are not called from any part of the libUSBCtrl, but only triggered from the
- * driver itself.
+ * INFO: the usbctrl_handle_*() functions defined in the usbctrl_event.c file are made
+ * to be resolved at link time by the driver. They are not called from any part of
+ * the libUSBCtrl, but only triggered from the driver itself (see usbctrl_handlers.h).
+ *
+ * Each driver event is captured in a compact event record (received SETUP packets
+ * are queued in the context SETUP ring). When
+ * CONFIG_USBCTRL_DEFERRED_DISPATCH is set, the record is pushed in the lock-free
+ * single-producer (driver ISR), single-consumer (usbctrl_dispatch() caller) ring of
+ * the device context, and executed later in the task context. Otherwise, the event is executed at once,
+ * in the driver ISR context.
+ */
+
+typedef enum {
+    USBCTRL_EVENT_EARLYSUSPEND = 0,
+    USBCTRL_EVENT_RESET,
+    USBCTRL_EVENT_USBSUSPEND,
+    USBCTRL_EVENT_WAKEUP,
+    USBCTRL_EVENT_INEP,
+    USBCTRL_EVENT_OUTEP,
+    USBCTRL_EVENT_SOF,
+} usbctrl_event_type_t;
+
+typedef struct {
+    uint8_t     type;           /*< event type (usbctrl_event_type_t) */
+    uint8_t     ep;             /*< EP number (EP events) */
+    uint8_t     ep_state;       /*< OUT EP state at event time (OUT EP events) */
+    uint32_t    dev_id;         /*< device id, from the USB device driver */
+    uint32_t    size;           /*< transfered data size (EP events), frame number (SOF events),
+                                    SETUP ring head (reset events) */
+    uint32_t    seq;            /*< reception order (deferred mode) */
+} usbctrl_event_t;
+
+#if CONFIG_USBCTRL_DEFERRED_DISPATCH
+
+#if (CONFIG_USBCTRL_EVENT_QUEUE_SIZE & (CONFIG_USBCTRL_EVENT_QUEUE_SIZE - 1)) != 0
+# error "CONFIG_USBCTRL_EVENT_QUEUE_SIZE must be a power of 2"
+#endif
+
+/*
+ * Driver events ring. head is only written by the producer (the context device
+ * ISR), tail only by the consumer (the usbctrl_dispatch_ctx() caller). Indexes
+ * are free running, the ring is full when head - tail == CONFIG_USBCTRL_EVENT_QUEUE_SIZE.
  */
+typedef struct {
+    usbctrl_event_t   event[CONFIG_USBCTRL_EVENT_QUEUE_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} usbctrl_event_ring_t;
+
+/*
+ * Per context driver events queue. Control plane events (bus events, EP0 events)
+ * and data plane events (other EPs events) have their own ring, the control
+ * plane ring being always executed first.
+ */
+typedef struct {
+    usbctrl_event_ring_t ctrl;          /*< bus and control pipe events */
+    usbctrl_event_ring_t data;          /*< data EPs events */
+    volatile uint32_t    seq;           /*< next event sequence number (producer only) */
+    volatile uint32_t    lost;          /*< events lost because of a full ring (producer only) */
+    uint32_t             lost_reported; /*< lost events already reported (consumer only) */
+    uint32_t             reset_seq;     /*< sequence number of the last executed bus reset (consumer only) */
+    bool                 reset_pending; /*< data events older than reset_seq may still be queued (consumer only) */
+    uint32_t             starved;       /*< current consecutive rounds ended with data events pending (consumer only) */
+    usbctrl_dispatch_stats_t stats;     /*< scheduling statistics (consumer only) */
+} usbctrl_event_queue_t;
+
+void usbctrl_event_queue_init(usbctrl_event_queue_t *queue);
+
+mbed_error_t usbctrl_event_dispatch(usbctrl_event_queue_t *queue);
+
+#endif
+
+mbed_error_t usbctrl_event_exec(usbctrl_event_t const * const event);
 
 #endif/*!USBCTRL_EVENT_H_*/
@@ -27,6 +27,9 @@
 #include "usbctrl_handlers.h"
 #include "usbctrl_state.h"
 #include "usbctrl.h"
+#include "usbctrl_drv.h"
+#include "usbctrl_sync.h"
+#include "usbctrl_xfer.h"
 
 #ifdef __FRAMAC__
 # include "framac/entrypoint.h"
@@ -38,7 +41,7 @@
     @ ensures \result == MBED_ERROR_NONE ;
 */
 
-mbed_error_t usbctrl_handle_earlysuspend(uint32_t dev_id __attribute__((unused)))
+mbed_error_t usbctrl_exec_earlysuspend(uint32_t dev_id __attribute__((unused)))
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     /* INFO: early suspend is executed very early, before starting DEFAULT state. There is
@@ -53,7 +56,7 @@ mbed_error_t usbctrl_handle_earlysuspend(uint32_t dev_id __attribute__((unused))
     @ ensures (\result == MBED_ERROR_NONE || \result == MBED_ERROR_INVSTATE);
 */
 
-mbed_error_t usbctrl_handle_usbsuspend(uint32_t dev_id __attribute__((unused)))
+mbed_error_t usbctrl_exec_usbsuspend(uint32_t dev_id __attribute__((unused)))
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
 
@@ -143,7 +146,7 @@ err:
 
 */
 
-mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
+mbed_error_t usbctrl_exec_reset(uint32_t dev_id, uint8_t setup_head)
 {
 
     mbed_error_t       errcode = MBED_ERROR_NONE;
@@ -171,6 +174,9 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
     /*@ assert 0 <= GHOST_idx_ctx < GHOST_num_ctx; */
 
     /*@ assert ctx != 0 ; */
+    /* SETUP packets of the previous bus session, whose event was lost, are dropped */
+    usbctrl_setup_ring_flush(ctx, setup_head);
+
     usb_device_state_t state = usbctrl_get_state(ctx);
     /*@ assert state == ctx->state ; */
     /*@ assert state == ctx_list[GHOST_idx_ctx].state ; */
@@ -208,7 +214,7 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             /* as USB Reset action reinitialize the EP0 FIFOs (flush, purge and deconfigure) they must
              * be reconfigure for EP0 here. */
             log_printf("[USBCTRL] reset: set reveive FIFO for EP0\n");
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
 
 
             if (errcode != MBED_ERROR_NONE) {
@@ -223,7 +229,7 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             /* as USB Reset action reinitialize the EP0 FIFOs (flush, purge and deconfigure) they must
              * be reconfigure for EP0 here. */
             log_printf("[USBCTRL] reset: set reveive FIFO for EP0\n");
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
 
             if (errcode != MBED_ERROR_NONE) {
                 goto err;
@@ -233,7 +239,7 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             break;
         case USB_DEVICE_STATE_SUSPENDED_DEFAULT:
             /* awake from suspended state, back to default */
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
             if (errcode != MBED_ERROR_NONE) {
                 goto err;
             }
@@ -243,7 +249,7 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             break;
         case USB_DEVICE_STATE_SUSPENDED_ADDRESS:
             /* awake from suspended state, back to address */
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
             if (errcode != MBED_ERROR_NONE) {
                 goto err;
             }
@@ -253,7 +259,7 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             break;
         case USB_DEVICE_STATE_SUSPENDED_CONFIGURED:
             /* awake from suspended state, back to configured */
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
             if (errcode != MBED_ERROR_NONE) {
                 goto err;
             }
@@ -262,7 +268,7 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             break;
         case USB_DEVICE_STATE_DEFAULT:
             /* going back to default... meaning doing nothing */
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
             if (errcode != MBED_ERROR_NONE) {
                 goto err;
             }
@@ -271,21 +277,21 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             break;
         case USB_DEVICE_STATE_ADDRESS:
             /* going back to default */
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
             if (errcode != MBED_ERROR_NONE) {
                 goto err;
             }
             /* control pipe recv FIFO is ready to be used */
             ctx->ctrl_fifo_state = USB_CTRL_RCV_FIFO_SATE_FREE;
             ctx->address = 0;
-            usb_backend_drv_set_address(0);
+            usbctrl_drv_set_address(ctx, 0);
             break;
         case USB_DEVICE_STATE_CONFIGURED:
             /* INFO: deconfigure any potential active EP of current config is automatically
              * done by USB OTG HS core at reset */
 
             /* going back to default */
-            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+            errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
             if (errcode != MBED_ERROR_NONE) {
                 goto err;
             }
@@ -293,7 +299,9 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
             ctx->ctrl_fifo_state = USB_CTRL_RCV_FIFO_SATE_FREE;
             /* when configured, the upper layer must also be reset */
             ctx->address = 0;
-            usb_backend_drv_set_address(0);
+            usbctrl_drv_set_address(ctx, 0);
+            /* pending transfers are lost */
+            usbctrl_xfer_flush(ctx);
             usbctrl_reset_received();
             break;
         default:
@@ -310,6 +318,8 @@ mbed_error_t usbctrl_handle_reset(uint32_t dev_id)
      * This action is generic thinks to the automaton and can be executed out
      * of the above switch().
      * after sanitation, should not fail */
+    /* EPs max packet sizes and descriptors follow the negotiated port speed */
+    usbctrl_update_speed(ctx);
     usbctrl_set_state(ctx, usbctrl_next_state(state, USB_DEVICE_TRANS_RESET));
     /*@ assert ctx ≡ &ctx_list[GHOST_idx_ctx]; */ ;
     /*@ assert !(\exists integer i; 0 <= i < GHOST_num_ctx && i!= GHOST_idx_ctx && \at(ctx_list,Pre)[i].state != ctx_list[i].state) ; */
@@ -344,7 +354,7 @@ err:
     @ disjoint behaviors ;
 */
 
-mbed_error_t usbctrl_handle_inepevent(uint32_t dev_id, uint32_t size, uint8_t ep)
+mbed_error_t usbctrl_exec_inepevent(uint32_t dev_id, uint32_t size, uint8_t ep)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     usbctrl_context_t *ctx = NULL;
@@ -369,63 +379,54 @@ mbed_error_t usbctrl_handle_inepevent(uint32_t dev_id, uint32_t size, uint8_t ep
      */
     /* acknowledge data transfert. For control & bulk (not isochronous, IT ?) */
     // acknowledgement in request handling by now...
-    // usb_backend_drv_send_zlp(ep);
+    // usbctrl_drv_send_zlp(ctx, ep);
 
     log_printf("[LIBCTRL] handle inpevent\n");
-    uint8_t curr_cfg = ctx->curr_cfg;
-    /* If we are in a request processing, we just close it. request processing
-     * that are closed here are the ones which send data (get_descriptor & co.)
-     * For them, the flag ctx->ctrl_req_processing is risen at request exec and
-     * is cleared here. other requests (the one which do not send data)
-     * have this flag clear syncrhonously. */
-    if (ctx->ctrl_req_processing == true) {
+    /* Control transfers handled by the libctrl: IN data stage packets and status
+     * stage ZLP completions make the control transfer progress. Other EP0 IN
+     * completions (control transfers owned by an upper layer) and other EPs
+     * completions are passed to the upper layer. */
+    if (ep == EP0 && ctx->ctrl_phase == USBCTRL_CTRL_PHASE_DATA_IN) {
+        if (usbctrl_ep0_in_next(ctx) == true) {
+            /* multi-packet data stage: next packet (or terminating ZLP) sent */
+            goto err;
+        }
+        /* data stage complete, the host now sends the status stage (OUT ZLP) */
+        usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_STATUS);
+    } else if (ep == EP0 && ctx->ctrl_phase == USBCTRL_CTRL_PHASE_STATUS) {
         log_printf("[LIBCTRL] end of control level request\n");
-        set_bool_with_membarrier(&ctx->ctrl_req_processing, false);
+        usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_IDLE);
+    } else if (ep != EP0 && usbctrl_xfer_in_complete(ctx, ep, size) == true) {
+        /* packet of a submitted transfer sent, next packet or transfer started */
     } else {
         log_printf("[LIBCTRL] end of upper layer request\n");
 
-        /*@
-            @ loop invariant 0 <= iface <= ctx->cfg[curr_cfg].interface_num ;
-            @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces[iface].eps + (ctx->cfg[curr_cfg].interface_num - 1));
-            @ loop assigns iface, errcode ;
-            @ loop variant (ctx->cfg[curr_cfg].interface_num - iface);
-        */
-
-        for (uint8_t iface = 0; iface < ctx->cfg[curr_cfg].interface_num; ++iface) {
-
-        /*@
-            @ loop invariant 0 <= i <= ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number ;
-            @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces[iface].eps + (ctx->cfg[curr_cfg].interface_num - 1));
-            @ loop assigns i, errcode ;
-            @ loop variant (ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number - i);
-        */
-
-            for (uint8_t i = 0; i < ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number; ++i) {
-                /* here we check both ep id and direction and EP0 is a specific full duplex case */
-                if (   ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num == ep
-                    && ctx->cfg[curr_cfg].interfaces[iface].eps[i].dir == USB_EP_DIR_IN) {
-                    log_printf("[LIBCTRL] found ep in iface %d, declared ep %d\n", iface, i);
-                    if (ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler) {
-
-                        #ifndef __FRAMAC__
-                        if (handler_sanity_check_with_panic((physaddr_t)ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler)) {
-                            goto err;
-                        }
-                        #endif
-
-                        log_printf("[LIBCTRL] iepint: executing upper class handler for EP %d\n", ep);
-                        /* XXX: c'est ma FIFO ? oui, c'est pour moi. Non, c'est pour au dessus :-)*/
-                            /*@ assert ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler ∈ {&handler_ep}; */
-                            /*@ calls handler_ep; */
-                        errcode = ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler(dev_id, size, ep);
-                    }
-                    break;
-                }
+        /* here we resolve both ep id and direction, in a single access to the
+         * current configuration EP table */
+        usbctrl_ep_entry_t *entry = usbctrl_get_endpoint_entry(ctx, ep | USBCTRL_EP_ADDR_DIR_IN);
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+        if (entry != NULL && ep != EP0) {
+            /* collected by the task through usbctrl_wait_events() */
+            usbctrl_ep_events_record(ctx, ep | USBCTRL_EP_ADDR_DIR_IN, size);
+            goto err;
+        }
+#endif
+        if (entry != NULL && entry->handler != NULL) {
+            log_printf("[LIBCTRL] found ep in iface %d, declared ep %d\n", entry->iface_id, entry->ep_id);
+
+            #ifndef __FRAMAC__
+            if (handler_sanity_check_with_panic((physaddr_t)entry->handler)) {
+                goto err;
             }
+            #endif
+
+            log_printf("[LIBCTRL] iepint: executing upper class handler for EP %d\n", ep);
+            /*@ assert entry->handler ∈ {&handler_ep}; */
+            /*@ calls handler_ep; */
+            errcode = entry->handler(dev_id, size, ep);
         }
     }
 err:
-    request_data_membarrier();
     return errcode;
 }
 
@@ -452,14 +453,14 @@ err:
      @ behavior state_USB_BACKEND_DRV_EP_STATE_SETUP_size_inferior_8 :
      @   assumes \exists integer i ; 0 <= i < GHOST_num_ctx && ctx_list[i].dev_id == dev_id ;
      @   assumes (ep < USB_BACKEND_DRV_MAX_OUT_EP) ;
-     @   assumes GHOST_out_eps[ep].state == USB_BACKEND_DRV_EP_STATE_SETUP;
+     @   assumes ep_state == USB_BACKEND_DRV_EP_STATE_SETUP;
      @   assumes size < 8 ;
      @   ensures is_valid_error(\result);
 
      @ behavior state_USB_BACKEND_DRV_EP_STATE_SETUP_size_other :
      @   assumes \exists integer i ; 0 <= i < GHOST_num_ctx && ctx_list[i].dev_id == dev_id ;
      @   assumes (ep < USB_BACKEND_DRV_MAX_OUT_EP) ;
-     @   assumes GHOST_out_eps[ep].state == USB_BACKEND_DRV_EP_STATE_SETUP;
+     @   assumes ep_state == USB_BACKEND_DRV_EP_STATE_SETUP;
      @   assumes size >= 8 ;
      @   ensures is_valid_error(\result);
 
@@ -467,14 +468,14 @@ err:
      @   assumes \exists integer i ; 0 <= i < GHOST_num_ctx && ctx_list[i].dev_id == dev_id ;
      @   assumes (ep < USB_BACKEND_DRV_MAX_OUT_EP) ;
      @   assumes size == 0 ;
-     @   assumes GHOST_out_eps[ep].state == USB_BACKEND_DRV_EP_STATE_DATA_OUT;
+     @   assumes ep_state == USB_BACKEND_DRV_EP_STATE_DATA_OUT;
      @   assigns GHOST_idx_ctx, GHOST_opaque_drv_privates;
      @   ensures \result == MBED_ERROR_NONE ;
 
      @ behavior state_USB_BACKEND_DRV_EP_STATE_DATA_OUT_size_not_0:
      @   assumes \exists integer i ; 0 <= i < GHOST_num_ctx && ctx_list[i].dev_id == dev_id ;
      @   assumes (ep < USB_BACKEND_DRV_MAX_OUT_EP) ;
-     @   assumes GHOST_out_eps[ep].state == USB_BACKEND_DRV_EP_STATE_DATA_OUT;
+     @   assumes ep_state == USB_BACKEND_DRV_EP_STATE_DATA_OUT;
      @   assumes size != 0 ;
 	 @   assigns GHOST_idx_ctx, GHOST_opaque_drv_privates;
      @   ensures is_valid_error(\result);
@@ -482,8 +483,8 @@ err:
      @ behavior defaults_in_state:
      @   assumes \exists integer i ; 0 <= i < GHOST_num_ctx && ctx_list[i].dev_id == dev_id ;
      @   assumes (ep < USB_BACKEND_DRV_MAX_OUT_EP) ;
-     @   assumes GHOST_out_eps[ep].state != USB_BACKEND_DRV_EP_STATE_DATA_OUT;
-     @   assumes GHOST_out_eps[ep].state != USB_BACKEND_DRV_EP_STATE_SETUP;
+     @   assumes ep_state != USB_BACKEND_DRV_EP_STATE_DATA_OUT;
+     @   assumes ep_state != USB_BACKEND_DRV_EP_STATE_SETUP;
      @   assigns GHOST_idx_ctx, GHOST_opaque_drv_privates;
      @   ensures \result == MBED_ERROR_NONE ;
 
@@ -497,7 +498,10 @@ err:
 */
 
 
-mbed_error_t usbctrl_handle_outepevent(uint32_t dev_id, uint32_t size, uint8_t ep)
+mbed_error_t usbctrl_exec_outepevent(uint32_t                   dev_id,
+                                     uint32_t                   size,
+                                     uint8_t                    ep,
+                                     usb_backend_drv_ep_state_t ep_state)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     usbctrl_context_t *ctx = NULL;
@@ -514,96 +518,89 @@ mbed_error_t usbctrl_handle_outepevent(uint32_t dev_id, uint32_t size, uint8_t e
      * in the second case, we have received some data, targetting one of the
      * interface which has registered a DATA EP with the corresponding EP id */
 
-    switch (usb_backend_drv_get_ep_state(ep, USB_BACKEND_DRV_EP_DIR_OUT)) {
+    switch (ep_state) {
         case USB_BACKEND_DRV_EP_STATE_SETUP:
             /*@ assert (ep < USB_BACKEND_DRV_MAX_OUT_EP) ; */
             log_printf("[LIBCTRL] oepint: a setup pkt transfert has been fully received. Handle it !\n");
 
             if (size < 8) {
-                usb_backend_drv_stall(ep, USB_BACKEND_DRV_EP_DIR_OUT);
+                usbctrl_drv_stall(ctx, ep, USB_BACKEND_DRV_EP_DIR_OUT);
                 break;
             }
             /* first, we should not accept setup pkt from other EP than 0.
              * Although, this is not forbidden by USB 2.0 standard. */
-            /* Second, we must convert received data into current endianess */
-            const uint8_t *setup_packet = ctx->ctrl_fifo;
-            usbctrl_setup_pkt_t formated_pkt = {
-                setup_packet[0],
-                setup_packet[1],
-                (uint16_t)(setup_packet[3] << 8 | setup_packet[2]),
-                (uint16_t)(setup_packet[5] << 8 | setup_packet[4]),
-                (uint16_t)(setup_packet[7] << 8 | setup_packet[6])
-            };
+            /* Second, the received data has been converted into current endianess
+             * and queued at event time: get back the oldest pending SETUP packet */
+            usbctrl_setup_pkt_t formated_pkt;
+            if (usbctrl_setup_ring_pop(ctx, &formated_pkt) == false) {
+                /* SETUP packet lost at event time (SETUP ring full) */
+                log_printf("[LIBCTRL] oepint: SETUP packet lost (%d lost)\n", ctx->setup_ring.lost);
+                errcode = MBED_ERROR_NOSTORAGE;
+                goto err;
+            }
             errcode = usbctrl_handle_requests(&formated_pkt, dev_id);
             return errcode;
             break;
         case USB_BACKEND_DRV_EP_STATE_DATA_OUT: {
-            uint8_t curr_cfg = ctx->curr_cfg;
+            /* data (or ZLP) received for a submitted transfer */
+            if (ep != EP0 && usbctrl_xfer_out_complete(ctx, ep, size) == true) {
+                goto err;
+            }
             if (size == 0) {
-                /* Well; nothing to do with size = 0 ? */
+                if (ep == EP0 && ctx->ctrl_phase == USBCTRL_CTRL_PHASE_STATUS) {
+                    /* host status stage of a control read transfer */
+                    log_printf("[LIBCTRL] end of control level request\n");
+                    usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_IDLE);
+                }
                 break;
             }
 
-            /*@
-                @ loop invariant 0 <= iface <= ctx->cfg[curr_cfg].interface_num ;
-                @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces[iface].eps + (ctx->cfg[curr_cfg].interface_num-1));
-                @ loop invariant size != 0 ;
-                @ loop assigns iface ;
-                @ loop variant (ctx->cfg[curr_cfg].interface_num -iface) ;
-            */
-
-            for (uint8_t iface = 0; iface < ctx->cfg[curr_cfg].interface_num; ++iface) {
-
-            /*@
-                @ loop invariant 0 <= i <= ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number ;
-                @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces[iface].eps + (ctx->cfg[curr_cfg].interface_num-1));
-                @ loop assigns i ;
-                @ loop variant (ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number -i);
-            */
-
-
-                for (uint8_t i = 0; i < ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number; ++i) {
-                    /* here we check both ep id and direction and EP0 is a specific full duplex case */
-                    if (   ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num == ep
-                        && ctx->cfg[curr_cfg].interfaces[iface].eps[i].dir == USB_EP_DIR_OUT) {
-                        /*
-                         * XXX: when using ctx->ctrl_req_processing flag, is the FIFO comparison
-                         * still useful ?
-                         * Though. We *must* set the recv FIFO again, considering that no
-                         * DATA in on EP0 happen for CTRL lib, only for upper stack.
-                         */
-                        /* EP0 special: We have received data from the host on CTRL EP.
-                         * These data can target our CTRL usage,  or another upper stack one's...
-                         * We can differenciate such cases by compare the currently configured
-                         * FIFO at driver level with our ususal recv FIFO. If the driver,
-                         * during the rxflvl time, used a FIFO not controlled by us, this means
-                         * that the current DATA out transfer is not for us.
-                         * In that last case:
-                         * 1. we call the upper layer stack
-                         * 2. we set back our FIFO to handle properly next setup packets
-                         */
-                        log_printf("[LIBCTRL] oepint: executing upper data handler (0x%x) for EP %d (size %d)\n",ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler, ep, size);
-                        if (ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler != NULL) {
-
-                            /*@ assert ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler ∈ {&handler_ep}; */
-                            /*@ calls handler_ep; */
-                            ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler(dev_id, size, ep);
-
-                            /* now that data are transfered (oepint finished) whe can set back our FIFO for
-                             * EP0, in order to support next EP0 events */
-                            errcode = usb_backend_drv_set_recv_fifo(&(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
-                            /*@ assert errcode == MBED_ERROR_NONE || errcode == MBED_ERROR_INVPARAM || errcode == MBED_ERROR_INVSTATE ; */
-                        }
-                        /*@ assert errcode == MBED_ERROR_NONE || errcode == MBED_ERROR_INVPARAM || errcode == MBED_ERROR_INVSTATE ; */
-                        goto err;
-                    }
+            /* data stage of a host-to-device control request, received by the libctrl
+             * (vendor requests, interfaces requests with a declared data stage handler) */
+            if (ep == EP0 && ctx->ep0_out.handler != NULL) {
+                errcode = usbctrl_handle_ctrl_data_stage(ctx, size);
+                goto err;
+            }
+
+            /* here we resolve both ep id and direction, in a single access to the
+             * current configuration EP table */
+            usbctrl_ep_entry_t *entry = usbctrl_get_endpoint_entry(ctx, ep);
+#if CONFIG_USBCTRL_EP_EVENTS_COALESCING
+            if (entry != NULL && ep != EP0) {
+                /* collected by the task through usbctrl_wait_events() */
+                usbctrl_ep_events_record(ctx, ep, size);
+                goto err;
+            }
+#endif
+            if (entry != NULL) {
+                /*
+                 * EP0 special: control data stages received by the libctrl are handled
+                 * above. Here are only data sent on EP0 to upper layers which have not
+                 * declared a data stage handler, and which have set their own reception
+                 * FIFO at SETUP time. In that case:
+                 * 1. we call the upper layer stack
+                 * 2. we set back our FIFO to handle properly next setup packets
+                 */
+                log_printf("[LIBCTRL] oepint: executing upper data handler (0x%x) for EP %d (size %d)\n", (uint32_t)(physaddr_t)entry->handler, ep, size);
+                if (entry->handler != NULL) {
+
+                    /*@ assert entry->handler ∈ {&handler_ep}; */
+                    /*@ calls handler_ep; */
+                    entry->handler(dev_id, size, ep);
+
+                    /* now that data are transfered (oepint finished) whe can set back our FIFO for
+                     * EP0, in order to support next EP0 events */
+                    errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, 0);
+                    /*@ assert errcode == MBED_ERROR_NONE || errcode == MBED_ERROR_INVPARAM || errcode == MBED_ERROR_INVSTATE ; */
                 }
+                /*@ assert errcode == MBED_ERROR_NONE || errcode == MBED_ERROR_INVPARAM || errcode == MBED_ERROR_INVSTATE ; */
+                goto err;
             }
             /* if we arrive here, this means that no active EP has been found above, corresponding to
              * the EP on which we have received some content. This is *not* a valid behavior, and we
              * should inform the host of this */
             errcode = MBED_ERROR_INVSTATE;
-            usb_backend_drv_nak(ep, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_drv_nak(ctx, ep, USB_BACKEND_DRV_EP_DIR_OUT);
             /* goto err is, currently, useless as there is no effective code executed between this line
              * and the err: label. Though, in order to be future-proof in case of code inclusion, we
              * prefer to add the goto statement. */
@@ -611,12 +608,11 @@ mbed_error_t usbctrl_handle_outepevent(uint32_t dev_id, uint32_t size, uint8_t e
             break;
         }
         default:
-            log_printf("[LIBCTRL] oepint: EP not in good state: %d !\n",usb_backend_drv_get_ep_state(ep, USB_BACKEND_DRV_EP_DIR_OUT));
+            log_printf("[LIBCTRL] oepint: EP not in good state: %d !\n", ep_state);
             /*@ assert errcode == MBED_ERROR_NONE ; */
             break;
     }
 err:
-    request_data_membarrier();
     return errcode;
 }
 
@@ -626,7 +622,7 @@ err:
 
 */
 
-mbed_error_t usbctrl_handle_wakeup(uint32_t dev_id __attribute__((unused)))
+mbed_error_t usbctrl_exec_wakeup(uint32_t dev_id __attribute__((unused)))
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
     usbctrl_context_t *ctx = NULL;
@@ -687,3 +683,40 @@ err:
 
     return errcode;
 }
+
+/*@
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_exec_sof(uint32_t dev_id __attribute__((unused)),
+                              uint16_t frame __attribute__((unused)))
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+#if CONFIG_USBCTRL_SOF_HOOK
+    usbctrl_context_t *ctx = NULL;
+    usbctrl_sof_handler_t handler;
+
+    if (usbctrl_get_context(dev_id, &ctx) != MBED_ERROR_NONE) {
+        log_printf("[USBCTRL] sof: no ctx found!\n");
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* periodic streams only exist in configured state */
+    if (usbctrl_get_state(ctx) != USB_DEVICE_STATE_CONFIGURED) {
+        goto err;
+    }
+    /* the hook may have been unregistered since the event capture */
+    handler = usbctrl_load_acquire(&(ctx->sof_handler));
+    if (handler == NULL) {
+        goto err;
+    }
+#ifndef __FRAMAC__
+    if (handler_sanity_check_with_panic((physaddr_t)handler)) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+#endif
+    handler(dev_id, frame);
+err:
+#endif
+    return errcode;
+}
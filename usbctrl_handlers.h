@@ -25,6 +25,7 @@
 #define USBCTRL_HANDLERS_H_
 
 #include "libc/types.h"
+#include "api/libusbctrl.h"
 
 /*
  * This package hold the various USB handlers that are triggered by the USB
@@ -46,4 +47,35 @@ mbed_error_t usbctrl_handle_outepevent(uint32_t dev_id, uint32_t size, uint8_t e
 
 mbed_error_t usbctrl_handle_wakeup(uint32_t dev_id);
 
+/*
+ * Start-Of-Frame. Only the SOF matching the upper layer hook divisor generate an
+ * event (CONFIG_USBCTRL_SOF_HOOK), the other ones return at once.
+ */
+mbed_error_t usbctrl_handle_sof(uint32_t dev_id);
+
+/*
+ * Effective handling of the above events. The driver triggered handlers capture
+ * the event (see usbctrl_event.h), which is then executed here, either directly
+ * (in the driver ISR context) or at usbctrl_dispatch() time (deferred mode).
+ * For OUT EP events, the EP state is the one captured at event time, and the
+ * SETUP packets are the ones queued in the context SETUP ring at event time.
+ * For reset events, setup_head is the SETUP ring head at event time.
+ */
+mbed_error_t usbctrl_exec_earlysuspend(uint32_t dev_id);
+
+mbed_error_t usbctrl_exec_reset(uint32_t dev_id, uint8_t setup_head);
+
+mbed_error_t usbctrl_exec_usbsuspend(uint32_t dev_id);
+
+mbed_error_t usbctrl_exec_inepevent(uint32_t dev_id, uint32_t size, uint8_t ep);
+
+mbed_error_t usbctrl_exec_outepevent(uint32_t                   dev_id,
+                                     uint32_t                   size,
+                                     uint8_t                    ep,
+                                     usb_backend_drv_ep_state_t ep_state);
+
+mbed_error_t usbctrl_exec_wakeup(uint32_t dev_id);
+
+mbed_error_t usbctrl_exec_sof(uint32_t dev_id, uint16_t frame);
+
 #endif/*!USBCTRL_HANDLERS_H_*/
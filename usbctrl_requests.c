@@ -1,8 +1,15 @@
 #include "libc/sync.h"
+#include "libc/string.h"
 #include "api/libusbctrl.h"
 #include "usbctrl_state.h"
 #include "usbctrl.h"
+#include "usbctrl_drv.h"
 #include "usbctrl_descriptors.h"
+#include "usbctrl_static_desc.h"
+#include "usbctrl_xfer.h"
+#if CONFIG_USBCTRL_CTRL_TIMESTAMPS
+#include "libc/syscall.h"
+#endif
 
 
 
@@ -88,6 +95,21 @@ usbctrl_req_recipient_t usbctrl_std_req_get_recipient(usbctrl_setup_pkt_t const
     return ((pkt->bmRequestType) & 0x1F);
 }
 
+/*@
+    @ requires \valid_read(pkt);
+    @ assigns \nothing ;
+    @ ensures \result == ((pkt->bmRequestType >> 7) & 0x1);
+*/
+
+#ifndef __FRAMAC__
+static inline
+#endif
+usbctrl_req_dir_t usbctrl_std_req_get_dir(usbctrl_setup_pkt_t const * const pkt)
+{
+    /* bit 7 */
+    return ((pkt->bmRequestType >> 7) & 0x1);
+}
+
 
 
 typedef enum {
@@ -204,6 +226,47 @@ bool is_vendor_requests_allowed(usbctrl_context_t const * const ctx)
  * About configuration set/unset utilities (used by set_configuration function)
  */
 
+/*
+ * Deactivate the configured endpoints of the given interface of the current
+ * configuration. Deconfiguration failures are not blocking.
+ */
+/*@
+    @ requires \separated(ctx,&GHOST_opaque_drv_privates);
+    @ requires iface < MAX_INTERFACES_PER_DEVICE ;
+    @ assigns  *ctx , GHOST_opaque_drv_privates;
+    @ ensures \result == MBED_ERROR_INVPARAM || \result == MBED_ERROR_NONE ;
+ */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_unset_iface_endpoints(usbctrl_context_t *ctx, uint8_t iface)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t curr_cfg = ctx->curr_cfg;
+    uint8_t max_ep = ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number ;
+
+    /*@
+        @ loop invariant 0 <= i <= max_ep ;
+        @ loop invariant \valid(ctx->cfg[curr_cfg].interfaces[iface].eps + (0..(max_ep-1))) ;
+        @ loop invariant \separated(ctx);
+        @ loop assigns i, errcode, *ctx, GHOST_opaque_drv_privates;
+        @ loop variant (max_ep - i) ;
+    */
+    for (uint8_t i = 0; i < max_ep; ++i) {
+
+        if (ctx->cfg[curr_cfg].interfaces[iface].eps[i].configured == true) {
+            errcode = usbctrl_drv_deconfigure_endpoint(ctx, ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num);
+            if (errcode != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] failure while deconfiguring EP %x\n",
+                        usbctrl_drv_deconfigure_endpoint(ctx, ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num));
+            }
+            /* published by the device state change */
+            ctx->cfg[curr_cfg].interfaces[iface].eps[i].configured = false;
+        }
+    }
+    return errcode;
+}
+
 /*
  * Deactivate currently configured endpoints
  */
@@ -225,6 +288,9 @@ mbed_error_t usbctrl_unset_active_endpoints(usbctrl_context_t *ctx)
     uint8_t curr_cfg = ctx->curr_cfg;
     uint8_t max_iface = ctx->cfg[curr_cfg].interface_num ;
 
+    /* pending transfers are dropped with their endpoints */
+    usbctrl_xfer_flush(ctx);
+
     /*@
         @ loop invariant 0 <= iface <= max_iface ;
         @ loop invariant \valid(ctx->cfg[curr_cfg].interfaces +(0..(max_iface-1)));
@@ -234,37 +300,123 @@ mbed_error_t usbctrl_unset_active_endpoints(usbctrl_context_t *ctx)
         */
 
     for (uint8_t iface = 0; iface < max_iface; ++iface) {
+        errcode = usbctrl_unset_iface_endpoints(ctx, iface);
+    }
+
+err:
+    return errcode;
+
+}
+
 
-        uint8_t max_ep = ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number ;
+/*
+ * Activate the endpoints of the current alternate setting of the given interface
+ * of the current configuration.
+ */
+/*@
+    @ requires \separated(ctx);
+    @ requires iface < MAX_INTERFACES_PER_DEVICE ;
+    @ assigns *ctx ;
+    @ assigns GHOST_in_eps[0 .. USB_BACKEND_DRV_MAX_IN_EP-1].state;
+    @ assigns GHOST_out_eps[0 .. USB_BACKEND_DRV_MAX_OUT_EP-1].state;
+    @ ensures \result == MBED_ERROR_NONE || \result == MBED_ERROR_INVPARAM || \result ≡ MBED_ERROR_NOSTORAGE ;
+ */
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_set_iface_endpoints(usbctrl_context_t *ctx, uint8_t iface)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t curr_cfg = ctx->curr_cfg;
+    uint8_t max_ep = ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number ;
 
     /*@
         @ loop invariant 0 <= i <= max_ep ;
-        @ loop invariant \valid(ctx->cfg[curr_cfg].interfaces +(0..(max_iface-1)));
         @ loop invariant \valid(ctx->cfg[curr_cfg].interfaces[iface].eps + (0..(max_ep-1))) ;
         @ loop invariant \separated(ctx);
-        @ loop assigns i, errcode, *ctx, GHOST_opaque_drv_privates;
+        @ loop assigns i, errcode, *ctx, GHOST_in_eps[0 .. 6 - 1].state, GHOST_out_eps[0 .. 6 - 1].state;
         @ loop variant (max_ep - i) ;
     */
+    for (uint8_t i = 0; i < max_ep; ++i) {
+        usb_backend_drv_ep_dir_t dir;
+        usb_backend_drv_ep_type_t type;
+        usb_backend_drv_ep_toggle_t toggle = USB_BACKEND_EP_ODDFRAME;
+        if (ctx->cfg[curr_cfg].interfaces[iface].eps[i].alt_setting != ctx->cfg[curr_cfg].interfaces[iface].alt_setting) {
+            /* EP of another alternate setting */
+            continue;
+        }
+        switch (ctx->cfg[curr_cfg].interfaces[iface].eps[i].dir) {
+            case USB_EP_DIR_OUT:
+                dir = USB_BACKEND_DRV_EP_DIR_OUT;
+                break;
+            case USB_EP_DIR_IN:
+                dir = USB_BACKEND_DRV_EP_DIR_IN;
+                break;
+            case USB_EP_DIR_BOTH:
+                dir = USB_BACKEND_DRV_EP_DIR_BOTH;
+                break;
+            default:
+                log_printf("[USBCTRL] invalid EP dir !\n");
+                errcode = MBED_ERROR_INVPARAM;
+                goto err;
+                break;
+        }
+        switch (ctx->cfg[curr_cfg].interfaces[iface].eps[i].type) {
+            case USB_EP_TYPE_CONTROL:
+                type = USB_BACKEND_DRV_EP_TYPE_CONTROL;
+                break;
+            case USB_EP_TYPE_ISOCHRONOUS:
+                type = USB_BACKEND_DRV_EP_TYPE_ISOCHRONOUS;
+                /* the first packet is sent (or received) in the next frame */
+                if (usbctrl_drv_has_frame_number(ctx)) {
+                    toggle = ((usbctrl_drv_get_frame_number(ctx) + 1) & 0x1) ?
+                             USB_BACKEND_EP_ODDFRAME : USB_BACKEND_EP_EVENFRAME;
+                }
+                break;
+            case USB_EP_TYPE_BULK:
+                type = USB_BACKEND_DRV_EP_TYPE_BULK;
+                break;
+            case USB_EP_TYPE_INTERRUPT:
+                type = USB_BACKEND_DRV_EP_TYPE_INT;
+                break;
+            default:
+                log_printf("[USBCTRL] invalid EP type !\n");
+                errcode = MBED_ERROR_INVPARAM;
+                goto err;
+                break;
+        }
 
-        for (uint8_t i = 0; i < max_ep; ++i) {
+       log_printf("[LIBCTRL] configure EP %d (dir %d)\n", ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num, dir);
 
-            if (ctx->cfg[curr_cfg].interfaces[iface].eps[i].configured == true) {
-                errcode = usb_backend_drv_deconfigure_endpoint(ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num);
-                if (errcode != MBED_ERROR_NONE) {
-                    log_printf("[USBCTRL] failure while deconfiguring EP %x\n",
-                            usb_backend_drv_deconfigure_endpoint(ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num));
-                }
-                set_bool_with_membarrier(&ctx->cfg[curr_cfg].interfaces[iface].eps[i].configured, false);
+       if (ctx->cfg[curr_cfg].interfaces[iface].eps[i].type != USB_EP_TYPE_CONTROL) {
+            errcode = usbctrl_drv_configure_endpoint(ctx, ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num,
+                    type,
+                    dir,
+                    ctx->cfg[curr_cfg].interfaces[iface].eps[i].pkt_maxsize,
+                    toggle,
+                    ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler);
+            /*@ assert errcode == MBED_ERROR_INVSTATE || errcode == MBED_ERROR_NONE  || errcode == MBED_ERROR_NOSTORAGE ; */
+
+             if (errcode != MBED_ERROR_NONE) {
+                log_printf("[LIBCTRL] unable to configure EP %d (dir %d): err %d\n", ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num, dir, errcode);
+                goto err;
             }
+
+        }
+        /* published by the device state change */
+        ctx->cfg[curr_cfg].interfaces[iface].eps[i].configured = true;
+        /* ping-pong OUT EPs receive data as soon as they are configured, double
+         * buffered isochronous IN EPs start streaming at the next frame */
+        errcode = usbctrl_xfer_start_pingpong(ctx, &ctx->cfg[curr_cfg].interfaces[iface].eps[i]);
+        if (errcode != MBED_ERROR_NONE) {
+            log_printf("[LIBCTRL] unable to arm ping-pong EP %d: err %d\n", ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num, errcode);
+            goto err;
         }
     }
-
 err:
     return errcode;
-
 }
 
-
 /*@
     @ requires \separated(ctx);
     @ assigns *ctx ;
@@ -290,6 +442,9 @@ mbed_error_t usbctrl_set_active_endpoints(usbctrl_context_t *ctx)
     uint8_t curr_cfg = ctx->curr_cfg;
     uint8_t max_iface = ctx->cfg[curr_cfg].interface_num ;
 
+    /* transfers submitted for the previous configuration are dropped */
+    usbctrl_xfer_flush(ctx);
+
     /*@
         @ loop invariant 0 <= iface <= max_iface ;
         @ loop invariant \valid(ctx->cfg[curr_cfg].interfaces +(0..(max_iface-1)));
@@ -298,81 +453,372 @@ mbed_error_t usbctrl_set_active_endpoints(usbctrl_context_t *ctx)
         @ loop variant (max_iface - iface);
     */
     for (uint8_t iface = 0; iface < max_iface; ++iface) {
+        if (ctx->cfg[curr_cfg].interfaces[iface].alt_setting != 0) {
+            /* SetConfiguration selects the default alternate setting of each interface */
+            usbctrl_ep_table_set_altsetting(&(ctx->cfg[curr_cfg]), iface, 0);
+        }
+        errcode = usbctrl_set_iface_endpoints(ctx, iface);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+err:
+    return errcode;
 
-        uint8_t max_ep = ctx->cfg[curr_cfg].interfaces[iface].usb_ep_number ;
+}
 
-    /*@
-        @ loop invariant 0 <= i <= max_ep ;
-        @ loop invariant \valid(ctx->cfg[curr_cfg].interfaces +(0..(max_iface-1)));
-        @ loop invariant \valid(ctx->cfg[curr_cfg].interfaces[iface].eps + (0..(max_ep-1))) ;
-        @ loop invariant \separated(ctx);
-        @ loop assigns i, errcode, *ctx, GHOST_in_eps[0 .. 6 - 1].state, GHOST_out_eps[0 .. 6 - 1].state;
-        @ loop variant (max_ep - i) ;
-    */
+/*
+ * About control transfers phases.
+ *
+ * Each control transfer goes through SETUP -> [DATA_IN|DATA_OUT] -> STATUS -> IDLE.
+ * The current phase is only written by the control pipe handlers (i.e. in the
+ * USB ISR context), and is never read by the upper layers: no memory barrier is
+ * required here.
+ * The status stage is sent by the libctrl itself, once the request is handled
+ * (no data stage) or once the data stage is complete.
+ */
 
-        for (uint8_t i = 0; i < max_ep; ++i) {
-            usb_backend_drv_ep_dir_t dir;
-            usb_backend_drv_ep_type_t type;
-            switch (ctx->cfg[curr_cfg].interfaces[iface].eps[i].dir) {
-                case USB_EP_DIR_OUT:
-                    dir = USB_BACKEND_DRV_EP_DIR_OUT;
-                    break;
-                case USB_EP_DIR_IN:
-                    dir = USB_BACKEND_DRV_EP_DIR_IN;
-                    break;
-                case USB_EP_DIR_BOTH:
-                    dir = USB_BACKEND_DRV_EP_DIR_BOTH;
-                    break;
-                default:
-                    log_printf("[USBCTRL] invalid EP dir !\n");
-                    errcode = MBED_ERROR_INVPARAM;
-                    goto err;
-                    break;
-            }
-            switch (ctx->cfg[curr_cfg].interfaces[iface].eps[i].type) {
-                case USB_EP_TYPE_CONTROL:
-                    type = USB_BACKEND_DRV_EP_TYPE_CONTROL;
-                    break;
-                case USB_EP_TYPE_ISOCHRONOUS:
-                    type = USB_BACKEND_DRV_EP_TYPE_ISOCHRONOUS;
-                    break;
-                case USB_EP_TYPE_BULK:
-                    type = USB_BACKEND_DRV_EP_TYPE_BULK;
-                    break;
-                case USB_EP_TYPE_INTERRUPT:
-                    type = USB_BACKEND_DRV_EP_TYPE_INT;
-                    break;
-                default:
-                    log_printf("[USBCTRL] invalid EP type !\n");
-                    errcode = MBED_ERROR_INVPARAM;
-                    goto err;
-                    break;
+#if CONFIG_USBCTRL_CTRL_TIMESTAMPS
+static const char *ctrl_phase_names[USBCTRL_CTRL_PHASE_NUM] = {
+    "idle", "setup", "data in", "data out", "status"
+};
+#endif
+
+/*@
+    @ requires \valid(ctx);
+    @ requires phase < USBCTRL_CTRL_PHASE_NUM;
+    @ assigns ctx->ctrl_phase ;
+    @ ensures ctx->ctrl_phase == phase ;
+*/
+void usbctrl_ctrl_set_phase(usbctrl_context_t    *ctx,
+                            usbctrl_ctrl_phase_t  phase)
+{
+#if CONFIG_USBCTRL_CTRL_TIMESTAMPS
+    uint64_t ts = 0;
+    sys_get_systick(&ts, PREC_CYCLE);
+    ctx->ctrl_phase_ts[phase] = ts;
+    if (phase == USBCTRL_CTRL_PHASE_IDLE && ctx->ctrl_phase != USBCTRL_CTRL_PHASE_IDLE) {
+        /* transfer complete (or aborted): dump each traversed phase latency */
+        for (uint8_t i = USBCTRL_CTRL_PHASE_SETUP; i < USBCTRL_CTRL_PHASE_NUM; ++i) {
+            if (ctx->ctrl_phase_ts[i] >= ctx->ctrl_phase_ts[USBCTRL_CTRL_PHASE_SETUP]) {
+                log_printf("[USBCTRL] ctrl %s: +%d cycles\n", ctrl_phase_names[i],
+                           (uint32_t)(ctx->ctrl_phase_ts[i] - ctx->ctrl_phase_ts[USBCTRL_CTRL_PHASE_SETUP]));
             }
+        }
+        log_printf("[USBCTRL] ctrl complete: +%d cycles\n",
+                   (uint32_t)(ts - ctx->ctrl_phase_ts[USBCTRL_CTRL_PHASE_SETUP]));
+    }
+#endif
+    ctx->ctrl_phase = phase;
+}
 
-           log_printf("[LIBCTRL] configure EP %d (dir %d)\n", ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num, dir);
+/*
+ * Send the status stage of the current control transfer (ZLP on EP0 IN). The
+ * transfer is complete at ZLP transmission completion.
+ */
 
-           if (ctx->cfg[curr_cfg].interfaces[iface].eps[i].type != USB_EP_TYPE_CONTROL) {
-                errcode = usb_backend_drv_configure_endpoint(ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num,
-                        type,
-                        dir,
-                        ctx->cfg[curr_cfg].interfaces[iface].eps[i].pkt_maxsize,
-                        USB_BACKEND_EP_ODDFRAME,
-                        ctx->cfg[curr_cfg].interfaces[iface].eps[i].handler);
-                /*@ assert errcode == MBED_ERROR_INVSTATE || errcode == MBED_ERROR_NONE  || errcode == MBED_ERROR_NOSTORAGE ; */
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->ctrl_phase ;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_ctrl_status(usbctrl_context_t *ctx)
+{
+    usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_STATUS);
+    return usbctrl_drv_send_zlp(ctx, EP0);
+}
 
-                 if (errcode != MBED_ERROR_NONE) {
-                    log_printf("[LIBCTRL] unable to configure EP %d (dir %d): err %d\n", ctx->cfg[curr_cfg].interfaces[iface].eps[i].ep_num, dir, errcode);
-                    goto err;
-                }
+/*
+ * Reject the current control transfer. The control pipe is back to idle, waiting
+ * for the next SETUP packet.
+ */
 
-            }
-            set_bool_with_membarrier(&ctx->cfg[curr_cfg].interfaces[iface].eps[i].configured, true);
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->ctrl_phase ;
+    @ ensures ctx->ctrl_phase == USBCTRL_CTRL_PHASE_IDLE ;
+*/
+void usbctrl_ctrl_stall(usbctrl_context_t        *ctx,
+                        usb_backend_drv_ep_dir_t  dir)
+{
+    usbctrl_drv_stall(ctx, EP0, dir);
+    usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_IDLE);
+}
+
+/*
+ * End of the SETUP phase handling. If the request handler has not started a data
+ * stage (or stalled the pipe), the status stage is sent here, or the pipe is
+ * stalled if the request has failed.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->ctrl_phase ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+void usbctrl_ctrl_setup_done(usbctrl_context_t *ctx,
+                             mbed_error_t       errcode)
+{
+    if (ctx->ctrl_phase != USBCTRL_CTRL_PHASE_SETUP) {
+        /* data stage started, or transfer already terminated */
+        return;
+    }
+    if (errcode == MBED_ERROR_NONE) {
+        usbctrl_ctrl_status(ctx);
+    } else {
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
+    }
+}
+
+/*
+ * About control pipe IN data stage.
+ *
+ * Responses (descriptors and others) may be larger than the control pipe max
+ * packet size, up to wLength (i.e. 64KB). They are sent packet per packet: the
+ * first packet is sent at request handling time, the next ones at the previous
+ * packet transmission completion (see usbctrl_handle_inepevent()).
+ * When the response is shorter than wLength and is a multiple of the max packet
+ * size, the host can't detect the end of the data stage. A ZLP is then sent.
+ * The response must then stay valid until the end of the data stage: responses
+ * forged at request handling time are built in the context data stage buffer,
+ * never on the stack.
+ */
+
+/*
+ * Context data stage buffer, cleared on size bytes, for short responses.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ requires size <= CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE;
+    @ assigns ctx->ctrl_data_buf[0 .. size-1] ;
+    @ ensures \result == &(ctx->ctrl_data_buf[0]) ;
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+uint8_t *usbctrl_ep0_resp_buf(usbctrl_context_t *ctx,
+                              uint8_t            size)
+{
+    memset(&(ctx->ctrl_data_buf[0]), 0x0, size);
+    return &(ctx->ctrl_data_buf[0]);
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->ep0_in, ctx->ctrl_phase ;
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_ep0_send(usbctrl_context_t *ctx,
+                              const uint8_t     *data,
+                              uint32_t           size,
+                              uint16_t           wLength)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t pkt_size;
+
+    if (ctx == NULL || (data == NULL && size != 0)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (size > wLength) {
+        /* the host never receives more than requested */
+        size = wLength;
+    }
+    usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_DATA_IN);
+    ctx->ep0_in.data = data;
+    ctx->ep0_in.size = (uint16_t)size;
+    ctx->ep0_in.zlp = (size < wLength && (size % ctx->ep0_mpsize) == 0);
+    if (size == 0) {
+        /* empty data stage is a ZLP by itself */
+        ctx->ep0_in.zlp = false;
+        ctx->ep0_in.offset = 0;
+        errcode = usbctrl_drv_send_zlp(ctx, EP0);
+        goto err;
+    }
+    pkt_size = (size > ctx->ep0_mpsize) ? ctx->ep0_mpsize : size;
+    ctx->ep0_in.offset = (uint16_t)pkt_size;
+    errcode = usbctrl_drv_send_data(ctx, (uint8_t*)data, pkt_size, EP0);
+err:
+    return errcode;
+}
+
+/*
+ * Called on control pipe IN transmission completion. Returns true if the data stage
+ * is not finished (another packet, or the terminating ZLP, has been sent), false if
+ * the data stage is complete.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->ep0_in ;
+*/
+bool usbctrl_ep0_in_next(usbctrl_context_t *ctx)
+{
+    bool in_progress = false;
+    uint32_t pkt_size;
+
+    if (ctx->ep0_in.offset < ctx->ep0_in.size) {
+        pkt_size = ctx->ep0_in.size - ctx->ep0_in.offset;
+        if (pkt_size > ctx->ep0_mpsize) {
+            pkt_size = ctx->ep0_mpsize;
         }
+        usbctrl_drv_send_data(ctx, (uint8_t*)&(ctx->ep0_in.data[ctx->ep0_in.offset]), pkt_size, EP0);
+        ctx->ep0_in.offset += (uint16_t)pkt_size;
+        in_progress = true;
+        goto end;
+    }
+    if (ctx->ep0_in.zlp == true) {
+        ctx->ep0_in.zlp = false;
+        usbctrl_drv_send_zlp(ctx, EP0);
+        in_progress = true;
+        goto end;
+    }
+    /* data stage complete */
+    ctx->ep0_in.data = NULL;
+    ctx->ep0_in.size = 0;
+    ctx->ep0_in.offset = 0;
+end:
+    return in_progress;
+}
 
+/*
+ * About control pipe OUT data stage.
+ *
+ * The data stage of host-to-device requests is received by the libctrl in the
+ * target buffer, in as many packets as needed. The target handler is called once,
+ * with the complete payload, and the status stage is sent depending on its result.
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid_read(pkt);
+    @ assigns ctx->ep0_out, ctx->ctrl_phase ;
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_ep0_recv(usbctrl_context_t        *ctx,
+                              usbctrl_setup_pkt_t const *pkt,
+                              uint8_t                  *buf,
+                              uint16_t                  buf_size,
+                              usb_rqst_data_handler_t   handler)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (buf == NULL || handler == NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (pkt->wLength > buf_size) {
+        log_printf("[USBCTRL] data stage too long (%d bytes)\n", pkt->wLength);
+        errcode = MBED_ERROR_NOSTORAGE;
+        goto err;
+    }
+    ctx->ep0_out.pkt = *pkt;
+    ctx->ep0_out.buf = buf;
+    ctx->ep0_out.size = pkt->wLength;
+    ctx->ep0_out.offset = 0;
+    ctx->ep0_out.handler = handler;
+    errcode = usbctrl_drv_set_recv_fifo(ctx, buf, pkt->wLength, EP0);
+    if (errcode != MBED_ERROR_NONE) {
+        ctx->ep0_out.handler = NULL;
+        goto err;
     }
+    usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_DATA_OUT);
+    usbctrl_drv_ack(ctx, EP0, USB_BACKEND_DRV_EP_DIR_OUT);
 err:
     return errcode;
+}
+
+/*
+ * Control pipe data OUT event, while an OUT data stage is pending. Once the data
+ * stage is fully received, the target handler is called and the status stage is sent.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_handle_ctrl_data_stage(usbctrl_context_t *ctx,
+                                            uint32_t           size)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usb_rqst_data_handler_t data_handler = ctx->ep0_out.handler;
+    uint32_t handler;
+    uint16_t data_size;
+
+    if (data_handler == NULL) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    if (size > (uint32_t)(ctx->ep0_out.size - ctx->ep0_out.offset)) {
+        ctx->ep0_out.handler = NULL;
+        errcode = MBED_ERROR_INVPARAM;
+        goto err_stall;
+    }
+    ctx->ep0_out.offset += (uint16_t)size;
+    if (ctx->ep0_out.offset < ctx->ep0_out.size) {
+        /* data stage not finished, continue receiving just after the received data */
+        errcode = usbctrl_drv_set_recv_fifo(ctx, &(ctx->ep0_out.buf[ctx->ep0_out.offset]),
+                                                ctx->ep0_out.size - ctx->ep0_out.offset, EP0);
+        if (errcode != MBED_ERROR_NONE) {
+            ctx->ep0_out.handler = NULL;
+            goto err_stall;
+        }
+        usbctrl_drv_ack(ctx, EP0, USB_BACKEND_DRV_EP_DIR_OUT);
+        return errcode;
+    }
+    ctx->ep0_out.handler = NULL;
+    data_size = ctx->ep0_out.size;
+    if (usbctrl_get_handler(ctx, &handler) != MBED_ERROR_NONE) {
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err_stall;
+    }
+#ifndef __FRAMAC__
+    if (handler_sanity_check((physaddr_t)data_handler)) {
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err_stall;
+    }
+#endif
+    /*@ assert data_handler ∈ {&vendor_rqst_handler}; */
+    /*@ calls vendor_rqst_handler; */
+    if ((errcode = data_handler(handler, &(ctx->ep0_out.pkt), ctx->ep0_out.buf, &data_size)) != MBED_ERROR_NONE) {
+        goto err_stall;
+    }
+    usbctrl_ctrl_status(ctx);
+    goto err_finish;
+
+err_stall:
+    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
+err_finish:
+err:
+    /* set back EP0 FIFO to handle next setup packets */
+    usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, EP0);
+    return errcode;
+}
+
+/*
+ * Abort any pending control pipe data stage (new SETUP packet).
+ */
 
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->ep0_in, ctx->ep0_out ;
+*/
+void usbctrl_ep0_abort(usbctrl_context_t *ctx)
+{
+    ctx->ep0_in.data = NULL;
+    ctx->ep0_in.size = 0;
+    ctx->ep0_in.offset = 0;
+    ctx->ep0_in.zlp = false;
+    if (ctx->ep0_out.handler != NULL) {
+        ctx->ep0_out.handler = NULL;
+        /* set back EP0 FIFO to handle next setup packets */
+        usbctrl_drv_set_recv_fifo(ctx, &(ctx->ctrl_fifo[0]), CONFIG_USBCTRL_EP0_FIFO_SIZE, EP0);
+    }
 }
 
 /*
@@ -399,7 +845,6 @@ err:
                 (ctx->state == USB_DEVICE_STATE_ADDRESS) ||
                 (ctx->state == USB_DEVICE_STATE_CONFIGURED)) ;
     @   ensures \result == MBED_ERROR_NONE   ;
-    @   ensures ctx->ctrl_req_processing == \false;
 
     @ complete behaviors ;
     @ disjoint behaviors ;
@@ -427,8 +872,6 @@ mbed_error_t usbctrl_std_req_handle_clear_feature(usbctrl_setup_pkt_t const * co
     }
     /* handling standard Request */
 
-    /*request finish here */
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
 err:
     return errcode;
 }
@@ -465,7 +908,6 @@ err:
     @   assumes pkt->wLength == 2;
     @   assumes ctx->state == USB_DEVICE_STATE_DEFAULT ;
     @   ensures \result == MBED_ERROR_NONE ; // not forbidden, but undefined by USB 2.0
-    @   ensures ctx->ctrl_req_processing == \false;
 
     // address state use cases
     // --> initial checks (global to address state)
@@ -475,7 +917,6 @@ err:
     @   assumes ctx->state == USB_DEVICE_STATE_ADDRESS ;
     @   assumes ((((pkt->bmRequestType) & 0x1F) != USB_REQ_RECIPIENT_ENDPOINT && ((pkt->bmRequestType) & 0x1F) != USB_REQ_RECIPIENT_DEVICE) || ((pkt->wIndex & 0xf) != 0)) ;
     @   ensures \result == MBED_ERROR_INVSTATE   ;
-    @   ensures ctx->ctrl_req_processing == \false;
 
     // --> endpoint: invalid endpoint, only EP0 allowed
     @ behavior USB_DEVICE_STATE_ADDRESS_recipient_USB_REQ_RECIPIENT_ENDPOINT_endpoint_false:
@@ -486,7 +927,6 @@ err:
     @   assumes (((pkt->bmRequestType) & 0x1F) == USB_REQ_RECIPIENT_ENDPOINT) ;
     @   assumes ((pkt->wIndex & 0xf) != EP0) ;
     @   ensures \result == MBED_ERROR_INVPARAM   ;
-    @   ensures ctx->ctrl_req_processing == \false;
 
     // --> endpoint: EP0 requested. For both valid and invalid direction (NAK or ACK)
     @ behavior USB_DEVICE_STATE_ADDRESS_recipient_USB_REQ_RECIPIENT_ENDPOINT_endpoint_true:
@@ -529,7 +969,6 @@ err:
     @   assumes !(\exists integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num && 0 <= j < ctx->cfg[ctx->curr_cfg].interfaces[i].usb_ep_number &&
                 ctx->cfg[ctx->curr_cfg].interfaces[i].eps[j].ep_num == (pkt->wIndex & 0xf)) ;
     @   ensures \result == MBED_ERROR_INVPARAM   ;
-    @   ensures ctx->ctrl_req_processing == \false;
 
     // --> endpoint: target EP is not EP0 and it exists
     @ behavior USB_DEVICE_STATE_CONFIGURED_recipient_USB_REQ_RECIPIENT_ENDPOINT_endpoint_true:
@@ -560,7 +999,6 @@ err:
     @   assumes !(\exists integer i,j ; 0 <= i < ctx->cfg[ctx->curr_cfg].interface_num &&
                 ctx->cfg[ctx->curr_cfg].interfaces[i].id == (pkt->wIndex & 0xf)) ;
     @   ensures \result == MBED_ERROR_INVPARAM   ;
-    @   ensures ctx->ctrl_req_processing == \false;
 
     // --> interface: iface found
     @ behavior USB_DEVICE_STATE_CONFIGURED_recipient_USB_REQ_RECIPIENT_INTERFACE_true:
@@ -619,13 +1057,13 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
      */
     if (pkt->wValue != 0) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
 
     if (pkt->wLength != 2) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
 #endif
@@ -639,9 +1077,7 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
         case USB_DEVICE_STATE_DEFAULT:
             /* This case is not forbidden by USB2.0 standard, but the behavior is
              * undefined. We can, for example, stall out. */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-            /*request finish here */
-            set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_ADDRESS:
            if (usbctrl_std_req_get_recipient(pkt) != USB_REQ_RECIPIENT_ENDPOINT &&
@@ -650,18 +1086,14 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
                 /* only interface or endpoint 0 allowed in ADDRESS state */
                 /* request error: sending STALL on status or data */
                 errcode = MBED_ERROR_INVSTATE;
-                usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+                usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                 goto err;
             }
             if ((pkt->wIndex & 0xf) != 0) {
                 /* only device or endpoint 0 allowed in ADDRESS state */
                 /* request error: sending STALL on status or data */
                 errcode = MBED_ERROR_INVSTATE;
-                usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+                usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                 goto err;
             }
             /* handling get_status() for other cases */
@@ -671,29 +1103,24 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
                     uint8_t epnum = pkt->wIndex & 0xf;
                     if (epnum != EP0) {
                         errcode = MBED_ERROR_INVSTATE;
-                        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-                        /*request finish here */
-                        set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+                        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                         goto err;
                     }
                     /* return the recipient (EP0) status (2 bytes, or wLength if smaller) */
-                    uint8_t resp[2] = { 0 };
+                    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 2);
 
-                    usb_backend_drv_send_data((uint8_t *)&resp, (pkt->wLength >=  2 ? 2 : pkt->wLength), EP0);
-                    usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
-                    /* std req finishes at the oepint rise */
+                    usbctrl_ep0_send(ctx, resp, 2, pkt->wLength);
+                    usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
                     break;
                 }
                 case USB_REQ_RECIPIENT_DEVICE: {
 
                     if (pkt->wIndex != 0) {
                         /* says as not specified. We stall. Yet this is not forbidden (errcode=NONE. */
-                        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-                        /*request finish here */
-                        set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+                        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                     }
                     /* return the recipient status (2 bytes, or wLength if smaller) */
-                    uint8_t resp[2] = { 0 };
+                    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 2);
 #if CONFIG_USR_LIB_USBCTRL_DEV_SELFPOWERED
                     /* INFO: self-power mode does not support dynamicity and can't be cleared by host through
                      * SetFeature() or ClearFeature() (allowed by USB standard, see chap. 9.4.5) */
@@ -701,14 +1128,13 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
 #endif
                     /* FIXME: add remoteWakeup field setting to resp */
 
-                    usb_backend_drv_send_data((uint8_t *)&resp, (pkt->wLength >=  2 ? 2 : pkt->wLength), EP0);
-                    usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
-                    /* std req finishes at the oepint rise */
+                    usbctrl_ep0_send(ctx, resp, 2, pkt->wLength);
+                    usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
                     break;
                 }
                 default:
                     errcode = MBED_ERROR_INVSTATE;
-                    usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+                    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                     goto err;
             }
             break;
@@ -722,37 +1148,31 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
                     /* EP0 does exists, It's me... */
                     if (epnum != EP0 && !usbctrl_is_endpoint_exists(ctx, epnum)) {
                         errcode = MBED_ERROR_INVPARAM;
-                        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-                        /*request finish here */
-                        set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+                        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                         goto err;
                     }
                     /* return the recipient status (2 bytes, or wLength if smaller) */
-                    uint8_t resp[2] = { 0 };
+                    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 2);
                     /* setting the halt bit */
                     if (usbctrl_is_endpoint_halted(ctx, epnum)) {
                         /* EP halted */
                         resp[0] |= 1;
                     }
-                    usb_backend_drv_send_data((uint8_t *)&resp, (pkt->wLength >=  2 ? 2 : pkt->wLength), EP0);
-                    usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
-                    /* std req finishes at the oepint rise */
+                    usbctrl_ep0_send(ctx, resp, 2, pkt->wLength);
+                    usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
                     break;
                 }
                 case USB_REQ_RECIPIENT_DEVICE: {
                     if (pkt->wIndex != 0) {
                         /* says as not specified. We stall. Yet this is not forbidden (errcode=NONE. */
-                        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-                        /*request finish here */
-                        set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+                        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                     }
                     /* return the recipient status (2 bytes, or wLength if smaller) */
-                    uint8_t resp[2] = { 0 };
+                    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 2);
                     /* FIXME: add remoteWakeup and selfPowered field setting to resp */
 
-                    usb_backend_drv_send_data((uint8_t *)&resp, (pkt->wLength >=  2 ? 2 : pkt->wLength), EP0);
-                    usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
-                    /* std req finishes at the oepint rise */
+                    usbctrl_ep0_send(ctx, resp, 2, pkt->wLength);
+                    usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
                     break;
                 }
                 case USB_REQ_RECIPIENT_INTERFACE: {
@@ -761,23 +1181,20 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
                     uint8_t ifaceid = pkt->wIndex & 0xf;
                     if (!usbctrl_is_interface_exists(ctx, ifaceid)) {
                         errcode = MBED_ERROR_INVPARAM;
-                        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
-                        /*request finish here */
-                        set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+                        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                         goto err;
                     }
                     /* return the recipient status (2 bytes, all reserved) */
-                    uint8_t resp[2] = { 0 };
+                    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 2);
 
-                    usb_backend_drv_send_data((uint8_t *)&resp, (pkt->wLength >=  2 ? 2 : pkt->wLength), EP0);
-                    usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
-                    /* std req finishes at the oepint rise */
+                    usbctrl_ep0_send(ctx, resp, 2, pkt->wLength);
+                    usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
                     break;
                 }
 
                 default:
                     errcode = MBED_ERROR_INVPARAM;
-                    usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+                    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
                     goto err;
             }
 
@@ -787,8 +1204,7 @@ mbed_error_t usbctrl_std_req_handle_get_status(const usbctrl_setup_pkt_t *pkt,
             /* this should never be reached with the is_std_requests_allowed() function */
             /*request finish here */
             errcode = MBED_ERROR_INVPARAM;
-            set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
     }
 err:
@@ -799,7 +1215,6 @@ err:
     @ requires \valid(ctx) ;
     @ requires \separated(ctx+ (..),pkt,&GHOST_opaque_drv_privates);
     @ assigns *ctx, GHOST_opaque_drv_privates ;
-    @ ensures ctx->ctrl_req_processing == \false ;
 
     @ behavior std_requests_not_allowed:
     @   assumes !((ctx->state == USB_DEVICE_STATE_DEFAULT) ||
@@ -872,15 +1287,11 @@ static
 mbed_error_t usbctrl_std_req_handle_get_interface(usbctrl_setup_pkt_t const * const pkt,
                                                          usbctrl_context_t *ctx)
 {
-    /* GET_INTERFACE request is used to request an alternate setting when using
-     * interfaces in a same configuration that use mutually exclusive settings.
-     * This is not yet implemented. By now, we stall.
-     * TODO: we should allows interfaces registration with altSettings information.
-     * In this very request, we should transmit the Get_interface to the corresponding
-     * interface target with the requested altSettings value and wait for its EP reconfiguration
-     * and results.
+    /* GET_INTERFACE request is used to get back the current alternate setting of
+     * an interface, selected by the host with SET_INTERFACE (0 by default).
      */
     mbed_error_t errcode = MBED_ERROR_NONE;
+    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 1);
     log_printf("[USBCTRL] Std req: get iface\n");
     if (!is_std_requests_allowed(ctx)) {
         /* error handling, invalid state */
@@ -893,39 +1304,40 @@ mbed_error_t usbctrl_std_req_handle_get_interface(usbctrl_setup_pkt_t const * co
 
     if (pkt->wValue != 0) {
         /* this field must be set to 0 */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
     }
     if (length != 1) {
         /* data length *must* be 1. When valid, the device returns the alternate
          * setting */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
     if (usbctrl_is_interface_exists(ctx, iface_id) == false) {
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
     /* let's respond to the request */
     switch (usbctrl_get_state(ctx)) {
         case USB_DEVICE_STATE_DEFAULT:
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_ADDRESS:
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_CONFIGURED:
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            resp[0] = ctx->cfg[ctx->curr_cfg].interfaces[iface_id].alt_setting;
+            usbctrl_ep0_send(ctx, resp, 1, length);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         default:
             /* this should never be reached with the is_std_requests_allowed() function */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
     }
 err:
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
     return errcode;
 }
 
@@ -956,7 +1368,6 @@ err:
                  (ctx->state == USB_DEVICE_STATE_ADDRESS) ||
                  (ctx->state == USB_DEVICE_STATE_CONFIGURED)) ;
     @   ensures ctx->address == \old(ctx->address);
-    @   ensures ctx->ctrl_req_processing == false ;
     @   ensures \result == MBED_ERROR_INVSTATE ;
 
     @ behavior invalid_addr:
@@ -976,7 +1387,6 @@ err:
     @   assumes (pkt->wValue & 0xff) <= 127;
     @   assumes (ctx->state == USB_DEVICE_STATE_DEFAULT) ;
     @   assumes ((pkt->wValue & 0xff) != 0) ;
-    @   ensures ctx->ctrl_req_processing == false ;
     @   ensures \result == MBED_ERROR_NONE ;
     @   ensures ctx->state == USB_DEVICE_STATE_ADDRESS ;
 
@@ -986,7 +1396,6 @@ err:
     @   assumes (pkt->wValue & 0xff) <= 127;
     @   assumes (ctx->state == USB_DEVICE_STATE_DEFAULT) ;
     @   assumes !((pkt->wValue & 0xff) != 0) ;
-    @   ensures ctx->ctrl_req_processing == false ;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior USB_DEVICE_STATE_ADDRESS_pktValue_not_null:
@@ -995,7 +1404,6 @@ err:
     @   assumes (pkt->wValue & 0xff) <= 127;
     @   assumes (ctx->state == USB_DEVICE_STATE_ADDRESS) ;
     @   assumes ((pkt->wValue & 0xff) != 0) ;
-    @   ensures ctx->ctrl_req_processing == false ;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior USB_DEVICE_STATE_ADDRESS_pktValue_null:
@@ -1004,7 +1412,6 @@ err:
     @   assumes (pkt->wValue & 0xff) <= 127;
     @   assumes (ctx->state == USB_DEVICE_STATE_ADDRESS) ;
     @   assumes !((pkt->wValue & 0xff) != 0) ;
-    @   ensures ctx->ctrl_req_processing == false ;
     @   ensures \result == MBED_ERROR_NONE && ctx->state ==  USB_DEVICE_STATE_DEFAULT ;
 
     @ behavior USB_DEVICE_STATE_CONFIGURED:
@@ -1013,7 +1420,6 @@ err:
     @   assumes (pkt->wValue & 0xff) <= 127;
     @   assumes (ctx->state == USB_DEVICE_STATE_CONFIGURED) ;
     @   ensures ctx->address == \old(ctx->address);
-    @   ensures ctx->ctrl_req_processing == false ;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ complete behaviors ;
@@ -1035,18 +1441,18 @@ mbed_error_t usbctrl_std_req_handle_set_address(usbctrl_setup_pkt_t const * cons
     /* USB 2.0 conformity: chap. 9.4.6 */
     if (pkt->wIndex != 0) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
     if (pkt->wLength != 0) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
     if (!is_std_requests_allowed(ctx)) {
         /* error handling, invalid state */
         errcode = MBED_ERROR_INVSTATE;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
 #endif
@@ -1060,7 +1466,7 @@ mbed_error_t usbctrl_std_req_handle_set_address(usbctrl_setup_pkt_t const * cons
     if (address > 127) {
         /* set as unspecified in USB 2.0 standard. Thus it is not says that
          * this is "forbidden". Only that the behavior is not specified. We stall. */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
     switch (usbctrl_get_state(ctx)) {
@@ -1070,46 +1476,42 @@ mbed_error_t usbctrl_std_req_handle_set_address(usbctrl_setup_pkt_t const * cons
                 usbctrl_set_state(ctx, newstate);
                 /*@ assert ctx->state == USB_DEVICE_STATE_ADDRESS ; */
                 ctx->address = address;
-                usb_backend_drv_set_address(ctx->address);
+                usbctrl_drv_set_address(ctx, ctx->address);
             }
             /* wValue set to 0 is *not* an error condition */
-            usb_backend_drv_send_zlp(0);
 
             break;
         case USB_DEVICE_STATE_ADDRESS:
             if (address != 0) {
                 /* simple update of address */
                 ctx->address = address;
-                usb_backend_drv_set_address(ctx->address);
+                usbctrl_drv_set_address(ctx, ctx->address);
             } else {
                 /* going back to default state */
                 newstate = USB_DEVICE_STATE_DEFAULT;
                 usbctrl_set_state(ctx, newstate);
                 /*@ assert ctx->state == USB_DEVICE_STATE_DEFAULT ; */
             }
-            usb_backend_drv_send_zlp(0);
             break;
         case USB_DEVICE_STATE_CONFIGURED:
             /* This case is not forbidden by USB2.0 standard, but the behavior is
              * undefined. We can, for example, stall out. */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         default:
             /* this should never be reached with the is_std_requests_allowed() function */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
     }
 
 err:
-    /*request finish here */
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
     return errcode;
 }
 
 /*@
     @ requires \valid(ctx) ;
     @ requires \separated(ctx, pkt, &GHOST_opaque_drv_privates, GHOST_in_eps+(0 .. USB_BACKEND_DRV_MAX_IN_EP-1));
-    @ assigns ctx->ctrl_req_processing, GHOST_opaque_drv_privates, GHOST_in_eps[0 .. USB_BACKEND_DRV_MAX_IN_EP-1].state;
+    @ assigns ctx->ctrl_phase, GHOST_opaque_drv_privates, GHOST_in_eps[0 .. USB_BACKEND_DRV_MAX_IN_EP-1].state;
 
     @ behavior invalid_pkt_fields:
     @   assumes (pkt->wValue != 0 || pkt->wIndex != 0 || pkt->wLength != 1);
@@ -1150,24 +1552,24 @@ mbed_error_t usbctrl_std_req_handle_get_configuration(usbctrl_setup_pkt_t const
                                                              usbctrl_context_t *ctx)
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
-    uint8_t resp[1];
+    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 1);
     log_printf("[USBCTRL] Std req: get configuration\n");
 
 #ifdef CONFIG_USR_LIB_USBCTRL_STRICT_USB_CONFORMITY
     /* USB 2.0 conformity: chap. 9.4.2 */
     if (pkt->wValue != 0) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
     if (pkt->wIndex != 0) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
     if (pkt->wLength != 1) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
 #endif
@@ -1175,7 +1577,7 @@ mbed_error_t usbctrl_std_req_handle_get_configuration(usbctrl_setup_pkt_t const
     if (!is_std_requests_allowed(ctx)) {
         /* error handling, invalid state */
         errcode = MBED_ERROR_INVSTATE;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         goto err;
     }
     switch (usbctrl_get_state(ctx)) {
@@ -1183,33 +1585,28 @@ mbed_error_t usbctrl_std_req_handle_get_configuration(usbctrl_setup_pkt_t const
 
             /* USB 2.0 says: behavior not specified. Here we just return 0 as bConfigurationValue */
             resp[0] = 0;
-            usb_backend_drv_send_data((uint8_t *)&resp, 1, EP0);
-            /* usb driver read status... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_ep0_send(ctx, resp, 1, pkt->wLength);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         case USB_DEVICE_STATE_ADDRESS:
             /* USB 2.0 says: return 0 as bConfigurationValue */
             resp[0] = 0;
-            usb_backend_drv_send_data((uint8_t *)&resp, 1, EP0);
-            /* usb driver read status... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_ep0_send(ctx, resp, 1, pkt->wLength);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         case USB_DEVICE_STATE_CONFIGURED:
             /* USB 2.0 says: non-zero bConfigurationValue of the current config. curr_cfg starts with 0 (table index) */
             resp[0] = ctx->curr_cfg + 1;
-            usb_backend_drv_send_data((uint8_t *)&resp, 1, EP0);
-            /* usb driver read status... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_ep0_send(ctx, resp, 1, pkt->wLength);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         default:
             /* this should never be reached with the is_std_requests_allowed() function. Defensive programing */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
     }
 
 err:
-    /*request finish here */
-    ctx->ctrl_req_processing = false;
     return errcode;
 }
 
@@ -1217,7 +1614,6 @@ err:
     @ requires  \valid(ctx);
     @ requires  \valid_read(pkt);
     @ requires \separated(ctx,pkt,&GHOST_opaque_drv_privates,GHOST_in_eps+(0 .. USB_BACKEND_DRV_MAX_IN_EP-1),GHOST_out_eps+(0 .. USB_BACKEND_DRV_MAX_OUT_EP-1));
-    @ ensures ctx->ctrl_req_processing == \false;
     @ assigns conf_set, *ctx, GHOST_opaque_drv_privates ;
     @ assigns GHOST_in_eps[0 .. USB_BACKEND_DRV_MAX_IN_EP-1].state, GHOST_out_eps[0 .. USB_BACKEND_DRV_MAX_OUT_EP-1].state;
 
@@ -1345,7 +1741,6 @@ mbed_error_t usbctrl_std_req_handle_set_configuration(usbctrl_setup_pkt_t const
         case USB_DEVICE_STATE_ADDRESS:
             if (requested_configuration == 0) {
                 /* just remains in address state */
-                usb_backend_drv_send_zlp(0);
                 goto end;
             }
             if (requested_configuration > ctx->num_cfg) {
@@ -1365,7 +1760,6 @@ mbed_error_t usbctrl_std_req_handle_set_configuration(usbctrl_setup_pkt_t const
                 /*@ assert errcode == MBED_ERROR_NONE; */
                 usbctrl_set_state(ctx, USB_DEVICE_STATE_CONFIGURED);
                 usbctrl_configuration_set();
-                usb_backend_drv_send_zlp(0);
                 /*@ assert ctx->state == USB_DEVICE_STATE_CONFIGURED; */
                 goto end;
             }
@@ -1383,8 +1777,7 @@ mbed_error_t usbctrl_std_req_handle_set_configuration(usbctrl_setup_pkt_t const
                 }
                 /*@ assert errcode == MBED_ERROR_NONE; */
                 usbctrl_set_state(ctx, USB_DEVICE_STATE_ADDRESS);
-                usb_backend_drv_set_address(0);
-                usb_backend_drv_send_zlp(0);
+                usbctrl_drv_set_address(ctx, 0);
                 /*@ assert ctx->state == USB_DEVICE_STATE_ADDRESS; */
                 goto end;
             }
@@ -1404,7 +1797,6 @@ mbed_error_t usbctrl_std_req_handle_set_configuration(usbctrl_setup_pkt_t const
                 }
                 /*@ assert errcode == MBED_ERROR_NONE; */
                 usbctrl_configuration_set();
-                usb_backend_drv_send_zlp(0);
                 goto end;
             }
             break;
@@ -1416,15 +1808,11 @@ mbed_error_t usbctrl_std_req_handle_set_configuration(usbctrl_setup_pkt_t const
     }
 end:
 
-    /*request finish here */
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
     /*@ assert errcode == MBED_ERROR_NONE ; */
     return errcode;
 
 err:
-    usb_backend_drv_stall(0, USB_BACKEND_DRV_EP_DIR_OUT);
-    /*request finish here */
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_OUT);
     return errcode;
 }
 
@@ -1455,7 +1843,6 @@ err:
                 (ctx->state == USB_DEVICE_STATE_ADDRESS) ||
                 (ctx->state == USB_DEVICE_STATE_CONFIGURED)) ;
     @   assumes pkt->wLength == 0 ;
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_DEVICE_index_not_null:
@@ -1465,7 +1852,6 @@ err:
     @   assumes !(pkt->wLength == 0) ;
     @   assumes (pkt->wValue >> 8) == USB_REQ_DESCRIPTOR_DEVICE ;
     @   assumes (pkt->wIndex != 0);
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_DEVICE_index_null:
@@ -1484,7 +1870,6 @@ err:
     @   assumes !(pkt->wLength == 0) ;
     @   assumes (pkt->wValue >> 8) == USB_REQ_DESCRIPTOR_CONFIGURATION ;
     @   assumes (pkt->wIndex != 0);
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_CONFIGURATION_index_null:
@@ -1511,7 +1896,6 @@ err:
     @   assumes !(pkt->wLength == 0) ;
     @   assumes (pkt->wValue >> 8) == USB_REQ_DESCRIPTOR_INTERFACE ;
     @   assumes (pkt->wIndex != 0);
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_INTERFACE_index_null:
@@ -1530,7 +1914,6 @@ err:
     @   assumes !(pkt->wLength == 0) ;
     @   assumes (pkt->wValue >> 8) == USB_REQ_DESCRIPTOR_ENDPOINT ;
     @   assumes (pkt->wIndex != 0);
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_ENDPOINT_index_null:
@@ -1549,7 +1932,6 @@ err:
     @   assumes !(pkt->wLength == 0) ;
     @   assumes (pkt->wValue >> 8) == USB_REQ_DESCRIPTOR_DEVICE_QUALIFIER ;
     @   assumes (pkt->wIndex != 0);
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_DEVICE_QUALIFIER_index_null:
@@ -1568,7 +1950,6 @@ err:
     @   assumes !(pkt->wLength == 0) ;
     @   assumes (pkt->wValue >> 8) == USB_REQ_DESCRIPTOR_OTHER_SPEED_CFG ;
     @   assumes (pkt->wIndex != 0);
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_OTHER_SPEED_CFG_index_null:
@@ -1587,7 +1968,6 @@ err:
     @   assumes !(pkt->wLength == 0) ;
     @   assumes (pkt->wValue >> 8) == USB_REQ_DESCRIPTOR_INTERFACE_POWER ;
     @   assumes (pkt->wIndex != 0);
-    @   ensures ctx->ctrl_req_processing == \false;
     @   ensures \result == MBED_ERROR_NONE ;
 
     @ behavior DESCTYPE_USB_REQ_DESCRIPTOR_INTERFACE_POWER_index_null:
@@ -1636,69 +2016,64 @@ mbed_error_t usbctrl_std_req_handle_get_descriptor(usbctrl_setup_pkt_t *pkt,
     maxlength = pkt->wLength;
     if (maxlength == 0) {
         /* nothing to send */
-        /*request finish here */
-        set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
         goto err;
     }
 
-    uint8_t buf[MAX_DESCRIPTOR_LEN] = { 0 };
+    /* descriptors are forged in the context data stage buffer, as they may be sent
+     * in several packets, after the request handling */
+    uint8_t *buf = &(ctx->ctrl_data_buf[0]);
+    uint8_t const *desc = NULL;
     uint32_t size = 0;
 
     switch (desctype) {
         case USB_REQ_DESCRIPTOR_DEVICE:
             log_printf("[USBCTRL] Std req: get device descriptor\n");
             if (pkt->wIndex != 0) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                 goto err;
             }
-
+            /* first request after the speed negotiation (the speed may not be known
+             * yet at reset time) */
+            usbctrl_update_speed(ctx);
+
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+            desc = usbctrl_static_dev_desc.desc;
+            size = usbctrl_static_dev_desc.size;
+#else
             if ((errcode = usbctrl_get_descriptor(USB_DESC_DEVICE, &(buf[0]), &size, ctx, pkt)) != MBED_ERROR_NONE) {
                     log_printf("[USBCTRL] Failure while generating descriptor !!!\n");
-                    /*request finish here */
-                    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                     goto err;
             }
+            desc = &(buf[0]);
+#endif
             log_printf("[USBCTRL] sending dev desc (%d bytes req, %d bytes needed)\n", maxlength, size);
 
-            if (maxlength >= size) {
-                errcode = usb_backend_drv_send_data(&(buf[0]), size, 0);
-            } else {
-                errcode = usb_backend_drv_send_data(&(buf[0]), maxlength, 0);
-                if (errcode != MBED_ERROR_NONE) {
-                    log_printf("[USBCTRL] Error while sending data\n");
-                }
-                /* should we not inform the host that there is not enough
-                * space ? TODO: we should: sending NYET or NAK
-                * XXX: check USB2.0 standard */
+            errcode = usbctrl_ep0_send(ctx, desc, size, maxlength);
+            if (errcode != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Error while sending data\n");
             }
             /* read status .... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         case USB_REQ_DESCRIPTOR_CONFIGURATION:
             log_printf("[USBCTRL] Std req: get configuration descriptor\n");
             /* wIndex (language ID) should be zero */
             if (pkt->wIndex != 0) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                 goto err;
             }
-            if ((errcode = usbctrl_get_descriptor(USB_DESC_CONFIGURATION, &(buf[0]), &size, ctx, pkt)) != MBED_ERROR_NONE) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+            /* the configuration descriptor is sent directly from the configuration
+             * cache, forged at first request (or at device start) only */
+            if ((errcode = usbctrl_get_configuration_desc(ctx, (pkt->wValue & 0xff), &desc, &size)) != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Failure while generating descriptor !!!\n");
                 goto err;
             }
-            if (maxlength > size) {
-                errcode = usb_backend_drv_send_data(&(buf[0]), size, 0);
-            } else {
-                errcode = usb_backend_drv_send_data(&(buf[0]), maxlength, 0);
-                /* should we not inform the host that there is not enough
-                 * space ? Well no, the host, send again a new descriptor
-                 * request with the correct size in it.
-                 * XXX: check USB2.0 standard */
+            /* setting current_cfg to requested cfg in get_descriptor */
+            ctx->curr_cfg = (pkt->wValue & 0xff);
+            errcode = usbctrl_ep0_send(ctx, desc, size, maxlength);
+            if (errcode != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Error while sending data\n");
             }
             /* read status .... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
 
             /* it is assumed by the USB standard that the returned configuration is now active.
              * From now on, the device is in CONFIGUED state, and the returned configuration is
@@ -1706,108 +2081,99 @@ mbed_error_t usbctrl_std_req_handle_get_descriptor(usbctrl_setup_pkt_t *pkt,
             break;
         case USB_REQ_DESCRIPTOR_STRING:
             log_printf("[USBCTRL] Std req: get string descriptor\n");
-            if ((errcode = usbctrl_get_descriptor(USB_DESC_STRING, &(buf[0]), &size, ctx, pkt)) != MBED_ERROR_NONE) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+            /* string descriptors are pre-encoded, they are sent directly from the strings table */
+            if ((errcode = usbctrl_get_string_desc(ctx, (pkt->wValue & 0xff), &desc, &size)) != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Unsupported string index requested.\n");
                 goto err;
             }
-                if (maxlength > size) {
-                    errcode = usb_backend_drv_send_data(&(buf[0]), size, 0);
-                } else {
-                    errcode = usb_backend_drv_send_data(&(buf[0]), maxlength, 0);
-                    /* should we not inform the host that there is not enough
-                     * space ?
-                     * XXX: check USB2.0 standard */
+                errcode = usbctrl_ep0_send(ctx, desc, size, maxlength);
+                if (errcode != MBED_ERROR_NONE) {
+                    log_printf("[USBCTRL] Error while sending data\n");
                 }
             /* read status .... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         case USB_REQ_DESCRIPTOR_INTERFACE:
             /* wIndex (language ID) should be zero */
             log_printf("[USBCTRL] Std req: get interface descriptor\n");
             if (pkt->wIndex != 0) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                 goto err;
             }
                 if ((errcode = usbctrl_get_descriptor(USB_DESC_INTERFACE, &(buf[0]), &size, ctx, pkt)) != MBED_ERROR_NONE) {
-                    /*request finish here */
-                    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                     goto err;
                 }
-                if (maxlength > size) {
-                    errcode = usb_backend_drv_send_data(&(buf[0]), size, 0);
-                } else {
-                    errcode = usb_backend_drv_send_data(&(buf[0]), maxlength, 0);
-                    /* should we not inform the host that there is not enough
-                     * space ?
-                     * XXX: check USB2.0 standard */
+                errcode = usbctrl_ep0_send(ctx, &(buf[0]), size, maxlength);
+                if (errcode != MBED_ERROR_NONE) {
+                    log_printf("[USBCTRL] Error while sending data\n");
                 }
             /* read status .... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         case USB_REQ_DESCRIPTOR_ENDPOINT:
             log_printf("[USBCTRL] Std req: get EP descriptor\n");
             /* wIndex (language ID) should be zero */
             if (pkt->wIndex != 0) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                 goto err;
             }
             if ((errcode = usbctrl_get_descriptor(USB_DESC_ENDPOINT, &(buf[0]), &size, ctx, pkt)) != MBED_ERROR_NONE) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                 goto err;
             }
-            if (maxlength > size) {
-                errcode = usb_backend_drv_send_data(&(buf[0]), size, 0);
-            } else {
-                errcode = usb_backend_drv_send_data(&(buf[0]), maxlength, 0);
-                /* should we not inform the host that there is not enough
-                 * space ?
-                 * XXX: check USB2.0 standard */
+            errcode = usbctrl_ep0_send(ctx, &(buf[0]), size, maxlength);
+            if (errcode != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Error while sending data\n");
             }
             /* read status .... */
-            usb_backend_drv_ack(0, USB_BACKEND_DRV_EP_DIR_OUT);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         case USB_REQ_DESCRIPTOR_DEVICE_QUALIFIER:
             log_printf("[USBCTRL] Std req: get dev qualifier descriptor\n");
             /* wIndex (language ID) should be zero */
             if (pkt->wIndex != 0) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                 goto err;
             }
-            /*TODO */
-            /*request finish here */
-            set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            /* stalled by full-speed only devices */
+            if ((errcode = usbctrl_get_descriptor(USB_DESC_DEV_QUALIFIER, &(buf[0]), &size, ctx, pkt)) != MBED_ERROR_NONE) {
+                goto err;
+            }
+            errcode = usbctrl_ep0_send(ctx, &(buf[0]), size, maxlength);
+            if (errcode != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Error while sending data\n");
+            }
+            /* read status .... */
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         case USB_REQ_DESCRIPTOR_OTHER_SPEED_CFG:
             log_printf("[USBCTRL] Std req: get othspeed descriptor\n");
             /* wIndex (language ID) should be zero */
             if (pkt->wIndex != 0) {
-                /*request finish here */
-                ctx->ctrl_req_processing = false;
                 goto err;
             }
-            /*TODO */
-            /*request finish here */
-            set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+#ifdef CONFIG_USR_LIB_USBCTRL_HIGHSPEED_CAPABLE
+            /* the other speed configuration descriptor is forged in the context buffer,
+             * and may be sent in multiple packets. The current configuration is not changed */
+            if ((errcode = usbctrl_get_other_speed_configuration_desc(ctx, (pkt->wValue & 0xff), &desc, &size)) != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Failure while generating descriptor !!!\n");
+                goto err;
+            }
+            errcode = usbctrl_ep0_send(ctx, desc, size, maxlength);
+            if (errcode != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] Error while sending data\n");
+            }
+            /* read status .... */
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
+#else
+            /* full-speed only device */
+            goto err;
+#endif
             break;
         case USB_REQ_DESCRIPTOR_INTERFACE_POWER:
             log_printf("[USBCTRL] Std req: get iface power descriptor\n");
             /* wIndex (language ID) should be zero */
             if (pkt->wIndex != 0) {
-                /*request finish here */
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
                 goto err;
             }
             /*TODO */
-            /*request finish here */
-            set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         default:
             goto err;
@@ -1816,7 +2182,7 @@ mbed_error_t usbctrl_std_req_handle_get_descriptor(usbctrl_setup_pkt_t *pkt,
 
     return errcode;
 err:
-    usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
     return errcode;
 }
 
@@ -1842,13 +2208,13 @@ err:
     @   assumes !((ctx->state == USB_DEVICE_STATE_DEFAULT) ||
                 (ctx->state == USB_DEVICE_STATE_ADDRESS) ||
                 (ctx->state == USB_DEVICE_STATE_CONFIGURED)) ;
-    @   ensures \result == MBED_ERROR_INVSTATE && ctx->ctrl_req_processing == \false ;
+    @   ensures \result == MBED_ERROR_INVSTATE ;
 
     @ behavior std_requests_allowed:
     @   assumes ((ctx->state == USB_DEVICE_STATE_DEFAULT) ||
                 (ctx->state == USB_DEVICE_STATE_ADDRESS) ||
                 (ctx->state == USB_DEVICE_STATE_CONFIGURED)) ;
-    @   ensures \result == MBED_ERROR_NONE &&  ctx->ctrl_req_processing == \false ;
+    @   ensures \result == MBED_ERROR_NONE ;
 
     @ complete behaviors ;
     @ disjoint behaviors ;
@@ -1879,8 +2245,6 @@ mbed_error_t usbctrl_std_req_handle_set_descriptor(usbctrl_setup_pkt_t * const p
     if (!is_std_requests_allowed(ctx)) {
         /* error handling, invalid state */
         errcode = MBED_ERROR_INVSTATE;
-        /*request finish here */
-        set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
         goto err;
     }
     /* handling standard Request */
@@ -1889,9 +2253,6 @@ mbed_error_t usbctrl_std_req_handle_set_descriptor(usbctrl_setup_pkt_t * const p
      * behavior is not supported by the device.
      */
 
-    usb_backend_drv_send_zlp(0);
-    /*request finish here */
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
 err:
     return errcode;
 }
@@ -1900,7 +2261,6 @@ err:
     @ requires \valid_read(pkt) && \valid(ctx);
     @ requires \separated(ctx+(..),pkt,&GHOST_opaque_drv_privates);
     @ assigns *ctx , GHOST_opaque_drv_privates;
-    @ ensures ctx->ctrl_req_processing == \false;
 
     @ behavior std_requests_not_allowed:
     @   assumes !((ctx->state == USB_DEVICE_STATE_DEFAULT) ||
@@ -1972,28 +2332,27 @@ mbed_error_t usbctrl_std_req_handle_set_feature(usbctrl_setup_pkt_t * const pkt,
 
     if (length != 0) {
         /* data length *must* be 0. There is no DATA stage after this SETUP stage */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
     /* let's respond to the request */
     switch (usbctrl_get_state(ctx)) {
         case USB_DEVICE_STATE_DEFAULT:
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_ADDRESS:
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_CONFIGURED:
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         default:
             /* this should never be reached with the is_std_requests_allowed() function */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
     }
 err:
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
     return errcode;
 }
 
@@ -2001,7 +2360,6 @@ err:
     @ requires \valid(ctx) && \valid(pkt) ;
     @ requires \separated(ctx+(..),pkt,&GHOST_opaque_drv_privates);
     @ assigns *ctx , GHOST_opaque_drv_privates;
-    @ ensures ctx->ctrl_req_processing == \false ;
 
     @ behavior std_requests_not_allowed:
     @   assumes !((ctx->state == USB_DEVICE_STATE_DEFAULT) ||
@@ -2049,7 +2407,7 @@ err:
     @   assumes !(pkt->wLength != 0) ;
     @   assumes   ( (pkt->wIndex & 0x7f) < ctx->cfg[ctx->curr_cfg].interface_num) ;
     @   assumes ctx->state == USB_DEVICE_STATE_CONFIGURED ;
-    @   ensures \result == MBED_ERROR_NONE ;
+    @   ensures is_valid_error(\result) ;
 
     @ complete behaviors ;
     @ disjoint behaviors ;
@@ -2062,13 +2420,14 @@ static
 mbed_error_t usbctrl_std_req_handle_set_interface(usbctrl_setup_pkt_t * const pkt,
                                                          usbctrl_context_t *ctx)
 {
-    /* This request permit to select interfaces of a same configuration which
-     * are mutually exclusive.
-     * This type of profile is not handled by the libxDCI, which, instead, handle
-     * multiple configurations with mutually exclusive interfaces in it.
-     * As a consequence, we return a STALL response to this request.
-     * See SET_CONFIGURATION request instead. */
+    /* This request permit to select one of the mutually exclusive alternate
+     * settings of an interface. Only the interface EPs are reconfigured: the EPs
+     * of the previous alternate setting are deconfigured (their pending transfers
+     * being dropped), and the ones of the new alternate setting configured.
+     * Other interfaces of the configuration are not impacted. */
     mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_interface_t *iface = NULL;
+    uint32_t handler = 0;
     log_printf("[USBCTRL] Std req: set interface\n");
     if (!is_std_requests_allowed(ctx)) {
         /* error handling, invalid state */
@@ -2080,14 +2439,14 @@ mbed_error_t usbctrl_std_req_handle_set_interface(usbctrl_setup_pkt_t * const pk
     uint16_t length = pkt->wLength;
     if (length != 0) {
         /* data length *must* be 0. There is no DATA stage after this SETUP stage */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
     if (usbctrl_is_interface_exists(ctx, iface_id) == false) {
         /* if the targetted ep does not exist in the current configuration, this
          * request is invalid. */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
@@ -2096,33 +2455,54 @@ mbed_error_t usbctrl_std_req_handle_set_interface(usbctrl_setup_pkt_t * const pk
     switch (usbctrl_get_state(ctx)) {
         case USB_DEVICE_STATE_DEFAULT:
             /* on DEFAULT state, USB 2.0 says 'undefined behavior', here, we stall */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_ADDRESS:
             /* USB 2.0 says that we repond with a 'request error' */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_CONFIGURED:
-            /* here, we supports only default settings for all our interfaces.
-             * we respond a request error */
-            /*
-             * TODO: Idealy, we should be able to handle mutually exclusive interfaces in a same
-             * configuration. In this case, here, the SetInterface should be used by the host
-             * to specify which interface is to be activated.
-             * This behavior differs from the Set_Configuration, which handle set of interfaces
-             * switching.
-             * By now, the libxDCI handles the Set_Configuration to manipulate mutually exclusive
-             * interfaces, instead of Set_Interface().
-             */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            iface = &(ctx->cfg[ctx->curr_cfg].interfaces[iface_id]);
+            /* interfaces without alternate settings only have the default one */
+            if (pkt->wValue >= iface->alt_setting_num && pkt->wValue != 0) {
+                usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
+                errcode = MBED_ERROR_INVPARAM;
+                goto err;
+            }
+            /* the previous alternate setting EPs are released... */
+            usbctrl_unset_iface_endpoints(ctx, iface_id);
+            for (uint8_t i = 0; i < iface->usb_ep_number; ++i) {
+                if (iface->eps[i].type != USB_EP_TYPE_CONTROL &&
+                    iface->eps[i].alt_setting == iface->alt_setting) {
+                    usbctrl_xfer_flush_ep(ctx, iface->eps[i].ep_num | USBCTRL_EP_ADDR_DIR_IN);
+                    usbctrl_xfer_flush_ep(ctx, iface->eps[i].ep_num);
+                }
+            }
+            usbctrl_ep_table_set_altsetting(&(ctx->cfg[ctx->curr_cfg]), iface_id, (uint8_t)pkt->wValue);
+            /* ... and the new ones configured */
+            errcode = usbctrl_set_iface_endpoints(ctx, iface_id);
+            if (errcode != MBED_ERROR_NONE) {
+                usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
+                goto err;
+            }
+            if (iface->altsetting_handler != NULL) {
+#ifndef __FRAMAC__
+                if (handler_sanity_check((physaddr_t)iface->altsetting_handler)) {
+                    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
+                    errcode = MBED_ERROR_UNKNOWN;
+                    goto err;
+                }
+#endif
+                usbctrl_get_handler(ctx, &handler);
+                iface->altsetting_handler(handler, iface_id, iface->alt_setting);
+            }
             break;
         default:
             /* this should never be reached with the is_std_requests_allowed() function */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
     }
 err:
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
     return errcode;
 }
 
@@ -2130,7 +2510,6 @@ err:
     @ requires \valid(ctx) && \valid_read(pkt) ;
     @ requires \separated(ctx+(..),pkt,&GHOST_opaque_drv_privates);
     @ assigns *ctx , GHOST_opaque_drv_privates;
-    @ ensures ctx->ctrl_req_processing == \false ;
 
     @ behavior std_requests_not_allowed:
     @   assumes !((ctx->state == USB_DEVICE_STATE_DEFAULT) ||
@@ -2212,12 +2591,15 @@ mbed_error_t usbctrl_std_req_handle_synch_frame(usbctrl_setup_pkt_t * const pkt,
      * If the specified endpoint does not support this request, then the device will
      * respond with a Request Error.
      *
-     * In the current implementation of the libxDCI, SYNC_FRAME is not supported as
-     * there is no frame/micro-frame count (it requires a lot of CPU cycles).
-     * This may be updated later using hardware-assisted calculation.
-     * Thus, we implement the request sanitation.
+     * The libxDCI answers with the frame number of the last SOF, as counted by the
+     * backend driver: the isochronous EPs patterns are bound to the frame they are
+     * sent in (see usbctrl_xfer.c), the current frame is then the start of a
+     * pattern. Only isochronous EPs support this request.
      */
     mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_ep_entry_t *entry = NULL;
+    uint16_t frame;
+    uint8_t *resp = usbctrl_ep0_resp_buf(ctx, 2);
     log_printf("[USBCTRL] Std req: sync_frame\n");
     if (!is_std_requests_allowed(ctx)) {
         /* error handling, invalid state */
@@ -2232,14 +2614,14 @@ mbed_error_t usbctrl_std_req_handle_synch_frame(usbctrl_setup_pkt_t * const pkt,
     uint16_t length = pkt->wLength;
     if (length != 2) {
         /* data length *must* be 2. The DATA packet received next should be of size 2 */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
     if (usbctrl_is_endpoint_exists(ctx, ep_id) == false) {
         /* if the targetted ep does not exist in the current configuration, this
          * request is invalid. */
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+        usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
         errcode = MBED_ERROR_INVPARAM;
         goto err;
     }
@@ -2248,25 +2630,34 @@ mbed_error_t usbctrl_std_req_handle_synch_frame(usbctrl_setup_pkt_t * const pkt,
     switch (usbctrl_get_state(ctx)) {
         case USB_DEVICE_STATE_DEFAULT:
             /* on DEFAULT state, USB 2.0 says 'undefined behavior', here, we stall */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_ADDRESS:
             /* USB 2.0 says that we repond with a 'request error' */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
         case USB_DEVICE_STATE_CONFIGURED:
-            /* here, this is a valid request, but while we do not support SYNC_FRAME,
-             * we respond a request error */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            entry = usbctrl_get_endpoint_entry(ctx, (uint8_t)(pkt->wIndex & 0x8f));
+            if (entry == NULL ||
+                ctx->cfg[ctx->curr_cfg].interfaces[entry->iface_id].eps[entry->ep_id].type != USB_EP_TYPE_ISOCHRONOUS ||
+                !usbctrl_drv_has_frame_number(ctx)) {
+                /* request error, or no frame counter to answer with */
+                usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
+                break;
+            }
+            frame = (uint16_t)(usbctrl_drv_get_frame_number(ctx) & 0x7ff);
+            resp[0] = (uint8_t)(frame & 0xff);
+            resp[1] = (uint8_t)((frame >> 8) & 0xff);
+            usbctrl_ep0_send(ctx, resp, 2, length);
+            usbctrl_drv_ack(ctx, 0, USB_BACKEND_DRV_EP_DIR_OUT);
             break;
         default:
             /* this should never be reached with the is_std_requests_allowed() function */
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
 
     }
 err:
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
     return errcode;
 }
 
@@ -2392,15 +2783,16 @@ mbed_error_t usbctrl_handle_std_requests(usbctrl_setup_pkt_t *pkt,
             break;
         default:
             log_printf("[USBCTRL] Unknown std request %d\n", pkt->bRequest);
-            usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+            usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
             break;
     }
     return errcode;
 }
 
 /*
- * TODO: The previous usb_control implementation didn't support the vendor requests.
- * It would be great to implement properly these requests now.
+ * Vendor requests are dispatched to the handler declared for their bRequest code and
+ * recipient (see usbctrl_declare_vendor_request()). The request direction and
+ * length are checked against the declared ones before calling the upper layer.
  */
 
 /*@
@@ -2418,8 +2810,7 @@ mbed_error_t usbctrl_handle_std_requests(usbctrl_setup_pkt_t *pkt,
     @   assumes ((ctx->state == USB_DEVICE_STATE_DEFAULT) ||
                 (ctx->state == USB_DEVICE_STATE_ADDRESS) ||
                 (ctx->state == USB_DEVICE_STATE_CONFIGURED)) ;
-    @   ensures \result == MBED_ERROR_NONE ;
-    @   ensures ctx->ctrl_req_processing == \false;
+    @   ensures is_valid_error(\result) ;
 
     @ complete behaviors ;
     @ disjoint behaviors ;
@@ -2427,30 +2818,98 @@ mbed_error_t usbctrl_handle_std_requests(usbctrl_setup_pkt_t *pkt,
 */
 
 #ifndef __FRAMAC__
-static inline
+static
 #endif
-mbed_error_t usbctrl_handle_vendor_requests(usbctrl_setup_pkt_t * const pkt __attribute__((unused)),
+mbed_error_t usbctrl_handle_vendor_requests(usbctrl_setup_pkt_t * const pkt,
                                             usbctrl_context_t   *ctx)
 
 {
     mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_vendor_rqst_t *rqst = NULL;
+    uint32_t handler;
+
     if (!is_vendor_requests_allowed(ctx)) {
         /* error handling, invalid state */
         errcode = MBED_ERROR_INVSTATE;
         goto err;
     }
+    rqst = usbctrl_get_vendor_request(ctx, pkt->bRequest, usbctrl_std_req_get_recipient(pkt));
+    if (rqst == NULL) {
+        log_printf("[USBCTRL] vendor rqst %x not declared\n", pkt->bRequest);
+        errcode = MBED_ERROR_UNSUPORTED_CMD;
+        goto err_stall;
+    }
+    /* request direction and length must match the declared ones. Device-to-host
+     * requests may ask for more than max_len, the response is shorter in that case */
+    if ((rqst->dir == USB_EP_DIR_IN  && usbctrl_std_req_get_dir(pkt) != USB_REQ_DIR_D2H) ||
+        (rqst->dir == USB_EP_DIR_OUT && usbctrl_std_req_get_dir(pkt) != USB_REQ_DIR_H2D)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err_stall;
+    }
+    if (rqst->dir == USB_EP_DIR_OUT && pkt->wLength > rqst->max_len) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err_stall;
+    }
 
-    /* request finish here */
-    set_bool_with_membarrier(&(ctx->ctrl_req_processing), false);
+    if (rqst->dir == USB_EP_DIR_OUT && pkt->wLength != 0) {
+        /* data stage first: the upper layer is called once it is fully received, in
+         * usbctrl_handle_ctrl_data_stage() */
+        errcode = usbctrl_ep0_recv(ctx, pkt, &(ctx->ctrl_data_buf[0]), CONFIG_USBCTRL_CTRL_DATA_BUF_SIZE, rqst->handler);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err_stall;
+        }
+        /* request finishes at status stage */
+        goto err;
+    }
+
+    if (usbctrl_get_handler(ctx, &handler) != MBED_ERROR_NONE) {
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err_stall;
+    }
+#ifndef __FRAMAC__
+    if (handler_sanity_check((physaddr_t)rqst->handler)) {
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err_stall;
+    }
+#endif
+    if (rqst->dir == USB_EP_DIR_IN) {
+        /* the response is built in the context data stage buffer, which stays
+         * valid during the whole (possibly multi-packet) data stage */
+        uint16_t size = rqst->max_len;
+        /*@ assert rqst->handler ∈ {&vendor_rqst_handler}; */
+        /*@ calls vendor_rqst_handler; */
+        if ((errcode = rqst->handler(handler, pkt, &(ctx->ctrl_data_buf[0]), &size)) != MBED_ERROR_NONE) {
+            goto err_stall;
+        }
+        if (size > rqst->max_len) {
+            size = rqst->max_len;
+        }
+        usbctrl_ep0_send(ctx, &(ctx->ctrl_data_buf[0]), size, pkt->wLength);
+        usbctrl_drv_ack(ctx, EP0, USB_BACKEND_DRV_EP_DIR_OUT);
+        /* request finishes at the iepint rise */
+        goto err;
+    }
+
+    /* host-to-device request without data stage */
+    uint16_t size = 0;
+    /*@ assert rqst->handler ∈ {&vendor_rqst_handler}; */
+    /*@ calls vendor_rqst_handler; */
+    if ((errcode = rqst->handler(handler, pkt, NULL, &size)) != MBED_ERROR_NONE) {
+        goto err_stall;
+    }
+    /* status stage is sent by the dispatcher */
+    goto err;
+
+err_stall:
+    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
 err:
     return errcode;
 }
 
 /*
- * Class requests targets interfaces (i.e. registered interfaces).
- * These requests are transfered to each upper pesonalities class request handlers
- * to find which one is able to respond to the current setup pkt.
- * this function is a dispatcher between the various registered personalities
+ * Class requests targets interfaces (i.e. registered interfaces) or their endpoints.
+ * These requests are transfered to the class request handler of the upper
+ * personality owning the recipient (see usbctrl_handle_iface_requests()).
  */
 
 
@@ -2475,10 +2934,109 @@ mbed_error_t usbctrl_handle_unknown_requests(usbctrl_setup_pkt_t *const pkt __at
                                              usbctrl_context_t   *const ctx __attribute__((unused)))
 {
     log_printf("[USBCTRL] Unknown Request type %d/%x\n", pkt->bmRequestType, pkt->bRequest);
-    usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_IN);
+    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_IN);
     return MBED_ERROR_UNKNOWN;
 }
 
+/*
+ * Interface and endpoint recipient requests are owned by a single interface: the
+ * one declared with the interface number (interface recipient) or holding the
+ * endpoint address (endpoint recipient) given in the wIndex low byte.
+ * Returns NULL if there is no such recipient in the current configuration.
+ */
+
+/*@
+    @ requires \valid_read(pkt) && \valid(ctx) ;
+    @ assigns \nothing ;
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+usbctrl_interface_t *usbctrl_get_request_owner(usbctrl_setup_pkt_t const * const pkt,
+                                               usbctrl_context_t   *ctx)
+{
+    usbctrl_interface_t *iface = NULL;
+    uint8_t recipient_id = (pkt->wIndex & 0xff);
+
+    switch (usbctrl_std_req_get_recipient(pkt)) {
+        case USB_REQ_RECIPIENT_INTERFACE:
+            iface = usbctrl_get_interface(ctx, recipient_id);
+            break;
+        case USB_REQ_RECIPIENT_ENDPOINT: {
+            usbctrl_ep_entry_t *entry = usbctrl_get_endpoint_entry(ctx, recipient_id);
+            if (entry != NULL) {
+                iface = &(ctx->cfg[ctx->curr_cfg].interfaces[entry->iface_id]);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return iface;
+}
+
+/*
+ * Requests targeting an interface or one of its endpoints are passed to the owning
+ * interface request handler only. Requests targeting a nonexistent recipient are
+ * rejected without calling any upper layer.
+ */
+
+/*@
+    @ requires \valid(pkt) && \valid(ctx) ;
+    @ requires \separated(ctx,pkt);
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_handle_iface_requests(usbctrl_setup_pkt_t *pkt,
+                                           usbctrl_context_t   *ctx)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    uint32_t handler;
+
+    usbctrl_interface_t *iface = usbctrl_get_request_owner(pkt, ctx);
+    if (iface == NULL) {
+        log_printf("[USBCTRL] request recipient %x not found\n", pkt->wIndex);
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    usbctrl_ctrl_data_t *ctrl_data = &(ctx->cfg[ctx->curr_cfg].ctrl_data[iface->id]);
+    if (ctrl_data->handler != NULL &&
+        usbctrl_std_req_get_dir(pkt) == USB_REQ_DIR_H2D && pkt->wLength != 0) {
+        /* the interface has declared a data stage handler: the libctrl receives the
+         * data stage and the handler is called with the complete payload */
+        errcode = usbctrl_ep0_recv(ctx, pkt, ctrl_data->buf, ctrl_data->size, ctrl_data->handler);
+        /* on error, stalled by the caller */
+        goto err;
+    }
+    if (iface->rqst_handler == NULL) {
+        errcode = MBED_ERROR_UNSUPORTED_CMD;
+        goto err;
+    }
+    if (usbctrl_get_handler(ctx, &handler) != MBED_ERROR_NONE) {
+        log_printf("[LIBCTRL] Unable to get back handler from ctx\n");
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+#ifndef __FRAMAC__
+    if (handler_sanity_check((physaddr_t)iface->rqst_handler)) {
+        errcode = MBED_ERROR_UNKNOWN;
+        goto err;
+    }
+#endif
+    log_printf("[USBCTRL] execute iface %d class handler\n", iface->id);
+    /*@ assert iface->rqst_handler ∈ {&class_rqst_handler}; */
+    /*@ calls class_rqst_handler; */
+    errcode = iface->rqst_handler(handler, pkt);
+    if (errcode == MBED_ERROR_NONE && ctx->ctrl_phase == USBCTRL_CTRL_PHASE_SETUP) {
+        /* the upper layer owns the end of the transfer (data and status stages) */
+        usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_IDLE);
+    }
+err:
+    return errcode;
+}
+
 /*
  * Global requests dispatcher. This function call the corresponding request handler, get back
  * its error code in return, release the EP0 receive FIFO lock and return the error code.
@@ -2511,7 +3069,7 @@ mbed_error_t usbctrl_handle_unknown_requests(usbctrl_setup_pkt_t *const pkt __at
     @   assumes pkt != \null ;
     @   assumes !(\forall integer i ; 0 <= i < GHOST_num_ctx ==> ctx_list[i].dev_id != dev_id) ;
     @   assumes (((pkt->bmRequestType >> 5) & 0x3) == USB_REQ_TYPE_VENDOR) ;
-    @   ensures (\result == MBED_ERROR_INVSTATE || \result == MBED_ERROR_NONE) ;
+    @   ensures is_valid_error(\result) ;
     @   assigns ctx_list[0..(GHOST_num_ctx-1)], GHOST_idx_ctx ;
 
     @ behavior USB_REQ_TYPE_CLASS:
@@ -2549,129 +3107,70 @@ mbed_error_t usbctrl_handle_requests(usbctrl_setup_pkt_t *pkt,
 
     /* Detect which context is assocated to current request and set local ctx */
     if (usbctrl_get_context(dev_id, &ctx) != MBED_ERROR_NONE) {
-        /* trapped on oepint() from a device which is not handled here ! what ? */
+        /* trapped on oepint() from a device which is not handled here ! what ?
+         * No context, hence no backend driver to stall the control pipe with */
         errcode = MBED_ERROR_UNKNOWN;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_OUT);
         goto err_init;
     }
     /*@ assert \valid(ctx); */
     /* Sanitation */
     if (pkt == NULL) {
         errcode = MBED_ERROR_INVPARAM;
-        usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_OUT);
+        usbctrl_drv_stall(ctx, EP0, USB_BACKEND_DRV_EP_DIR_OUT);
         goto err;
     }
     /*@ assert \valid(pkt) ; */
+    /* a new SETUP packet terminates any previous control transfer */
+    usbctrl_ep0_abort(ctx);
+    usbctrl_ctrl_set_phase(ctx, USBCTRL_CTRL_PHASE_SETUP);
     usbctrl_req_type_t type = usbctrl_std_req_get_type(pkt);
 
     switch(type){
         case USB_REQ_TYPE_STD:
             if(usbctrl_std_req_get_recipient(pkt) != USB_REQ_RECIPIENT_INTERFACE){
-                set_bool_with_membarrier(&(ctx->ctrl_req_processing), true);
                 log_printf("[USBCTRL] std request for control (recipient = 0)\n");
                 /* For current request of current context, is the current context is a standard
                 * request ? If yes, handle localy */
                 /*@ assert \separated(pkt, ctx + (..), &conf_set); */
                 errcode = usbctrl_handle_std_requests(pkt, ctx);
+                usbctrl_ctrl_setup_done(ctx, errcode);
             }else{
-                log_printf("[USBCTRL] std request for iface/ep/other: %x\n", usbctrl_std_req_get_recipient(pkt));
-                uint8_t curr_cfg = ctx->curr_cfg;
-                mbed_error_t upper_stack_err = MBED_ERROR_INVPARAM;
-
-            /*@
-                @ loop invariant 0 <= i <= ctx->cfg[curr_cfg].interface_num ;
-                @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces + (0..(ctx->cfg[curr_cfg].interface_num-1))) ;
-                @ loop assigns i, upper_stack_err ;
-                @ loop variant (ctx->cfg[curr_cfg].interface_num - i);
-            */
-                for (uint8_t i = 0; i < ctx->cfg[curr_cfg].interface_num; ++i) {
-                    if (ctx->cfg[curr_cfg].interfaces[i].rqst_handler) {
-                        log_printf("[USBCTRL] execute iface class handler\n");
-                        uint32_t handler;
-                        if (usbctrl_get_handler(ctx, &handler) != MBED_ERROR_NONE) {
-                            log_printf("[LIBCTRL] Unable to get back handler from ctx\n");
-                            goto err ;
-                        }
-
-#ifndef __FRAMAC__
-                        if (handler_sanity_check((physaddr_t)ctx->cfg[curr_cfg].interfaces[i].rqst_handler)) {
-                            goto err;
-                        }
-#endif
-                /*@ assert \separated(&handler,pkt,ctx_list + (0..(GHOST_num_ctx-1))) ; */
-                /*@ assert ctx->cfg[curr_cfg].interfaces[i].rqst_handler ∈ {&class_rqst_handler}; */
-                /*@ calls class_rqst_handler; */
-
-                        if ((upper_stack_err = ctx->cfg[curr_cfg].interfaces[i].rqst_handler(handler, pkt)) == MBED_ERROR_NONE) {
-                            /* upper class handler found, we can leave the loop */
-                            break;
-                        }
-                    }
+                log_printf("[USBCTRL] std request for iface: %x\n", pkt->wIndex);
+                if (!usbctrl_is_interface_exists(ctx, pkt->wIndex & 0xff)) {
+                    /* no such interface in current configuration */
+                    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_OUT);
+                    errcode = MBED_ERROR_INVPARAM;
+                    goto err;
                 }
-
-                /* fallback if no upper stack class request handler was able to handle the received CLASS request */
-                if (upper_stack_err != MBED_ERROR_NONE) {
-                    usb_backend_drv_stall(0, USB_BACKEND_DRV_EP_DIR_OUT);
+                if ((errcode = usbctrl_handle_iface_requests(pkt, ctx)) != MBED_ERROR_NONE) {
+                    /* the owning interface does not handle this standard request,
+                     * fallback to the standard handling of interface recipient */
+                    /*@ assert \separated(pkt, ctx + (..), &conf_set); */
+                    errcode = usbctrl_handle_std_requests(pkt, ctx);
+                    usbctrl_ctrl_setup_done(ctx, errcode);
                 }
-                /* upgrade local errcode with upper stack errcode received */
-                errcode = usbctrl_handle_unknown_requests(pkt, ctx);
             }
             break;
         case USB_REQ_TYPE_VENDOR:
             log_printf("[USBCTRL] vendor request\n");
             /* ... or, is the current request is a vendor request, then handle locally
             * for vendor */
-            set_bool_with_membarrier(&(ctx->ctrl_req_processing), true);
             /*@ assert \separated(pkt, ctx + (..)); */
             errcode = usbctrl_handle_vendor_requests(pkt, ctx);
+            usbctrl_ctrl_setup_done(ctx, errcode);
             break;
         case USB_REQ_TYPE_CLASS:
-            if(usbctrl_std_req_get_recipient(pkt) == USB_REQ_RECIPIENT_INTERFACE){
-                log_printf("[USBCTRL] class request for iface\n");
-                //if(usbctrl_std_req_get_recipient(pkt) == USB_REQ_RECIPIENT_INTERFACE){
-                log_printf("[USBCTRL] receiving class Request\n");
+            if(usbctrl_std_req_get_recipient(pkt) == USB_REQ_RECIPIENT_INTERFACE ||
+               usbctrl_std_req_get_recipient(pkt) == USB_REQ_RECIPIENT_ENDPOINT){
+                log_printf("[USBCTRL] class request for iface/ep %x\n", pkt->wIndex);
                 /* ... or, is the current request is a class request or target a dedicated
                 * interface, then handle in upper layer*/
-                uint8_t curr_cfg = ctx->curr_cfg;
-                mbed_error_t upper_stack_err = MBED_ERROR_INVPARAM;
-
-            /*@
-                @ loop invariant 0 <= i <= ctx->cfg[curr_cfg].interface_num ;
-                @ loop invariant \valid_read(ctx->cfg[curr_cfg].interfaces + (0..(ctx->cfg[curr_cfg].interface_num-1))) ;
-                @ loop assigns i, upper_stack_err ;
-                @ loop variant (ctx->cfg[curr_cfg].interface_num - i);
-            */
-                for (uint8_t i = 0; i < ctx->cfg[curr_cfg].interface_num; ++i) {
-                    if (ctx->cfg[curr_cfg].interfaces[i].rqst_handler) {
-                        log_printf("[USBCTRL] execute iface class handler\n");
-                        uint32_t handler;
-                        if (usbctrl_get_handler(ctx, &handler) != MBED_ERROR_NONE) {
-                            log_printf("[LIBCTRL] Unable to get back handler from ctx\n");
-                            goto err ;
-                        }
-
-#ifndef __FRAMAC__
-                        if (handler_sanity_check((physaddr_t)ctx->cfg[curr_cfg].interfaces[i].rqst_handler)) {
-                            goto err;
-                        }
-#endif
-                /*@ assert ctx->cfg[curr_cfg].interfaces[i].rqst_handler ∈ {&class_rqst_handler}; */
-                /*@ calls class_rqst_handler; */
-
-                        if ((upper_stack_err = ctx->cfg[curr_cfg].interfaces[i].rqst_handler(handler, pkt)) == MBED_ERROR_NONE) {
-                            /* upper class handler found, we can leave the loop */
-                            break;
-                        }
-                    }
-                }
-
-                /* fallback if no upper stack class request handler was able to handle the received CLASS request */
-                if (upper_stack_err != MBED_ERROR_NONE) {
-                    log_printf("[USBCTRL] error during iface class rqust handler exec: %d\n", upper_stack_err);
-                    usb_backend_drv_stall(0, USB_BACKEND_DRV_EP_DIR_OUT);
+                if ((errcode = usbctrl_handle_iface_requests(pkt, ctx)) != MBED_ERROR_NONE) {
+                    /* the recipient does not exist or its owner is not able to handle
+                     * the received CLASS request */
+                    log_printf("[USBCTRL] error during iface class rqust handler exec: %d\n", errcode);
+                    usbctrl_ctrl_stall(ctx, USB_BACKEND_DRV_EP_DIR_OUT);
                 }
-                /* upgrade local errcode with upper stack errcode received */
-                errcode = upper_stack_err;
             }else{
                 log_printf("[USBCTRL] class request for other(s)\n");
                 errcode = usbctrl_handle_unknown_requests(pkt, ctx);
@@ -142,17 +142,6 @@ typedef enum {
    USB_FEATURE_TEST_MODE          = 0x2,
 } usbctrl_feature_selector_t;
 
-/*
- * Max descriptor len in bytes. Descriptor may include successive descriptors,
- * for e.g. in case of configuration descriptor requests, to which we respond
- * by returning the current device descriptor, configuration descriptor, and,
- * for each interface active, the interface descriptor and associated
- * endpoint descriptors.
- * Other descriptor, for e.g. for String descriptors, may also be large, for
- * example for internationalization, for which the size is 255.
- */
-#define MAX_DESCRIPTOR_LEN 256
-
 
 /*
  * Handle USB requests (standard setup packets)
@@ -183,4 +172,24 @@ mbed_error_t usbctrl_handle_class_requests(usbctrl_setup_pkt_t *pkt,
 
 mbed_error_t usbctrl_unset_active_endpoints(usbctrl_context_t *ctx);
 
+mbed_error_t usbctrl_handle_ctrl_data_stage(usbctrl_context_t *ctx,
+                                            uint32_t           size);
+
+mbed_error_t usbctrl_ep0_send(usbctrl_context_t *ctx,
+                              const uint8_t     *data,
+                              uint32_t           size,
+                              uint16_t           wLength);
+
+bool usbctrl_ep0_in_next(usbctrl_context_t *ctx);
+
+void usbctrl_ep0_abort(usbctrl_context_t *ctx);
+
+void usbctrl_ctrl_set_phase(usbctrl_context_t    *ctx,
+                            usbctrl_ctrl_phase_t  phase);
+
+mbed_error_t usbctrl_ctrl_status(usbctrl_context_t *ctx);
+
+void usbctrl_ctrl_stall(usbctrl_context_t        *ctx,
+                        usb_backend_drv_ep_dir_t  dir);
+
 #endif/*USBCTRL_STD_REQUESTS_H_*/
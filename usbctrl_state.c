@@ -2,6 +2,7 @@
 #include "libc/stdio.h"
 #include "libc/sync.h"
 #include "usbctrl.h"
+#include "usbctrl_sync.h"
 #include "usbctrl_state.h"
 #include "usbctrl_requests.h"
 #ifdef __FRAMAC__
@@ -494,7 +495,7 @@ usb_device_state_t usbctrl_get_state(const usbctrl_context_t *ctx)
    if (ctx == NULL) {
        return USB_DEVICE_STATE_INVALID;
    }
-   return ctx->state;
+   return usbctrl_load_acquire(&(ctx->state));
 }
 
 /*
@@ -533,10 +534,11 @@ mbed_error_t usbctrl_set_state(__out usbctrl_context_t *ctx,
     }
     log_printf("[USBCTRL] changing from state %x to %x\n", ctx->state, newstate);
     /*@ assert \valid(&ctx->state); */
-    /* here we do not use set_u8_with_membarrier() because it forbid metACSL from detecting that
-     * ctx->state is assigned only here. Instead, using request_data_membarrier() */
-    ctx->state = newstate;
-    request_data_membarrier();
+    /* the state change is the publish point of the device state (address, current
+     * configuration, active EPs...): all of them are visible once it is seen.
+     * usbctrl_store_release() is a plain assignment for Frama-C, so that metACSL
+     * still detects that ctx->state is assigned only here. */
+    usbctrl_store_release(&(ctx->state), (uint8_t)newstate);
 
     return MBED_ERROR_NONE;
 }
@@ -0,0 +1,60 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef USBCTRL_STATIC_DESC_H_
+#define USBCTRL_STATIC_DESC_H_
+
+#include "libc/types.h"
+
+/*
+ * Build-time generated descriptors.
+ *
+ * When CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS is set, the device, configuration
+ * and string descriptors are generated at build time by tools/usbctrl_gendesc.py
+ * from Kconfig and the interfaces manifest, and stored as const (flash resident)
+ * byte arrays. The request path then sends these bytes as is, instead of forging
+ * the descriptors at enumeration time.
+ *
+ * The manifest must describe the interfaces in their declaration order. This is
+ * checked against the interfaces declared at runtime when the device is started.
+ */
+typedef struct {
+    const uint8_t *desc;    /*< descriptor bytes (NULL for unused string index) */
+    uint16_t       size;    /*< descriptor size in bytes */
+} usbctrl_static_desc_t;
+
+#ifdef CONFIG_USR_LIB_USBCTRL_STATIC_DESCRIPTORS
+
+extern const usbctrl_static_desc_t usbctrl_static_dev_desc;
+
+/* configuration descriptors, indexed by configuration cell */
+extern const usbctrl_static_desc_t usbctrl_static_cfg_desc[];
+extern const uint8_t               usbctrl_static_cfg_desc_num;
+
+/* string descriptors, indexed by string descriptor index */
+extern const usbctrl_static_desc_t usbctrl_static_string_desc[];
+extern const uint8_t               usbctrl_static_string_desc_num;
+
+#endif
+
+#endif/*!USBCTRL_STATIC_DESC_H_*/
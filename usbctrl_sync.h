@@ -0,0 +1,71 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef USBCTRL_SYNC_H_
+#define USBCTRL_SYNC_H_
+
+/*
+ * Publication of data shared between the USB events context (ISR or dispatch task)
+ * and the API context.
+ *
+ * Each shared structure has a single publish point: its producer writes the
+ * data with plain stores, then publishes them with a release store of the
+ * publishing field (ring head, device state, context handle...). The consumer
+ * reads the publishing field with an acquire load before reading the data.
+ * On Cortex-M, a release store is a single DMB followed by the store, and an
+ * acquire load is the load followed by a single DMB, both inlined, where the
+ * libstd set_*_with_membarrier() helpers cost a function call and a full
+ * barrier after the store.
+ *
+ * Ownership flags, which can be claimed from several contexts, are taken with
+ * an atomic exchange (LDREXB/STREXB loop on Cortex-M), returning the previous
+ * owner state: only the context reading 0 back owns the flag.
+ *
+ * Frama-C analyses see plain accesses, which have the same semantic in the
+ * sequential model of the proofs.
+ */
+
+#include "libc/types.h"
+
+#if defined(__FRAMAC__)
+# define usbctrl_load_acquire(ptr)       (*(ptr))
+# define usbctrl_store_release(ptr, val) (*(ptr) = (val))
+
+/*@
+    @ requires \valid(ptr);
+    @ assigns *ptr ;
+    @ ensures *ptr == val && \result == \old(*ptr) ;
+*/
+static inline uint8_t usbctrl_exchange_acq_rel(volatile uint8_t *ptr, uint8_t val)
+{
+    uint8_t old = *ptr;
+    *ptr = val;
+    return old;
+}
+#else
+# define usbctrl_load_acquire(ptr)       __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+# define usbctrl_store_release(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+# define usbctrl_exchange_acq_rel(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_ACQ_REL)
+#endif
+
+#endif/*!USBCTRL_SYNC_H_*/
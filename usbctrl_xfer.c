@@ -0,0 +1,755 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/sync.h"
+#include "libc/string.h"
+#include "api/libusbctrl.h"
+#include "usbctrl.h"
+#include "usbctrl_sync.h"
+#include "usbctrl_drv.h"
+#include "usbctrl_state.h"
+#include "usbctrl_xfer.h"
+
+#define USBCTRL_XFER_QUEUE_MASK (CONFIG_USBCTRL_XFER_QUEUE_DEPTH - 1)
+
+/*
+ * EP max packet size, as declared by the owning interface
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid_read(entry);
+    @ assigns \nothing ;
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+uint16_t usbctrl_xfer_mpsize(usbctrl_context_t const * const ctx,
+                             usbctrl_ep_entry_t const * const entry)
+{
+    return ctx->cfg[ctx->curr_cfg].interfaces[entry->iface_id].eps[entry->ep_id].pkt_maxsize;
+}
+
+/*
+ * Isochronous EPs send (or receive) their packet in the frames of the configured
+ * even/odd parity. Each isochronous transfer is armed for the next frame, which
+ * parity alternates: the EP is configured again with it before being armed, as
+ * the backend drivers only take the parity at EP configuration time.
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid_read(entry);
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_xfer_iso_parity(usbctrl_context_t        *ctx,
+                                     uint8_t                   ep_addr,
+                                     usbctrl_ep_entry_t const *entry)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usb_ep_infos_t *ep = &(ctx->cfg[ctx->curr_cfg].interfaces[entry->iface_id].eps[entry->ep_id]);
+    usb_backend_drv_ep_toggle_t toggle;
+
+    if (ep->type != USB_EP_TYPE_ISOCHRONOUS || !usbctrl_drv_has_frame_number(ctx)) {
+        goto err;
+    }
+    toggle = ((usbctrl_drv_get_frame_number(ctx) + 1) & 0x1) ?
+             USB_BACKEND_EP_ODDFRAME : USB_BACKEND_EP_EVENFRAME;
+    errcode = usbctrl_drv_configure_endpoint(ctx, ep_addr & 0xf,
+            USB_BACKEND_DRV_EP_TYPE_ISOCHRONOUS,
+            (ep_addr & USBCTRL_EP_ADDR_DIR_IN) ? USB_BACKEND_DRV_EP_DIR_IN : USB_BACKEND_DRV_EP_DIR_OUT,
+            ep->pkt_maxsize,
+            toggle,
+            ep->handler);
+err:
+    return errcode;
+}
+
+/*
+ * Source of the next IN packet of a gather transfer, starting at offset. The
+ * packet is sent from the segment itself when it fits in it, and is gathered in
+ * the EP bounce buffer otherwise. Returns NULL if the packet can't be sent.
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid_read(xfer);
+*/
+#ifndef __FRAMAC__
+static
+#endif
+uint8_t *usbctrl_xfer_gather(usbctrl_context_t    *ctx __attribute__((unused)),
+                             uint8_t               ep __attribute__((unused)),
+                             usbctrl_xfer_t const *xfer,
+                             uint32_t              offset,
+                             uint16_t              chunk)
+{
+    uint8_t *src = NULL;
+    uint8_t seg = 0;
+
+    /* look for the segment holding offset */
+    while (seg < xfer->iovcnt && offset >= xfer->iov[seg].len) {
+        offset -= xfer->iov[seg].len;
+        seg++;
+    }
+    if (seg == xfer->iovcnt) {
+        goto err;
+    }
+    if (xfer->iov[seg].len - offset >= chunk) {
+        /* zero copy */
+        src = (uint8_t*)&(xfer->iov[seg].base[offset]);
+        goto err;
+    }
+#if CONFIG_USBCTRL_XFER_GATHER_BOUNCE_SIZE > 0
+    if (chunk > CONFIG_USBCTRL_XFER_GATHER_BOUNCE_SIZE || ep >= USBCTRL_GATHER_MAX_EP_NUM) {
+        goto err;
+    }
+    uint16_t copied = 0;
+    while (copied < chunk && seg < xfer->iovcnt) {
+        uint32_t size = xfer->iov[seg].len - offset;
+        if (size > (uint32_t)(chunk - copied)) {
+            size = chunk - copied;
+        }
+        memcpy(&(ctx->gather_bounce[ep][copied]), &(xfer->iov[seg].base[offset]), size);
+        copied += (uint16_t)size;
+        offset = 0;
+        seg++;
+    }
+    src = &(ctx->gather_bounce[ep][0]);
+#endif
+err:
+    return src;
+}
+
+/*
+ * Start (or continue) the transfer at the queue tail
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid(queue);
+    @ assigns queue->chunk, queue->zlp ;
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_xfer_start(usbctrl_context_t    *ctx,
+                                uint8_t               ep_addr,
+                                usbctrl_xfer_queue_t *queue)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_xfer_t *xfer = &(queue->xfer[queue->tail & USBCTRL_XFER_QUEUE_MASK]);
+    usbctrl_ep_entry_t *entry = usbctrl_get_endpoint_entry(ctx, ep_addr);
+    uint8_t ep = ep_addr & 0xf;
+    uint32_t remaining = xfer->len - queue->offset;
+
+    if (entry == NULL) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    if (queue->offset == 0) {
+        /* new transfer: target the next frame */
+        errcode = usbctrl_xfer_iso_parity(ctx, ep_addr, entry);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+    if (ep_addr & USBCTRL_EP_ADDR_DIR_IN) {
+        uint16_t mpsize = usbctrl_xfer_mpsize(ctx, entry);
+        if (remaining == 0) {
+            /* zero length transfer */
+            queue->chunk = 0;
+            queue->zlp = true;
+            errcode = usbctrl_drv_send_zlp(ctx, ep);
+            goto err;
+        }
+        queue->chunk = (uint16_t)((remaining > mpsize) ? mpsize : remaining);
+        if (xfer->iov != NULL) {
+            uint8_t *src = usbctrl_xfer_gather(ctx, ep, xfer, queue->offset, queue->chunk);
+            if (src == NULL) {
+                errcode = MBED_ERROR_INVSTATE;
+                goto err;
+            }
+            errcode = usbctrl_drv_send_data(ctx, src, queue->chunk, ep);
+        } else {
+            errcode = usbctrl_drv_send_data(ctx, &(xfer->buf[queue->offset]), queue->chunk, ep);
+        }
+    } else {
+        /* the whole remaining length is armed, the transfer completes on a short packet */
+        errcode = usbctrl_drv_set_recv_fifo(ctx, &(xfer->buf[queue->offset]), remaining, ep);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+        usbctrl_drv_ack(ctx, ep, USB_BACKEND_DRV_EP_DIR_OUT);
+    }
+err:
+    return errcode;
+}
+
+/*
+ * Current transfer complete: release it, start the next one, then call the
+ * completion handler (which may submit a new transfer).
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid(queue);
+*/
+#ifndef __FRAMAC__
+static
+#endif
+void usbctrl_xfer_complete(usbctrl_context_t    *ctx,
+                           uint8_t               ep_addr,
+                           usbctrl_xfer_queue_t *queue,
+                           uint32_t              size)
+{
+    usbctrl_xfer_t xfer = queue->xfer[queue->tail & USBCTRL_XFER_QUEUE_MASK];
+    uint8_t tail = queue->tail + 1;
+    bool start = false;
+
+    queue->offset = 0;
+    queue->chunk = 0;
+    queue->zlp = false;
+    usbctrl_store_release(&(queue->tail), tail);
+    /*
+     * The EP start ownership is kept while transfers are pending. Otherwise it is
+     * released, then taken again if a transfer has been queued meanwhile, as its
+     * producer may have found the EP still busy.
+     */
+    do {
+        if (tail != usbctrl_load_acquire(&(queue->head))) {
+            start = true;
+            break;
+        }
+        usbctrl_store_release(&(queue->busy), 0);
+    } while (tail != usbctrl_load_acquire(&(queue->head)) &&
+             usbctrl_exchange_acq_rel(&(queue->busy), 1) == 0);
+    if (start == true) {
+        if (usbctrl_xfer_start(ctx, ep_addr, queue) != MBED_ERROR_NONE) {
+            log_printf("[USBCTRL] unable to start next transfer on EP %x\n", ep_addr);
+        }
+    }
+    if (xfer.handler != NULL) {
+#ifndef __FRAMAC__
+        if (handler_sanity_check((physaddr_t)xfer.handler)) {
+            return;
+        }
+#endif
+        xfer.handler(ctx->dev_id, size, ep_addr & 0xf, xfer.cookie);
+    }
+}
+
+/*
+ * Queue a transfer on an EP of the current configuration, starting it if the EP
+ * is idle. The device state is checked by the callers.
+ * The completion of the transfer in progress may run (ISR) between the head
+ * publication and the idle check: the EP is started only by the context which
+ * takes the queue busy flag, here or in usbctrl_xfer_complete().
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid_read(req);
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_xfer_push(usbctrl_context_t    *ctx,
+                               uint8_t               ep_addr,
+                               usbctrl_xfer_t const *req)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_xfer_queue_t *queue = NULL;
+    uint8_t head;
+
+    if ((ep_addr & 0xf) == EP0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (usbctrl_get_endpoint_entry(ctx, ep_addr) == NULL) {
+        /* EP not declared in the current configuration */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    queue = &(ctx->xfer_queue[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]);
+    head = queue->head;
+    if ((uint8_t)(head - queue->tail) >= CONFIG_USBCTRL_XFER_QUEUE_DEPTH) {
+        errcode = MBED_ERROR_BUSY;
+        goto err;
+    }
+    queue->xfer[head & USBCTRL_XFER_QUEUE_MASK] = *req;
+    usbctrl_store_release(&(queue->head), head + 1);
+    if (usbctrl_exchange_acq_rel(&(queue->busy), 1) == 0) {
+        /* EP idle: start at once */
+        errcode = usbctrl_xfer_start(ctx, ep_addr, queue);
+        if (errcode != MBED_ERROR_NONE) {
+            /* withdraw the transfer, still owning the EP, then release it */
+            usbctrl_store_release(&(queue->head), head);
+            usbctrl_store_release(&(queue->busy), 0);
+        }
+    }
+err:
+    return errcode;
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_xfer_submit(usbctrl_context_t      *ctx,
+                                 uint8_t                 ep_addr,
+                                 uint8_t                *buf,
+                                 uint32_t                len,
+                                 uint32_t                flags,
+                                 usbctrl_xfer_handler_t  handler,
+                                 void                   *cookie)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_xfer_t req = { buf, len, flags, handler, cookie, NULL, 0 };
+
+    if (buf == NULL && len != 0) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (!(ep_addr & USBCTRL_EP_ADDR_DIR_IN) && len == 0) {
+        /* nothing to receive */
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (usbctrl_get_state(ctx) != USB_DEVICE_STATE_CONFIGURED) {
+        /* EP not active in the current configuration */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    errcode = usbctrl_xfer_push(ctx, ep_addr, &req);
+err:
+    return errcode;
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_xfer_submit_iov(usbctrl_context_t      *ctx,
+                                     uint8_t                 ep_addr,
+                                     const usbctrl_iovec_t  *iov,
+                                     uint8_t                 iovcnt,
+                                     uint32_t                flags,
+                                     usbctrl_xfer_handler_t  handler,
+                                     void                   *cookie)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_xfer_t req = { NULL, 0, flags, handler, cookie, iov, iovcnt };
+    usbctrl_ep_entry_t *entry = NULL;
+    uint16_t mpsize;
+
+    if (iov == NULL || iovcnt == 0 || !(ep_addr & USBCTRL_EP_ADDR_DIR_IN)) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    if (usbctrl_get_state(ctx) != USB_DEVICE_STATE_CONFIGURED ||
+        (entry = usbctrl_get_endpoint_entry(ctx, ep_addr)) == NULL ||
+        (mpsize = usbctrl_xfer_mpsize(ctx, entry)) == 0) {
+        /* EP not active in the current configuration */
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    /*@
+      @ loop invariant 0 <= i <= iovcnt ;
+      @ loop assigns i, req.len, errcode ;
+      @ loop variant (iovcnt - i) ;
+      */
+    for (uint8_t i = 0; i < iovcnt; ++i) {
+        if ((iov[i].base == NULL && iov[i].len != 0) ||
+            iov[i].len > (uint32_t)(0xffffffff - req.len)) {
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+        }
+        req.len += iov[i].len;
+        if (i < iovcnt - 1 && (req.len % mpsize) != 0 &&
+            (mpsize > CONFIG_USBCTRL_XFER_GATHER_BOUNCE_SIZE ||
+             (ep_addr & 0xf) >= USBCTRL_GATHER_MAX_EP_NUM)) {
+            /* a packet crosses this segment boundary, and can't be gathered */
+            errcode = MBED_ERROR_INVPARAM;
+            goto err;
+        }
+    }
+    errcode = usbctrl_xfer_push(ctx, ep_addr, &req);
+err:
+    return errcode;
+}
+
+/*
+ * About ping-pong reception.
+ *
+ * A ping-pong OUT EP is fed with two transfers of pingpong_size bytes each,
+ * one per half of pingpong_buf. When one of them completes, the transfer engine
+ * arms the other half before calling the completion handler below, so that the
+ * EP is never left without a reception buffer while the upper layer consumes the
+ * received data. Once the upper layer handler returns, the consumed half is queued
+ * again behind the one being received.
+ */
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns \nothing ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+usb_ep_infos_t *usbctrl_xfer_pingpong_ep(usbctrl_context_t *ctx, uint8_t ep_addr)
+{
+    usbctrl_ep_entry_t *entry = usbctrl_get_endpoint_entry(ctx, ep_addr);
+    if (entry == NULL) {
+        return NULL;
+    }
+    return &(ctx->cfg[ctx->curr_cfg].interfaces[entry->iface_id].eps[entry->ep_id]);
+}
+
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_xfer_pingpong_complete(uint32_t dev_id,
+                                            uint32_t size,
+                                            uint8_t  ep_id,
+                                            void    *cookie)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_context_t *ctx = NULL;
+    usb_ep_infos_t *ep = NULL;
+    uint8_t *buf = (uint8_t*)cookie;
+    usbctrl_xfer_t req = { buf, 0, 0, usbctrl_xfer_pingpong_complete, buf, NULL, 0 };
+
+    if (usbctrl_get_context(dev_id, &ctx) != MBED_ERROR_NONE ||
+        (ep = usbctrl_xfer_pingpong_ep(ctx, ep_id)) == NULL ||
+        ep->pingpong_buf == NULL) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    if (ep->pingpong_handler != NULL) {
+#ifndef __FRAMAC__
+        if (handler_sanity_check((physaddr_t)ep->pingpong_handler)) {
+            errcode = MBED_ERROR_INVSTATE;
+            goto err;
+        }
+#endif
+        errcode = ep->pingpong_handler(dev_id, size, ep_id, buf);
+    }
+    /* the buffer is released: queue it again, behind the other half */
+    req.len = ep->pingpong_size;
+    if (usbctrl_xfer_push(ctx, ep_id, &req) != MBED_ERROR_NONE) {
+        log_printf("[USBCTRL] unable to re-arm ping-pong buffer on EP %x\n", ep_id);
+    }
+err:
+    return errcode;
+}
+
+/*
+ * About isochronous IN double buffering.
+ *
+ * An isochronous IN EP sends one packet per frame. The two pingpong_buf halves
+ * are queued as two single packet transfers: while one of them is sent, the
+ * other one is ready for the next frame. When a frame buffer is sent, the transfer
+ * engine starts the other one at once, and the completion handler below fills the
+ * released half for the frame after, then queues it again. The stream does not
+ * miss a frame as long as the fill handler returns within a frame.
+ * Feedback EPs are filled by the libusbctrl with the current feedback value,
+ * encoded for the negotiated port speed.
+ */
+
+/*@
+    @ requires \valid(ctx) && \valid(ep) && \valid(buf + (0 .. ep->pingpong_size-1));
+*/
+#ifndef __FRAMAC__
+static
+#endif
+uint16_t usbctrl_xfer_iso_fill(usbctrl_context_t *ctx,
+                               usb_ep_infos_t    *ep,
+                               uint8_t           *buf)
+{
+    uint16_t size = ep->pingpong_size;
+    uint16_t len = 0;
+
+    if (size > ep->pkt_maxsize) {
+        size = ep->pkt_maxsize;
+    }
+    if (ep->iso_fill_handler == NULL) {
+        /* feedback EP, little endian value */
+        uint32_t rate = usbctrl_load_acquire(&(ep->iso_feedback));
+        if (ctx->speed == USB_BACKEND_DRV_PORT_HIGHSPEED) {
+            len = USBCTRL_ISO_FEEDBACK_HS_LEN;
+        } else {
+            /* 16.16 to 10.14 */
+            rate >>= 2;
+            len = USBCTRL_ISO_FEEDBACK_FS_LEN;
+        }
+        for (uint8_t i = 0; i < len; ++i) {
+            buf[i] = (uint8_t)((rate >> (8 * i)) & 0xff);
+        }
+        goto err;
+    }
+#ifndef __FRAMAC__
+    if (handler_sanity_check((physaddr_t)ep->iso_fill_handler)) {
+        goto err;
+    }
+#endif
+    len = ep->iso_fill_handler(ctx->dev_id, ep->ep_num, buf, size);
+    if (len > size) {
+        log_printf("[USBCTRL] iso EP %d: frame buffer overflow\n", ep->ep_num);
+        len = size;
+    }
+err:
+    return len;
+}
+
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_xfer_iso_complete(uint32_t dev_id,
+                                       uint32_t size __attribute__((unused)),
+                                       uint8_t  ep_id,
+                                       void    *cookie)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usbctrl_context_t *ctx = NULL;
+    usb_ep_infos_t *ep = NULL;
+    uint8_t *buf = (uint8_t*)cookie;
+    usbctrl_xfer_t req = { buf, 0, 0, usbctrl_xfer_iso_complete, buf, NULL, 0 };
+
+    if (usbctrl_get_context(dev_id, &ctx) != MBED_ERROR_NONE ||
+        (ep = usbctrl_xfer_pingpong_ep(ctx, ep_id | USBCTRL_EP_ADDR_DIR_IN)) == NULL ||
+        ep->pingpong_buf == NULL) {
+        errcode = MBED_ERROR_INVSTATE;
+        goto err;
+    }
+    /* the other half is being sent: fill this one for the next frame */
+    req.len = usbctrl_xfer_iso_fill(ctx, ep, buf);
+    errcode = usbctrl_xfer_push(ctx, ep_id | USBCTRL_EP_ADDR_DIR_IN, &req);
+    if (errcode != MBED_ERROR_NONE) {
+        log_printf("[USBCTRL] unable to queue iso frame buffer on EP %x\n", ep_id);
+    }
+err:
+    return errcode;
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_xfer_iso_set_feedback(usbctrl_context_t *ctx,
+                                           uint8_t            ep_addr,
+                                           uint32_t           rate)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+    usb_ep_infos_t *ep = usbctrl_xfer_pingpong_ep(ctx, ep_addr);
+
+    if (ep == NULL || ep->type != USB_EP_TYPE_ISOCHRONOUS ||
+        ep->usage != USB_EP_USAGE_FEEDBACK || ep->iso_fill_handler != NULL) {
+        errcode = MBED_ERROR_INVPARAM;
+        goto err;
+    }
+    /* single word, read when the next frame buffer is filled */
+    usbctrl_store_release(&(ep->iso_feedback), rate);
+err:
+    return errcode;
+}
+
+/*@
+    @ requires \valid(ctx) && \valid(ep);
+    @ ensures is_valid_error(\result) ;
+*/
+#ifndef __FRAMAC__
+static
+#endif
+mbed_error_t usbctrl_xfer_start_iso(usbctrl_context_t *ctx,
+                                    usb_ep_infos_t    *ep)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    /*@
+      @ loop invariant 0 <= i <= 2 ;
+      @ loop assigns i, errcode, *ctx ;
+      @ loop variant (2 - i) ;
+      */
+    for (uint8_t i = 0; i < 2; ++i) {
+        uint8_t *buf = &(ep->pingpong_buf[i * ep->pingpong_size]);
+        usbctrl_xfer_t req = { buf, 0, 0, usbctrl_xfer_iso_complete, buf, NULL, 0 };
+        req.len = usbctrl_xfer_iso_fill(ctx, ep, buf);
+        errcode = usbctrl_xfer_push(ctx, ep->ep_num | USBCTRL_EP_ADDR_DIR_IN, &req);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+err:
+    return errcode;
+}
+
+/*@
+    @ requires \valid(ctx) && \valid(ep);
+    @ ensures is_valid_error(\result) ;
+*/
+mbed_error_t usbctrl_xfer_start_pingpong(usbctrl_context_t *ctx,
+                                         usb_ep_infos_t    *ep)
+{
+    mbed_error_t errcode = MBED_ERROR_NONE;
+
+    if (ep->pingpong_buf == NULL) {
+        goto err;
+    }
+    if (ep->dir == USB_EP_DIR_IN) {
+        errcode = usbctrl_xfer_start_iso(ctx, ep);
+        goto err;
+    }
+    /*@
+      @ loop invariant 0 <= i <= 2 ;
+      @ loop assigns i, errcode, *ctx ;
+      @ loop variant (2 - i) ;
+      */
+    for (uint8_t i = 0; i < 2; ++i) {
+        uint8_t *buf = &(ep->pingpong_buf[i * ep->pingpong_size]);
+        usbctrl_xfer_t req = { buf, ep->pingpong_size, 0, usbctrl_xfer_pingpong_complete, buf, NULL, 0 };
+        errcode = usbctrl_xfer_push(ctx, ep->ep_num, &req);
+        if (errcode != MBED_ERROR_NONE) {
+            goto err;
+        }
+    }
+err:
+    return errcode;
+}
+
+/*@
+    @ requires \valid(ctx);
+*/
+bool usbctrl_xfer_in_complete(usbctrl_context_t *ctx,
+                              uint8_t            ep,
+                              uint32_t           size __attribute__((unused)))
+{
+    uint8_t ep_addr = (ep & 0xf) | USBCTRL_EP_ADDR_DIR_IN;
+    usbctrl_xfer_queue_t *queue = &(ctx->xfer_queue[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]);
+    usbctrl_ep_entry_t *entry = NULL;
+    usbctrl_xfer_t *xfer = NULL;
+
+    if (queue->tail == queue->head) {
+        /* no submitted transfer, the EP is driven by the upper layer */
+        return false;
+    }
+    xfer = &(queue->xfer[queue->tail & USBCTRL_XFER_QUEUE_MASK]);
+    if (queue->zlp == false) {
+        queue->offset += queue->chunk;
+        if (queue->offset < xfer->len) {
+            /* next packet */
+            if (usbctrl_xfer_start(ctx, ep_addr, queue) != MBED_ERROR_NONE) {
+                log_printf("[USBCTRL] unable to continue transfer on EP %x\n", ep_addr);
+            }
+            return true;
+        }
+        entry = usbctrl_get_endpoint_entry(ctx, ep_addr);
+        if ((xfer->flags & USBCTRL_XFER_FLAG_ZLP) && entry != NULL &&
+            (xfer->len % usbctrl_xfer_mpsize(ctx, entry)) == 0) {
+            /* the host can't detect the end of the transfer by itself */
+            queue->zlp = true;
+            usbctrl_drv_send_zlp(ctx, ep & 0xf);
+            return true;
+        }
+    }
+    usbctrl_xfer_complete(ctx, ep_addr, queue, xfer->len);
+    return true;
+}
+
+/*@
+    @ requires \valid(ctx);
+*/
+bool usbctrl_xfer_out_complete(usbctrl_context_t *ctx,
+                               uint8_t            ep,
+                               uint32_t           size)
+{
+    uint8_t ep_addr = ep & 0xf;
+    usbctrl_xfer_queue_t *queue = &(ctx->xfer_queue[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]);
+    usbctrl_ep_entry_t *entry = NULL;
+    usbctrl_xfer_t *xfer = NULL;
+
+    if (queue->tail == queue->head) {
+        /* no submitted transfer, the EP is driven by the upper layer */
+        return false;
+    }
+    xfer = &(queue->xfer[queue->tail & USBCTRL_XFER_QUEUE_MASK]);
+    if (size > xfer->len - queue->offset) {
+        size = xfer->len - queue->offset;
+    }
+    queue->offset += size;
+    entry = usbctrl_get_endpoint_entry(ctx, ep_addr);
+    if (queue->offset < xfer->len && size != 0 && entry != NULL &&
+        (size % usbctrl_xfer_mpsize(ctx, entry)) == 0) {
+        /* full packets received, the transfer continues */
+        if (usbctrl_xfer_start(ctx, ep_addr, queue) != MBED_ERROR_NONE) {
+            log_printf("[USBCTRL] unable to continue transfer on EP %x\n", ep_addr);
+        }
+        return true;
+    }
+    /* complete, or short packet */
+    usbctrl_xfer_complete(ctx, ep_addr, queue, queue->offset);
+    return true;
+}
+
+/*@
+    @ requires \valid(queue);
+    @ assigns queue->head, queue->tail, queue->busy, queue->offset, queue->chunk, queue->zlp ;
+*/
+#ifndef __FRAMAC__
+static inline
+#endif
+void usbctrl_xfer_queue_reset(usbctrl_xfer_queue_t *queue)
+{
+    queue->head = 0;
+    queue->tail = 0;
+    queue->busy = 0;
+    queue->offset = 0;
+    queue->chunk = 0;
+    queue->zlp = false;
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->xfer_queue[0 .. USBCTRL_EP_TABLE_SIZE-1] ;
+*/
+void usbctrl_xfer_flush(usbctrl_context_t *ctx)
+{
+    /*@
+      @ loop invariant 0 <= i <= USBCTRL_EP_TABLE_SIZE ;
+      @ loop assigns i, ctx->xfer_queue[0 .. USBCTRL_EP_TABLE_SIZE-1] ;
+      @ loop variant (USBCTRL_EP_TABLE_SIZE - i) ;
+      */
+    for (uint8_t i = 0; i < USBCTRL_EP_TABLE_SIZE; ++i) {
+        usbctrl_xfer_queue_reset(&(ctx->xfer_queue[i]));
+    }
+}
+
+/*@
+    @ requires \valid(ctx);
+    @ assigns ctx->xfer_queue[0 .. USBCTRL_EP_TABLE_SIZE-1] ;
+*/
+void usbctrl_xfer_flush_ep(usbctrl_context_t *ctx, uint8_t ep_addr)
+{
+    usbctrl_xfer_queue_reset(&(ctx->xfer_queue[USBCTRL_EP_ADDR_TO_IDX(ep_addr)]));
+}
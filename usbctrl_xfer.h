@@ -0,0 +1,90 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+#ifndef USBCTRL_XFER_H_
+#define USBCTRL_XFER_H_
+
+#include "libc/types.h"
+#include "api/libusbctrl.h"
+#include "usbctrl.h"
+
+/*
+ * Endpoint transfers engine. Submitted transfers are queued per EP address, and
+ * sent (or received) packet per packet. The next transfer is started as soon as
+ * the current one is complete, from the EP event handler.
+ */
+
+mbed_error_t usbctrl_xfer_submit(usbctrl_context_t      *ctx,
+                                 uint8_t                 ep_addr,
+                                 uint8_t                *buf,
+                                 uint32_t                len,
+                                 uint32_t                flags,
+                                 usbctrl_xfer_handler_t  handler,
+                                 void                   *cookie);
+
+mbed_error_t usbctrl_xfer_submit_iov(usbctrl_context_t      *ctx,
+                                     uint8_t                 ep_addr,
+                                     const usbctrl_iovec_t  *iov,
+                                     uint8_t                 iovcnt,
+                                     uint32_t                flags,
+                                     usbctrl_xfer_handler_t  handler,
+                                     void                   *cookie);
+
+/*
+ * Arm the two reception buffers of a ping-pong OUT EP, or fill and queue the two
+ * frame buffers of a double buffered isochronous IN EP (no-op for other EPs)
+ */
+mbed_error_t usbctrl_xfer_start_pingpong(usbctrl_context_t *ctx,
+                                         usb_ep_infos_t    *ep);
+
+/*
+ * Set the rate sent by an isochronous feedback EP
+ */
+mbed_error_t usbctrl_xfer_iso_set_feedback(usbctrl_context_t *ctx,
+                                           uint8_t            ep_addr,
+                                           uint32_t           rate);
+
+/*
+ * IN (resp. OUT) EP event. Returns true if the event belongs to a submitted
+ * transfer (and has been handled), false otherwise.
+ */
+bool usbctrl_xfer_in_complete(usbctrl_context_t *ctx,
+                              uint8_t            ep,
+                              uint32_t           size);
+
+bool usbctrl_xfer_out_complete(usbctrl_context_t *ctx,
+                               uint8_t            ep,
+                               uint32_t           size);
+
+/*
+ * Drop all the pending transfers (configuration change, USB reset)
+ */
+void usbctrl_xfer_flush(usbctrl_context_t *ctx);
+
+/*
+ * Drop the pending transfers of a single EP address (interface alternate
+ * setting change)
+ */
+void usbctrl_xfer_flush_ep(usbctrl_context_t *ctx, uint8_t ep_addr);
+
+#endif/*!USBCTRL_XFER_H_*/